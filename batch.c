@@ -0,0 +1,1875 @@
+#include "batch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Lanes with the same input so far share a context. The contexts are run by
+ * their own copy of the core, in lockstep while they are at the same
+ * instructions, and one at a time otherwise. There is only one APU, so lanes
+ * have no sound. */
+#ifndef ENABLE_LCD
+# define ENABLE_LCD 1
+#endif
+
+#undef ENABLE_SOUND
+#define ENABLE_SOUND 0
+
+#define PEANUT_GB_ROM_READ batch_rom_read
+#define PEANUT_GB_CART_RAM_READ batch_cart_ram_read
+#define PEANUT_GB_CART_RAM_WRITE batch_cart_ram_write
+#define PEANUT_GB_ERROR batch_error
+
+#define PEANUT_GB_VARIANT batch
+#include "peanut_gb.h"
+
+/* Cycles in each frame. Every lane is run to the same cycle. */
+#define BATCH_FRAME_CYCLES 70224
+
+/* Each instruction in lockstep loops over every group, so a frame in lockstep
+ * only pays when nearly every group runs nearly every instruction in it. That
+ * is, when at least BATCH_MIN_SHARE eighths of the groups looped over run the
+ * instruction, and BATCH_MIN_LOCKSTEP instructions run in lockstep for each
+ * one stepped alone. This is checked every BATCH_CHECK_STEPS steps, and
+ * once it does not pay, groups are run alone for up to BATCH_MAX_BACKOFF
+ * frames before lockstep is tried again. */
+#ifndef BATCH_MIN_SHARE
+# define BATCH_MIN_SHARE 7
+#endif
+#ifndef BATCH_MIN_LOCKSTEP
+# define BATCH_MIN_LOCKSTEP 8
+#endif
+#ifndef BATCH_CHECK_STEPS
+# define BATCH_CHECK_STEPS 1024
+#endif
+#ifndef BATCH_MAX_BACKOFF
+# define BATCH_MAX_BACKOFF 64
+#endif
+
+/* Registers in the order that opcodes number them, with F in place of
+ * (HL). */
+enum
+{
+    BATCH_REG_B,
+    BATCH_REG_C,
+    BATCH_REG_D,
+    BATCH_REG_E,
+    BATCH_REG_H,
+    BATCH_REG_L,
+    BATCH_REG_F,
+    BATCH_REG_A,
+    BATCH_REG_COUNT
+};
+
+#define BATCH_FLAG_Z 0x80
+#define BATCH_FLAG_N 0x40
+#define BATCH_FLAG_H 0x20
+#define BATCH_FLAG_C 0x10
+
+/* Emulator context shared by lanes with the same input so far. */
+struct batch_group_s
+{
+    struct gb_s gb;
+    const batch_t *batch;
+    uint8_t *cart_ram;
+    size_t cart_ram_size;
+    /* Joypad state of the lanes in the group for the next frame. */
+    uint8_t joypad;
+    bool joypad_set;
+    bool crashed;
+    /* Group copied from during the current frame, or NULL, and its index. */
+    struct batch_group_s *parent;
+    size_t parent_index;
+    gb_pixel_t fb[LCD_HEIGHT][LCD_LINE_SIZE];
+};
+
+struct batch_s
+{
+    const uint8_t *rom;
+    size_t lanes;
+    /* Group of each lane, and its input. */
+    size_t *lane_group;
+    uint8_t *lane_joypad;
+    /* There are never more groups than lanes. */
+    struct batch_group_s **groups;
+    size_t group_count;
+
+    /* Registers of every group, as a structure of arrays. They are copied
+     * back to the context of a group whenever it is stepped alone, and at the
+     * end of each frame. */
+    uint8_t *r[BATCH_REG_COUNT];
+    uint16_t *sp;
+    uint16_t *pc;
+    /* Cycle count of each group, which is UINT64_MAX once it has crashed. */
+    uint64_t *cycles;
+    /* Cycles each group may run in lockstep before an event is due, the LCD
+     * changes mode or the frame ends. 0 if it has an interrupt to take. */
+    int32_t *budget;
+    /* ROM bank mapped at 0x4000 of each group. */
+    uint32_t *bank;
+
+    /* Cycles taken by each group for the current instruction, or 0 if it is
+     * not running it. */
+    uint8_t *run;
+    /* Operand, address and RAM of each group for the current instruction.
+     * ptr_hi is the second byte of 16-bit accesses. */
+    uint8_t *val;
+    uint16_t *addr;
+    uint8_t **ptr;
+    uint8_t **ptr_hi;
+
+    /* Instructions run by groups in lockstep and alone since lockstep was
+     * last tried, and the groups looped over to run them in lockstep. */
+    uint64_t lockstep_steps;
+    uint64_t alone_steps;
+    uint64_t lockstep_slots;
+    /* Frames left to run each group alone, and how many to run alone the
+     * next time that lockstep does not pay. */
+    unsigned alone_frames;
+    unsigned backoff;
+
+    uint64_t frame_end;
+};
+
+/* Most cycles of each instruction that can run in lockstep, or 0 for those
+ * that are stepped a group at a time. Those are the ones that halt, or may
+ * touch memory other than ROM, WRAM and HRAM. CB instructions are given by
+ * batch_cb_cycles(). */
+static const uint8_t batch_op_cycles[0x100] =
+{
+    /* *INDENT-OFF* */
+    /*0 1  2  3  4  5  6  7  8  9  A  B  C  D  E  F  */
+    4, 12, 8, 8, 4, 4, 8, 4, 0, 8, 8, 8, 4, 4, 8, 4,   /* 0x00 */
+    0, 12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,   /* 0x10 */
+   12, 12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,   /* 0x20 */
+   12, 12, 8, 8,12,12,12, 4,12, 8, 8, 8, 4, 4, 8, 4,   /* 0x30 */
+    4,  4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,   /* 0x40 */
+    4,  4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,   /* 0x50 */
+    4,  4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,   /* 0x60 */
+    8,  8, 8, 8, 8, 8, 0, 8, 4, 4, 4, 4, 4, 4, 8, 4,   /* 0x70 */
+    4,  4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,   /* 0x80 */
+    4,  4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,   /* 0x90 */
+    4,  4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,   /* 0xA0 */
+    4,  4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,   /* 0xB0 */
+   20, 12,16,16,24,16, 8,16,20,16,16, 0,24,24, 8,16,   /* 0xC0 */
+   20, 12,16, 0,24,16, 8,16,20,16,16, 0,24, 0, 8,16,   /* 0xD0 */
+   12, 12, 8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,   /* 0xE0 */
+   12, 12, 8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16    /* 0xF0 */
+    /* *INDENT-ON* */
+};
+
+static uint8_t batch_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+    const struct batch_group_s *const g = gb->direct.priv;
+    return g->batch->rom[addr];
+}
+
+static uint8_t batch_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+    const struct batch_group_s *const g = gb->direct.priv;
+    return g->cart_ram[addr];
+}
+
+static void batch_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+                                 const uint8_t val)
+{
+    const struct batch_group_s *const g = gb->direct.priv;
+    g->cart_ram[addr] = val;
+}
+
+/**
+ * Invalid opcodes are handled by __gb_step_cpu(), so this is only called for
+ * reads that cannot happen.
+ */
+static void batch_error(struct gb_s *gb, const enum gb_error_e gb_err,
+                        const uint16_t addr)
+{
+    (void)gb;
+    (void)gb_err;
+    (void)addr;
+    abort();
+}
+
+/**
+ * Returns the cycles that the group may run in lockstep. Only the CPU runs in
+ * lockstep, so nothing else may happen before the instruction ends.
+ */
+static int32_t batch_budget(const batch_t *batch, const struct gb_s *gb)
+{
+    const uint64_t cycles = gb->counter.cycles;
+    uint64_t left;
+    uint_fast32_t end;
+    uint_fast32_t count;
+
+    if (gb->gb_halt || (gb->gb_ime && gb->hram_io[IO_IF] &
+                                          gb->hram_io[IO_IE] & ANY_INTR))
+        return 0;
+
+    if (cycles >= batch->frame_end || cycles >= gb->counter.next_event)
+        return 0;
+
+    left = batch->frame_end - cycles;
+    if (gb->counter.next_event - cycles < left)
+        left = gb->counter.next_event - cycles;
+
+    if (!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
+    {
+        end = LCD_FRAME_CYCLES;
+        count = gb->counter.lcd_off_count;
+    }
+    else
+    {
+        switch (gb->hram_io[IO_STAT] & STAT_MODE)
+        {
+        case IO_STAT_MODE_OAM_SCAN:
+            end = LCD_MODE2_OAM_SCAN_END;
+            break;
+
+        case IO_STAT_MODE_LCD_DRAW:
+            end = LCD_MODE3_LCD_DRAW_END;
+            break;
+
+        default:
+            end = LCD_LINE_CYCLES;
+            break;
+        }
+
+        count = gb->counter.lcd_count;
+    }
+
+    if (count >= end)
+        return 0;
+
+    if (end - count < left)
+        left = end - count;
+
+    return (int32_t)left;
+}
+
+/**
+ * Copies the registers and counters of the group from its context.
+ */
+static void batch_load_group(batch_t *batch, size_t i)
+{
+    const struct gb_s *const gb = &batch->groups[i]->gb;
+
+    batch->r[BATCH_REG_B][i] = gb->cpu_reg.bc.bytes.b;
+    batch->r[BATCH_REG_C][i] = gb->cpu_reg.bc.bytes.c;
+    batch->r[BATCH_REG_D][i] = gb->cpu_reg.de.bytes.d;
+    batch->r[BATCH_REG_E][i] = gb->cpu_reg.de.bytes.e;
+    batch->r[BATCH_REG_H][i] = gb->cpu_reg.hl.bytes.h;
+    batch->r[BATCH_REG_L][i] = gb->cpu_reg.hl.bytes.l;
+    batch->r[BATCH_REG_F][i] = (uint8_t)(gb->cpu_reg.f.f_bits.z << 7 |
+                                         gb->cpu_reg.f.f_bits.n << 6 |
+                                         gb->cpu_reg.f.f_bits.h << 5 |
+                                         gb->cpu_reg.f.f_bits.c << 4);
+    batch->r[BATCH_REG_A][i] = gb->cpu_reg.a;
+    batch->sp[i] = gb->cpu_reg.sp.reg;
+    batch->pc[i] = gb->cpu_reg.pc.reg;
+    batch->cycles[i] = gb->counter.cycles;
+    batch->budget[i] = batch_budget(batch, gb);
+    batch->bank[i] = gb->selected_rom_bank |
+                     (uint32_t)gb->cart_mode_select << 16;
+}
+
+/**
+ * Copies the registers and counters of the group back to its context.
+ */
+static void batch_store_group(batch_t *batch, size_t i)
+{
+    struct gb_s *const gb = &batch->groups[i]->gb;
+    const uint8_t f = batch->r[BATCH_REG_F][i];
+    const uint_fast32_t ran =
+        (uint_fast32_t)(batch->cycles[i] - gb->counter.cycles);
+
+    gb->cpu_reg.bc.bytes.b = batch->r[BATCH_REG_B][i];
+    gb->cpu_reg.bc.bytes.c = batch->r[BATCH_REG_C][i];
+    gb->cpu_reg.de.bytes.d = batch->r[BATCH_REG_D][i];
+    gb->cpu_reg.de.bytes.e = batch->r[BATCH_REG_E][i];
+    gb->cpu_reg.hl.bytes.h = batch->r[BATCH_REG_H][i];
+    gb->cpu_reg.hl.bytes.l = batch->r[BATCH_REG_L][i];
+    gb->cpu_reg.f.f_bits.z = (f >> 7) & 1;
+    gb->cpu_reg.f.f_bits.n = (f >> 6) & 1;
+    gb->cpu_reg.f.f_bits.h = (f >> 5) & 1;
+    gb->cpu_reg.f.f_bits.c = (f >> 4) & 1;
+    gb->cpu_reg.a = batch->r[BATCH_REG_A][i];
+    gb->cpu_reg.sp.reg = batch->sp[i];
+    gb->cpu_reg.pc.reg = batch->pc[i];
+
+    /* No LCD mode ended in lockstep, so only its count moved on. */
+    if (gb->hram_io[IO_LCDC] & LCDC_ENABLE)
+        gb->counter.lcd_count += ran;
+    else
+        gb->counter.lcd_off_count += ran;
+
+    gb->counter.cycles = batch->cycles[i];
+}
+
+/**
+ * Returns the bit of pc in the filter of batch_run_group().
+ */
+static uint64_t batch_pc_bit(const uint16_t pc)
+{
+    return (uint64_t)1 << ((pc ^ pc >> 6) & 63);
+}
+
+/**
+ * Returns whether a group other than group i is waiting to run the instruction
+ * at pc of the given ROM bank this frame.
+ */
+static bool batch_shared(const batch_t *batch, const size_t i,
+                         const uint16_t pc, const uint32_t bank)
+{
+    const bool banked = pc >= ROM_BANK_SIZE - 2;
+    bool shared = false;
+    size_t j;
+
+    for (j = 0; j < batch->group_count; j++)
+        shared |= j != i && batch->pc[j] == pc &&
+                  batch->cycles[j] < batch->frame_end &&
+                  (!banked || batch->bank[j] == bank);
+
+    return shared;
+}
+
+/**
+ * Steps the group with the core until it gets to cycles until, or to a PC in
+ * the filter that another group is waiting at. Steps it at least once.
+ */
+static void batch_run_core(batch_t *batch, const size_t i, const uint64_t until,
+                           const uint64_t filter)
+{
+    struct gb_s *const gb = &batch->groups[i]->gb;
+
+    batch_store_group(batch, i);
+
+    do
+    {
+        __gb_step_cpu(gb);
+        batch->alone_steps++;
+
+        if (gb->stop_reason == GB_STOP_INVALID_OPCODE)
+        {
+            batch->groups[i]->crashed = true;
+            gb->counter.deadline = UINT64_MAX;
+            gb->stop_events = 0;
+            batch->cycles[i] = UINT64_MAX;
+            batch->budget[i] = 0;
+            return;
+        }
+    } while (gb->counter.cycles < until &&
+             (!(filter & batch_pc_bit(gb->cpu_reg.pc.reg)) ||
+              !batch_shared(batch, i, gb->cpu_reg.pc.reg,
+                            gb->selected_rom_bank |
+                                (uint32_t)gb->cart_mode_select << 16)));
+
+    batch_load_group(batch, i);
+}
+
+/**
+ * Steps the group, which cannot run in lockstep, with the core. A group that
+ * other groups are waiting with is stepped until it is no longer the furthest
+ * behind, so that they catch up with it, and the groups that are level with it
+ * are stepped over the instruction too. A group that is alone runs until it
+ * reaches an instruction that another group is waiting at, or the end of the
+ * frame.
+ */
+static void batch_run_group(batch_t *batch, const size_t i)
+{
+    const uint16_t pc = batch->pc[i];
+    const uint32_t bank = batch->bank[i];
+    const uint64_t cycles = batch->cycles[i];
+    uint64_t until = batch->frame_end;
+    /* The other groups wait while this one runs, so a filter of their PCs
+     * spares looking through them after most instructions. */
+    uint64_t filter = 0;
+    size_t j;
+
+    if (batch_shared(batch, i, pc, bank))
+    {
+        const bool banked = pc >= ROM_BANK_SIZE - 2;
+
+        for (j = 0; j < batch->group_count; j++)
+            if (j != i && batch->cycles[j] < until)
+                until = batch->cycles[j];
+
+        batch_run_core(batch, i, until, 0);
+
+        for (j = 0; j < batch->group_count; j++)
+            if (j != i && batch->pc[j] == pc && batch->cycles[j] == cycles &&
+                (!banked || batch->bank[j] == bank))
+                batch_run_core(batch, j, 0, 0);
+
+        return;
+    }
+
+    for (j = 0; j < batch->group_count; j++)
+        if (j != i && batch->cycles[j] < batch->frame_end)
+            filter |= batch_pc_bit(batch->pc[j]);
+
+    batch_run_core(batch, i, batch->frame_end, filter);
+}
+
+/**
+ * Returns where addr is in the WRAM or HRAM of the group, or NULL if it is
+ * elsewhere, which only a group stepped alone may access.
+ */
+static uint8_t *batch_ram(struct gb_s *gb, const uint16_t addr)
+{
+    if (addr >= WRAM_0_ADDR && addr < ECHO_ADDR)
+        return &gb->wram[addr - WRAM_0_ADDR];
+
+    if (addr >= HRAM_ADDR && addr < INTR_EN_ADDR)
+        return &gb->hram_io[addr - IO_ADDR];
+
+    return NULL;
+}
+
+/**
+ * Finds batch->addr in the RAM of each running group, and stops the groups
+ * where it is elsewhere. Returns whether the leader still runs.
+ */
+static bool batch_map(batch_t *batch, uint8_t **ptr, const size_t leader)
+{
+    size_t i;
+
+    for (i = 0; i < batch->group_count; i++)
+    {
+        if (!batch->run[i])
+            continue;
+
+        ptr[i] = batch_ram(&batch->groups[i]->gb, batch->addr[i]);
+        if (ptr[i] == NULL)
+            batch->run[i] = 0;
+    }
+
+    return batch->run[leader] != 0;
+}
+
+/**
+ * Enables or disables interrupts on each running group. Groups that then have
+ * an interrupt to take stop running in lockstep.
+ */
+static void batch_set_ime(batch_t *batch, const bool ime)
+{
+    size_t i;
+
+    for (i = 0; i < batch->group_count; i++)
+    {
+        struct gb_s *const gb = &batch->groups[i]->gb;
+
+        if (!batch->run[i])
+            continue;
+
+        gb->gb_ime = ime;
+        if (ime && gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR)
+            batch->budget[i] = 0;
+    }
+}
+
+/**
+ * Returns the most cycles of the CB instruction.
+ */
+static uint8_t batch_cb_cycles(const uint8_t cbop)
+{
+    if ((cbop & 0x07) != 6)
+        return 8;
+
+    return (cbop & 0xC0) == 0x40 ? 12 : 16;
+}
+
+/**
+ * Returns whether the condition in bits 4-3 of a jump, call or return holds
+ * for the flags.
+ */
+static bool batch_cond(const uint8_t f, const uint8_t op)
+{
+    const uint8_t flag = (op & 0x10) ? BATCH_FLAG_C : BATCH_FLAG_Z;
+    return ((f & flag) != 0) == ((op & 0x08) != 0);
+}
+
+/**
+ * Runs ALU operation alu of bits 5-3 of the opcode on A and src.
+ */
+static void batch_alu(batch_t *batch, const unsigned alu, const uint8_t *src)
+{
+    uint8_t *const a = batch->r[BATCH_REG_A];
+    uint8_t *const f = batch->r[BATCH_REG_F];
+    const uint8_t *const run = batch->run;
+    const size_t n = batch->group_count;
+    size_t i;
+
+    switch (alu)
+    {
+    case 0: /* ADD */
+    case 1: /* ADC */
+    {
+        const uint8_t carry = alu == 1 ? BATCH_FLAG_C : 0;
+
+        for (i = 0; i < n; i++)
+        {
+            const unsigned t = a[i] + src[i] + ((f[i] & carry) != 0);
+            const uint8_t fl = (t > 0xFF ? BATCH_FLAG_C : 0) |
+                               ((a[i] ^ src[i] ^ t) & 0x10 ? BATCH_FLAG_H : 0) |
+                               ((t & 0xFF) == 0 ? BATCH_FLAG_Z : 0);
+            a[i] = run[i] ? (uint8_t)t : a[i];
+            f[i] = run[i] ? fl : f[i];
+        }
+
+        break;
+    }
+
+    case 2: /* SUB */
+    case 3: /* SBC */
+    case 7: /* CP */
+    {
+        const uint8_t carry = alu == 3 ? BATCH_FLAG_C : 0;
+        const bool store = alu != 7;
+
+        for (i = 0; i < n; i++)
+        {
+            const int t = a[i] - src[i] - ((f[i] & carry) != 0);
+            const uint8_t fl = (t < 0 ? BATCH_FLAG_C : 0) |
+                               ((a[i] ^ src[i] ^ t) & 0x10 ? BATCH_FLAG_H : 0) |
+                               BATCH_FLAG_N |
+                               ((t & 0xFF) == 0 ? BATCH_FLAG_Z : 0);
+            a[i] = run[i] && store ? (uint8_t)t : a[i];
+            f[i] = run[i] ? fl : f[i];
+        }
+
+        break;
+    }
+
+    case 4: /* AND */
+        for (i = 0; i < n; i++)
+        {
+            const uint8_t t = a[i] & src[i];
+            a[i] = run[i] ? t : a[i];
+            f[i] = run[i] ? (uint8_t)((t == 0 ? BATCH_FLAG_Z : 0) |
+                                      BATCH_FLAG_H)
+                          : f[i];
+        }
+
+        break;
+
+    case 5: /* XOR */
+        for (i = 0; i < n; i++)
+        {
+            const uint8_t t = a[i] ^ src[i];
+            a[i] = run[i] ? t : a[i];
+            f[i] = run[i] ? (t == 0 ? BATCH_FLAG_Z : 0) : f[i];
+        }
+
+        break;
+
+    default: /* OR */
+        for (i = 0; i < n; i++)
+        {
+            const uint8_t t = a[i] | src[i];
+            a[i] = run[i] ? t : a[i];
+            f[i] = run[i] ? (t == 0 ? BATCH_FLAG_Z : 0) : f[i];
+        }
+
+        break;
+    }
+}
+
+/**
+ * Runs CB instruction cbop on batch->val, which holds the operand of each
+ * group, and sets the flags.
+ */
+static void batch_cb(batch_t *batch, const uint8_t cbop)
+{
+    uint8_t *const v = batch->val;
+    uint8_t *const f = batch->r[BATCH_REG_F];
+    const uint8_t *const run = batch->run;
+    const size_t n = batch->group_count;
+    const unsigned b = (cbop >> 3) & 0x7;
+    size_t i;
+
+    switch (cbop >> 6)
+    {
+    case 0x0:
+        for (i = 0; i < n; i++)
+        {
+            const uint8_t x = v[i];
+            const uint8_t cin = (f[i] & BATCH_FLAG_C) != 0;
+            uint8_t t;
+            uint8_t c;
+
+            switch (b)
+            {
+            case 0: /* RLC */
+                t = (uint8_t)(x << 1 | x >> 7);
+                c = x >> 7;
+                break;
+
+            case 1: /* RRC */
+                t = (uint8_t)(x >> 1 | x << 7);
+                c = x & 1;
+                break;
+
+            case 2: /* RL */
+                t = (uint8_t)(x << 1 | cin);
+                c = x >> 7;
+                break;
+
+            case 3: /* RR */
+                t = (uint8_t)(x >> 1 | cin << 7);
+                c = x & 1;
+                break;
+
+            case 4: /* SLA */
+                t = (uint8_t)(x << 1);
+                c = x >> 7;
+                break;
+
+            case 5: /* SRA */
+                t = (uint8_t)(x >> 1 | (x & 0x80));
+                c = x & 1;
+                break;
+
+            case 6: /* SWAP */
+                t = (uint8_t)(x << 4 | x >> 4);
+                c = 0;
+                break;
+
+            default: /* SRL */
+                t = x >> 1;
+                c = x & 1;
+                break;
+            }
+
+            v[i] = t;
+            f[i] = run[i] ? (uint8_t)((t == 0 ? BATCH_FLAG_Z : 0) |
+                                      (c ? BATCH_FLAG_C : 0))
+                          : f[i];
+        }
+
+        break;
+
+    case 0x1: /* BIT */
+        for (i = 0; i < n; i++)
+        {
+            const uint8_t fl = (f[i] & BATCH_FLAG_C) | BATCH_FLAG_H |
+                               (((v[i] >> b) & 1) ? 0 : BATCH_FLAG_Z);
+            f[i] = run[i] ? fl : f[i];
+        }
+
+        break;
+
+    case 0x2: /* RES */
+        for (i = 0; i < n; i++)
+            v[i] &= (uint8_t)~(1 << b);
+
+        break;
+
+    default: /* SET */
+        for (i = 0; i < n; i++)
+            v[i] |= (uint8_t)(1 << b);
+
+        break;
+    }
+}
+
+/**
+ * Runs the instruction of the leader on every group with the same PC and ROM
+ * bank that can run it in lockstep. Each operation is a loop over every group,
+ * where groups that are not running keep their registers.
+ *
+ * Returns false, having changed nothing, if the leader must be stepped alone.
+ */
+static bool batch_step(batch_t *batch, const size_t leader)
+{
+    struct gb_s *const gb = &batch->groups[leader]->gb;
+    const size_t n = batch->group_count;
+    const uint16_t pc0 = batch->pc[leader];
+    uint8_t **const ptr = batch->ptr;
+    uint8_t **const ptr_hi = batch->ptr_hi;
+    uint16_t *const addr = batch->addr;
+    uint16_t *const pc = batch->pc;
+    uint16_t *const sp = batch->sp;
+    uint8_t *const run = batch->run;
+    uint8_t *const val = batch->val;
+    uint8_t *const a = batch->r[BATCH_REG_A];
+    uint8_t *const f = batch->r[BATCH_REG_F];
+    uint8_t *const h = batch->r[BATCH_REG_H];
+    uint8_t *const l = batch->r[BATCH_REG_L];
+    uint16_t next = pc0 + 1;
+    bool jump = false;
+    uint8_t op;
+    uint8_t n8;
+    uint16_t n16;
+    uint8_t max;
+    size_t count = 0;
+    size_t i;
+
+    /* The instruction must be read from ROM. */
+    if (pc0 > 0x7FFD || batch->budget[leader] <= 0)
+        return false;
+
+    op = __gb_read(gb, pc0);
+    n8 = __gb_read(gb, pc0 + 1);
+    max = op == 0xCB ? batch_cb_cycles(n8) : batch_op_cycles[op];
+    if (max == 0 || batch->budget[leader] <= max)
+        return false;
+
+    {
+        const bool banked = pc0 >= ROM_BANK_SIZE - 2;
+        const uint32_t bank = batch->bank[leader];
+
+        for (i = 0; i < n; i++)
+        {
+            run[i] = pc[i] == pc0 && batch->budget[i] > max &&
+                             (!banked || batch->bank[i] == bank)
+                         ? max
+                         : 0;
+            count += run[i] != 0;
+        }
+
+        /* A group alone is faster to step with the core. */
+        if (count < 2)
+            return false;
+    }
+
+    n16 = (uint16_t)(n8 | __gb_read(gb, pc0 + 2) << 8);
+
+    switch (op)
+    {
+    case 0x00: /* NOP */
+        break;
+
+    case 0x01: /* LD BC, imm */
+    case 0x11: /* LD DE, imm */
+    case 0x21: /* LD HL, imm */
+    {
+        uint8_t *const hi = batch->r[op >> 3];
+        uint8_t *const lo = batch->r[(op >> 3) + 1];
+
+        for (i = 0; i < n; i++)
+        {
+            hi[i] = run[i] ? (uint8_t)(n16 >> 8) : hi[i];
+            lo[i] = run[i] ? (uint8_t)n16 : lo[i];
+        }
+
+        next = pc0 + 3;
+        break;
+    }
+
+    case 0x31: /* LD SP, imm */
+        for (i = 0; i < n; i++)
+            sp[i] = run[i] ? n16 : sp[i];
+
+        next = pc0 + 3;
+        break;
+
+    case 0x02: /* LD (BC), A */
+    case 0x12: /* LD (DE), A */
+    case 0x0A: /* LD A, (BC) */
+    case 0x1A: /* LD A, (DE) */
+    {
+        const uint8_t *const hi = batch->r[(op >> 3) & 0x6];
+        const uint8_t *const lo = batch->r[((op >> 3) & 0x6) + 1];
+
+        for (i = 0; i < n; i++)
+            addr[i] = (uint16_t)(hi[i] << 8 | lo[i]);
+
+        if (!batch_map(batch, ptr, leader))
+            return false;
+
+        for (i = 0; i < n; i++)
+        {
+            if (!run[i])
+                continue;
+
+            if (op & 0x08)
+                a[i] = *ptr[i];
+            else
+                *ptr[i] = a[i];
+        }
+
+        break;
+    }
+
+    case 0x22: /* LDI (HL), A */
+    case 0x32: /* LDD (HL), A */
+    case 0x2A: /* LDI A, (HL) */
+    case 0x3A: /* LDD A, (HL) */
+    {
+        const uint16_t step = (op & 0x10) ? 0xFFFF : 1;
+
+        for (i = 0; i < n; i++)
+            addr[i] = (uint16_t)(h[i] << 8 | l[i]);
+
+        if (!batch_map(batch, ptr, leader))
+            return false;
+
+        for (i = 0; i < n; i++)
+        {
+            const uint16_t hl = (uint16_t)(addr[i] + step);
+
+            if (!run[i])
+                continue;
+
+            if (op & 0x08)
+                a[i] = *ptr[i];
+            else
+                *ptr[i] = a[i];
+
+            h[i] = (uint8_t)(hl >> 8);
+            l[i] = (uint8_t)hl;
+        }
+
+        break;
+    }
+
+    case 0x03: /* INC BC */
+    case 0x13: /* INC DE */
+    case 0x23: /* INC HL */
+    case 0x0B: /* DEC BC */
+    case 0x1B: /* DEC DE */
+    case 0x2B: /* DEC HL */
+    {
+        uint8_t *const hi = batch->r[(op >> 3) & 0x6];
+        uint8_t *const lo = batch->r[((op >> 3) & 0x6) + 1];
+        const uint16_t step = (op & 0x08) ? 0xFFFF : 1;
+
+        for (i = 0; i < n; i++)
+        {
+            const uint16_t t = (uint16_t)((hi[i] << 8 | lo[i]) + step);
+            hi[i] = run[i] ? (uint8_t)(t >> 8) : hi[i];
+            lo[i] = run[i] ? (uint8_t)t : lo[i];
+        }
+
+        break;
+    }
+
+    case 0x33: /* INC SP */
+    case 0x3B: /* DEC SP */
+    {
+        const uint16_t step = (op & 0x08) ? 0xFFFF : 1;
+
+        for (i = 0; i < n; i++)
+            sp[i] = run[i] ? (uint16_t)(sp[i] + step) : sp[i];
+
+        break;
+    }
+
+    case 0x04: /* INC B */
+    case 0x0C: /* INC C */
+    case 0x14: /* INC D */
+    case 0x1C: /* INC E */
+    case 0x24: /* INC H */
+    case 0x2C: /* INC L */
+    case 0x3C: /* INC A */
+    {
+        uint8_t *const r = batch->r[op >> 3];
+
+        for (i = 0; i < n; i++)
+        {
+            const uint8_t t = r[i] + 1;
+            const uint8_t fl = (f[i] & BATCH_FLAG_C) |
+                               ((t & 0x0F) == 0 ? BATCH_FLAG_H : 0) |
+                               (t == 0 ? BATCH_FLAG_Z : 0);
+            r[i] = run[i] ? t : r[i];
+            f[i] = run[i] ? fl : f[i];
+        }
+
+        break;
+    }
+
+    case 0x05: /* DEC B */
+    case 0x0D: /* DEC C */
+    case 0x15: /* DEC D */
+    case 0x1D: /* DEC E */
+    case 0x25: /* DEC H */
+    case 0x2D: /* DEC L */
+    case 0x3D: /* DEC A */
+    {
+        uint8_t *const r = batch->r[op >> 3];
+
+        for (i = 0; i < n; i++)
+        {
+            const uint8_t t = r[i] - 1;
+            const uint8_t fl = (f[i] & BATCH_FLAG_C) | BATCH_FLAG_N |
+                               ((t & 0x0F) == 0x0F ? BATCH_FLAG_H : 0) |
+                               (t == 0 ? BATCH_FLAG_Z : 0);
+            r[i] = run[i] ? t : r[i];
+            f[i] = run[i] ? fl : f[i];
+        }
+
+        break;
+    }
+
+    case 0x34: /* INC (HL) */
+    case 0x35: /* DEC (HL) */
+    case 0x36: /* LD (HL), imm */
+        for (i = 0; i < n; i++)
+            addr[i] = (uint16_t)(h[i] << 8 | l[i]);
+
+        if (!batch_map(batch, ptr, leader))
+            return false;
+
+        for (i = 0; i < n; i++)
+        {
+            uint8_t t;
+
+            if (!run[i])
+                continue;
+
+            if (op == 0x36)
+            {
+                *ptr[i] = n8;
+                continue;
+            }
+
+            if (op == 0x34)
+            {
+                t = *ptr[i] + 1;
+                f[i] = (f[i] & BATCH_FLAG_C) |
+                       ((t & 0x0F) == 0 ? BATCH_FLAG_H : 0);
+            }
+            else
+            {
+                t = *ptr[i] - 1;
+                f[i] = (f[i] & BATCH_FLAG_C) | BATCH_FLAG_N |
+                       ((t & 0x0F) == 0x0F ? BATCH_FLAG_H : 0);
+            }
+
+            f[i] |= t == 0 ? BATCH_FLAG_Z : 0;
+            *ptr[i] = t;
+        }
+
+        next = op == 0x36 ? pc0 + 2 : pc0 + 1;
+        break;
+
+    case 0x06: /* LD B, imm */
+    case 0x0E: /* LD C, imm */
+    case 0x16: /* LD D, imm */
+    case 0x1E: /* LD E, imm */
+    case 0x26: /* LD H, imm */
+    case 0x2E: /* LD L, imm */
+    case 0x3E: /* LD A, imm */
+    {
+        uint8_t *const r = batch->r[op >> 3];
+
+        for (i = 0; i < n; i++)
+            r[i] = run[i] ? n8 : r[i];
+
+        next = pc0 + 2;
+        break;
+    }
+
+    case 0x07: /* RLCA */
+    case 0x0F: /* RRCA */
+    case 0x17: /* RLA */
+    case 0x1F: /* RRA */
+        for (i = 0; i < n; i++)
+        {
+            const uint8_t x = a[i];
+            const uint8_t cin = (f[i] & BATCH_FLAG_C) != 0;
+            uint8_t t;
+            uint8_t c;
+
+            switch (op)
+            {
+            case 0x07:
+                t = (uint8_t)(x << 1 | x >> 7);
+                c = x >> 7;
+                break;
+
+            case 0x0F:
+                t = (uint8_t)(x >> 1 | x << 7);
+                c = x & 1;
+                break;
+
+            case 0x17:
+                t = (uint8_t)(x << 1 | cin);
+                c = x >> 7;
+                break;
+
+            default:
+                t = (uint8_t)(x >> 1 | cin << 7);
+                c = x & 1;
+                break;
+            }
+
+            a[i] = run[i] ? t : a[i];
+            f[i] = run[i] ? (c ? BATCH_FLAG_C : 0) : f[i];
+        }
+
+        break;
+
+    case 0x09: /* ADD HL, BC */
+    case 0x19: /* ADD HL, DE */
+    case 0x29: /* ADD HL, HL */
+    case 0x39: /* ADD HL, SP */
+    {
+        const uint8_t *const hi = batch->r[(op >> 3) & 0x6];
+        const uint8_t *const lo = batch->r[((op >> 3) & 0x6) + 1];
+
+        for (i = 0; i < n; i++)
+        {
+            const unsigned hl = (unsigned)(h[i] << 8 | l[i]);
+            const unsigned rr = op == 0x39 ? sp[i]
+                                           : (unsigned)(hi[i] << 8 | lo[i]);
+            const unsigned t = hl + rr;
+            const uint8_t fl = (f[i] & BATCH_FLAG_Z) |
+                               ((t ^ hl ^ rr) & 0x1000 ? BATCH_FLAG_H : 0) |
+                               (t > 0xFFFF ? BATCH_FLAG_C : 0);
+            h[i] = run[i] ? (uint8_t)(t >> 8) : h[i];
+            l[i] = run[i] ? (uint8_t)t : l[i];
+            f[i] = run[i] ? fl : f[i];
+        }
+
+        break;
+    }
+
+    case 0x18: /* JR imm */
+    case 0x20: /* JR NZ, imm */
+    case 0x28: /* JR Z, imm */
+    case 0x30: /* JR NC, imm */
+    case 0x38: /* JR C, imm */
+    {
+        const uint16_t to = (uint16_t)(pc0 + 2 + (int8_t)n8);
+
+        for (i = 0; i < n; i++)
+        {
+            const bool taken = op == 0x18 || batch_cond(f[i], op);
+            pc[i] = run[i] ? (taken ? to : (uint16_t)(pc0 + 2)) : pc[i];
+            run[i] -= run[i] && !taken ? 4 : 0;
+        }
+
+        jump = true;
+        break;
+    }
+
+    case 0x27: /* DAA */
+        for (i = 0; i < n; i++)
+        {
+            int t = a[i];
+            uint8_t fl = f[i] & (BATCH_FLAG_N | BATCH_FLAG_C);
+
+            if (f[i] & BATCH_FLAG_N)
+            {
+                if (f[i] & BATCH_FLAG_H)
+                    t = (t - 0x06) & 0xFF;
+
+                if (f[i] & BATCH_FLAG_C)
+                    t -= 0x60;
+            }
+            else
+            {
+                if ((f[i] & BATCH_FLAG_H) || (t & 0x0F) > 9)
+                    t += 0x06;
+
+                if ((f[i] & BATCH_FLAG_C) || t > 0x9F)
+                    t += 0x60;
+            }
+
+            if (t & 0x100)
+                fl |= BATCH_FLAG_C;
+
+            fl |= (t & 0xFF) == 0 ? BATCH_FLAG_Z : 0;
+            a[i] = run[i] ? (uint8_t)t : a[i];
+            f[i] = run[i] ? fl : f[i];
+        }
+
+        break;
+
+    case 0x2F: /* CPL */
+        for (i = 0; i < n; i++)
+        {
+            a[i] = run[i] ? (uint8_t)~a[i] : a[i];
+            f[i] = run[i] ? f[i] | BATCH_FLAG_N | BATCH_FLAG_H : f[i];
+        }
+
+        break;
+
+    case 0x37: /* SCF */
+        for (i = 0; i < n; i++)
+            f[i] = run[i] ? (f[i] & BATCH_FLAG_Z) | BATCH_FLAG_C : f[i];
+
+        break;
+
+    case 0x3F: /* CCF */
+        for (i = 0; i < n; i++)
+            f[i] = run[i] ? (f[i] & (BATCH_FLAG_Z | BATCH_FLAG_C)) ^
+                                BATCH_FLAG_C
+                          : f[i];
+
+        break;
+
+    case 0xC6: /* ADD A, imm */
+    case 0xCE: /* ADC A, imm */
+    case 0xD6: /* SUB imm */
+    case 0xDE: /* SBC A, imm */
+    case 0xE6: /* AND imm */
+    case 0xEE: /* XOR imm */
+    case 0xF6: /* OR imm */
+    case 0xFE: /* CP imm */
+        memset(val, n8, n);
+        batch_alu(batch, (op >> 3) & 0x7, val);
+        next = pc0 + 2;
+        break;
+
+    case 0xC3: /* JP imm */
+    case 0xC2: /* JP NZ, imm */
+    case 0xCA: /* JP Z, imm */
+    case 0xD2: /* JP NC, imm */
+    case 0xDA: /* JP C, imm */
+        for (i = 0; i < n; i++)
+        {
+            const bool taken = op == 0xC3 || batch_cond(f[i], op);
+            pc[i] = run[i] ? (taken ? n16 : (uint16_t)(pc0 + 3)) : pc[i];
+            run[i] -= run[i] && !taken ? 4 : 0;
+        }
+
+        jump = true;
+        break;
+
+    case 0xE9: /* JP (HL) */
+        for (i = 0; i < n; i++)
+            pc[i] = run[i] ? (uint16_t)(h[i] << 8 | l[i]) : pc[i];
+
+        jump = true;
+        break;
+
+    case 0xF3: /* DI */
+    case 0xFB: /* EI */
+        batch_set_ime(batch, op == 0xFB);
+        break;
+
+    case 0xF9: /* LD SP, HL */
+        for (i = 0; i < n; i++)
+            sp[i] = run[i] ? (uint16_t)(h[i] << 8 | l[i]) : sp[i];
+
+        break;
+
+    case 0xE8: /* ADD SP, imm */
+    case 0xF8: /* LD HL, SP+/-imm */
+        for (i = 0; i < n; i++)
+        {
+            const uint16_t t = (uint16_t)(sp[i] + (int8_t)n8);
+            const uint8_t fl =
+                ((sp[i] & 0xF) + (n8 & 0xF) > 0xF ? BATCH_FLAG_H : 0) |
+                ((sp[i] & 0xFF) + n8 > 0xFF ? BATCH_FLAG_C : 0);
+
+            if (op == 0xE8)
+            {
+                sp[i] = run[i] ? t : sp[i];
+            }
+            else
+            {
+                h[i] = run[i] ? (uint8_t)(t >> 8) : h[i];
+                l[i] = run[i] ? (uint8_t)t : l[i];
+            }
+
+            f[i] = run[i] ? fl : f[i];
+        }
+
+        next = pc0 + 2;
+        break;
+
+    case 0xE0: /* LD (0xFF00+imm), A */
+    case 0xF0: /* LD A, (0xFF00+imm) */
+    case 0xE2: /* LD (C), A */
+    case 0xF2: /* LD A, (C) */
+    case 0xEA: /* LD (imm), A */
+    case 0xFA: /* LD A, (imm) */
+    {
+        const uint8_t *const c = batch->r[BATCH_REG_C];
+
+        for (i = 0; i < n; i++)
+        {
+            switch (op & 0x0F)
+            {
+            case 0x0:
+                addr[i] = 0xFF00 | n8;
+                break;
+
+            case 0x2:
+                addr[i] = 0xFF00 | c[i];
+                break;
+
+            default:
+                addr[i] = n16;
+                break;
+            }
+        }
+
+        if (!batch_map(batch, ptr, leader))
+            return false;
+
+        for (i = 0; i < n; i++)
+        {
+            if (!run[i])
+                continue;
+
+            if (op & 0x10)
+                a[i] = *ptr[i];
+            else
+                *ptr[i] = a[i];
+        }
+
+        next = pc0 + ((op & 0x0F) == 0x0 ? 2 : (op & 0x0F) == 0x2 ? 1 : 3);
+        break;
+    }
+
+    case 0xC1: /* POP BC */
+    case 0xD1: /* POP DE */
+    case 0xE1: /* POP HL */
+    case 0xF1: /* POP AF */
+    case 0xC9: /* RET */
+    case 0xD9: /* RETI */
+        for (i = 0; i < n; i++)
+            addr[i] = sp[i];
+
+        if (!batch_map(batch, ptr, leader))
+            return false;
+
+        for (i = 0; i < n; i++)
+            addr[i] = (uint16_t)(sp[i] + 1);
+
+        if (!batch_map(batch, ptr_hi, leader))
+            return false;
+
+        for (i = 0; i < n; i++)
+        {
+            if (!run[i])
+                continue;
+
+            switch (op)
+            {
+            case 0xC9:
+            case 0xD9:
+                pc[i] = (uint16_t)(*ptr_hi[i] << 8 | *ptr[i]);
+                break;
+
+            case 0xF1:
+                f[i] = *ptr[i] & 0xF0;
+                a[i] = *ptr_hi[i];
+                break;
+
+            default:
+                batch->r[(op >> 3) & 0x6][i] = *ptr_hi[i];
+                batch->r[((op >> 3) & 0x6) + 1][i] = *ptr[i];
+                break;
+            }
+
+            sp[i] += 2;
+        }
+
+        if (op == 0xD9)
+            batch_set_ime(batch, true);
+
+        jump = op == 0xC9 || op == 0xD9;
+        break;
+
+    case 0xC0: /* RET NZ */
+    case 0xC8: /* RET Z */
+    case 0xD0: /* RET NC */
+    case 0xD8: /* RET C */
+        /* Only groups that return read the stack. */
+        for (i = 0; i < n; i++)
+        {
+            if (!run[i] || !batch_cond(f[i], op))
+                continue;
+
+            ptr[i] = batch_ram(&batch->groups[i]->gb, sp[i]);
+            ptr_hi[i] = batch_ram(&batch->groups[i]->gb, (uint16_t)(sp[i] + 1));
+            if (ptr[i] == NULL || ptr_hi[i] == NULL)
+                run[i] = 0;
+        }
+
+        if (!run[leader])
+            return false;
+
+        for (i = 0; i < n; i++)
+        {
+            if (!run[i])
+                continue;
+
+            if (!batch_cond(f[i], op))
+            {
+                pc[i] = pc0 + 1;
+                run[i] -= 12;
+                continue;
+            }
+
+            pc[i] = (uint16_t)(*ptr_hi[i] << 8 | *ptr[i]);
+            sp[i] += 2;
+        }
+
+        jump = true;
+        break;
+
+    case 0xC5: /* PUSH BC */
+    case 0xD5: /* PUSH DE */
+    case 0xE5: /* PUSH HL */
+    case 0xF5: /* PUSH AF */
+    case 0xCD: /* CALL imm */
+    case 0xC7: /* RST 0x0000 */
+    case 0xCF: /* RST 0x0008 */
+    case 0xD7: /* RST 0x0010 */
+    case 0xDF: /* RST 0x0018 */
+    case 0xE7: /* RST 0x0020 */
+    case 0xEF: /* RST 0x0028 */
+    case 0xF7: /* RST 0x0030 */
+    case 0xFF: /* RST 0x0038 */
+        for (i = 0; i < n; i++)
+            addr[i] = (uint16_t)(sp[i] - 2);
+
+        if (!batch_map(batch, ptr, leader))
+            return false;
+
+        for (i = 0; i < n; i++)
+            addr[i] = (uint16_t)(sp[i] - 1);
+
+        if (!batch_map(batch, ptr_hi, leader))
+            return false;
+
+        for (i = 0; i < n; i++)
+        {
+            uint16_t push;
+
+            if (!run[i])
+                continue;
+
+            switch (op)
+            {
+            case 0xF5:
+                push = (uint16_t)(a[i] << 8 | (f[i] & 0xF0));
+                break;
+
+            case 0xCD:
+                push = pc0 + 3;
+                pc[i] = n16;
+                break;
+
+            case 0xC5:
+            case 0xD5:
+            case 0xE5:
+                push = (uint16_t)(batch->r[(op >> 3) & 0x6][i] << 8 |
+                                  batch->r[((op >> 3) & 0x6) + 1][i]);
+                break;
+
+            default:
+                push = pc0 + 1;
+                pc[i] = op & 0x38;
+                break;
+            }
+
+            *ptr_hi[i] = (uint8_t)(push >> 8);
+            *ptr[i] = (uint8_t)push;
+            sp[i] -= 2;
+        }
+
+        jump = op == 0xCD || (op & 0x07) == 0x07;
+        break;
+
+    case 0xC4: /* CALL NZ, imm */
+    case 0xCC: /* CALL Z, imm */
+    case 0xD4: /* CALL NC, imm */
+    case 0xDC: /* CALL C, imm */
+        /* Only groups that call write the stack. */
+        for (i = 0; i < n; i++)
+        {
+            if (!run[i] || !batch_cond(f[i], op))
+                continue;
+
+            ptr[i] = batch_ram(&batch->groups[i]->gb, (uint16_t)(sp[i] - 2));
+            ptr_hi[i] = batch_ram(&batch->groups[i]->gb, (uint16_t)(sp[i] - 1));
+            if (ptr[i] == NULL || ptr_hi[i] == NULL)
+                run[i] = 0;
+        }
+
+        if (!run[leader])
+            return false;
+
+        for (i = 0; i < n; i++)
+        {
+            if (!run[i])
+                continue;
+
+            if (!batch_cond(f[i], op))
+            {
+                pc[i] = pc0 + 3;
+                run[i] -= 12;
+                continue;
+            }
+
+            *ptr_hi[i] = (uint8_t)((pc0 + 3) >> 8);
+            *ptr[i] = (uint8_t)(pc0 + 3);
+            sp[i] -= 2;
+            pc[i] = n16;
+        }
+
+        jump = true;
+        break;
+
+    case 0xCB: /* CB INST */
+    {
+        const unsigned r = n8 & 0x7;
+
+        if (r == 6)
+        {
+            for (i = 0; i < n; i++)
+                addr[i] = (uint16_t)(h[i] << 8 | l[i]);
+
+            if (!batch_map(batch, ptr, leader))
+                return false;
+
+            for (i = 0; i < n; i++)
+                val[i] = run[i] ? *ptr[i] : 0;
+
+            batch_cb(batch, n8);
+
+            if ((n8 & 0xC0) != 0x40)
+                for (i = 0; i < n; i++)
+                    if (run[i])
+                        *ptr[i] = val[i];
+        }
+        else
+        {
+            uint8_t *const reg = batch->r[r];
+
+            memcpy(val, reg, n);
+            batch_cb(batch, n8);
+
+            if ((n8 & 0xC0) != 0x40)
+                for (i = 0; i < n; i++)
+                    reg[i] = run[i] ? val[i] : reg[i];
+        }
+
+        next = pc0 + 2;
+        break;
+    }
+
+    default:
+    {
+        const unsigned dst = (op >> 3) & 0x7;
+        const unsigned src = op & 0x7;
+
+        /* Every other instruction that runs in lockstep is in the blocks of
+         * LD r, r' and the ALU operations. The table excludes HALT. */
+        if (src == 6 || (op < 0x80 && dst == 6))
+        {
+            for (i = 0; i < n; i++)
+                addr[i] = (uint16_t)(h[i] << 8 | l[i]);
+
+            if (!batch_map(batch, ptr, leader))
+                return false;
+        }
+
+        if (op >= 0x80)
+        {
+            if (src == 6)
+            {
+                for (i = 0; i < n; i++)
+                    val[i] = run[i] ? *ptr[i] : 0;
+            }
+
+            batch_alu(batch, dst, src == 6 ? val : batch->r[src]);
+        }
+        else if (src == 6)
+        {
+            uint8_t *const r = batch->r[dst];
+
+            for (i = 0; i < n; i++)
+                if (run[i])
+                    r[i] = *ptr[i];
+        }
+        else if (dst == 6)
+        {
+            const uint8_t *const r = batch->r[src];
+
+            for (i = 0; i < n; i++)
+                if (run[i])
+                    *ptr[i] = r[i];
+        }
+        else
+        {
+            uint8_t *const d = batch->r[dst];
+            const uint8_t *const s = batch->r[src];
+
+            for (i = 0; i < n; i++)
+                d[i] = run[i] ? s[i] : d[i];
+        }
+
+        break;
+    }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (!jump)
+            pc[i] = run[i] ? next : pc[i];
+
+        batch->cycles[i] += run[i];
+        batch->budget[i] -= run[i];
+    }
+
+    batch->lockstep_steps += count;
+    batch->lockstep_slots += n;
+    return true;
+}
+
+static void batch_free_group(struct batch_group_s *g)
+{
+    free(g->cart_ram);
+    free(g);
+}
+
+/**
+ * Returns a new group with a copy of the state of parent, or NULL if there
+ * was not enough memory.
+ */
+static struct batch_group_s *batch_copy_group(struct batch_group_s *parent,
+                                              size_t parent_index)
+{
+    struct batch_group_s *g = malloc(sizeof(*g));
+
+    if (g == NULL)
+        return NULL;
+
+    memcpy(g, parent, sizeof(*g));
+    g->cart_ram = malloc(parent->cart_ram_size ? parent->cart_ram_size : 1);
+    if (g->cart_ram == NULL)
+    {
+        free(g);
+        return NULL;
+    }
+
+    memcpy(g->cart_ram, parent->cart_ram, parent->cart_ram_size);
+    g->gb.direct.priv = g;
+    g->parent = parent;
+    g->parent_index = parent_index;
+#if ENABLE_LCD
+    gb_set_lcd_fb(&g->gb, g->fb, sizeof(g->fb[0]));
+#endif
+    return g;
+}
+
+batch_t *batch_create(const uint8_t *rom, size_t lanes)
+{
+    batch_t *batch = calloc(1, sizeof(*batch));
+    struct batch_group_s *g;
+    size_t i;
+
+    if (batch == NULL)
+        return NULL;
+
+    batch->rom = rom;
+    batch->lanes = lanes;
+    batch->lane_group = calloc(lanes, sizeof(*batch->lane_group));
+    batch->lane_joypad = malloc(lanes);
+    batch->groups = calloc(lanes, sizeof(*batch->groups));
+    for (i = 0; i < BATCH_REG_COUNT; i++)
+        batch->r[i] = malloc(lanes);
+
+    batch->sp = calloc(lanes, sizeof(*batch->sp));
+    batch->pc = calloc(lanes, sizeof(*batch->pc));
+    batch->cycles = calloc(lanes, sizeof(*batch->cycles));
+    batch->budget = calloc(lanes, sizeof(*batch->budget));
+    batch->bank = calloc(lanes, sizeof(*batch->bank));
+    batch->run = malloc(lanes);
+    batch->val = malloc(lanes);
+    batch->addr = calloc(lanes, sizeof(*batch->addr));
+    batch->ptr = calloc(lanes, sizeof(*batch->ptr));
+    batch->ptr_hi = calloc(lanes, sizeof(*batch->ptr_hi));
+    g = calloc(1, sizeof(*g));
+    if (batch->lane_group == NULL || batch->lane_joypad == NULL ||
+        batch->groups == NULL || batch->sp == NULL || batch->pc == NULL ||
+        batch->cycles == NULL || batch->budget == NULL ||
+        batch->bank == NULL || batch->run == NULL || batch->val == NULL ||
+        batch->addr == NULL || batch->ptr == NULL ||
+        batch->ptr_hi == NULL || g == NULL || lanes == 0)
+    {
+        free(g);
+        batch_destroy(batch);
+        return NULL;
+    }
+
+    batch->groups[batch->group_count++] = g;
+    for (i = 0; i < BATCH_REG_COUNT; i++)
+    {
+        if (batch->r[i] == NULL)
+        {
+            batch_destroy(batch);
+            return NULL;
+        }
+    }
+
+    g->batch = batch;
+    if (gb_init(&g->gb, batch_rom_read, batch_cart_ram_read,
+                batch_cart_ram_write, batch_error, g) != GB_INIT_NO_ERROR ||
+        gb_get_save_size_s(&g->gb, &g->cart_ram_size) != 0 ||
+        (g->cart_ram = calloc(1, g->cart_ram_size ? g->cart_ram_size : 1)) ==
+            NULL)
+    {
+        batch_destroy(batch);
+        return NULL;
+    }
+
+#if ENABLE_LCD
+    gb_init_lcd_fb(&g->gb, g->fb, sizeof(g->fb[0]), NULL);
+#endif
+    memset(batch->lane_joypad, 0xFF, lanes);
+    batch->backoff = 1;
+    batch->frame_end = gb_get_cycles(&g->gb);
+    return batch;
+}
+
+void batch_destroy(batch_t *batch)
+{
+    size_t i;
+
+    if (batch->groups != NULL)
+        for (i = 0; i < batch->group_count; i++)
+            batch_free_group(batch->groups[i]);
+
+    for (i = 0; i < BATCH_REG_COUNT; i++)
+        free(batch->r[i]);
+
+    free(batch->ptr_hi);
+    free(batch->ptr);
+    free(batch->addr);
+    free(batch->val);
+    free(batch->run);
+    free(batch->bank);
+    free(batch->budget);
+    free(batch->cycles);
+    free(batch->pc);
+    free(batch->sp);
+    free(batch->groups);
+    free(batch->lane_joypad);
+    free(batch->lane_group);
+    free(batch);
+}
+
+void batch_set_joypad(batch_t *batch, size_t lane, uint8_t joypad)
+{
+    batch->lane_joypad[lane] = joypad;
+}
+
+/**
+ * Moves the lane to a group with its input, copying its current group if no
+ * other lane with that input has been split from it yet this frame. Returns
+ * -1 if there was not enough memory.
+ */
+static int batch_split_lane(batch_t *batch, size_t lane, size_t first_new)
+{
+    const size_t from_index = batch->lane_group[lane];
+    struct batch_group_s *const from = batch->groups[from_index];
+    const uint8_t joypad = batch->lane_joypad[lane];
+    struct batch_group_s *g;
+    size_t i;
+
+    for (i = first_new; i < batch->group_count; i++)
+    {
+        if (batch->groups[i]->parent == from &&
+            batch->groups[i]->joypad == joypad)
+        {
+            batch->lane_group[lane] = i;
+            return 0;
+        }
+    }
+
+    g = batch_copy_group(from, from_index);
+    if (g == NULL)
+        return -1;
+
+    g->joypad = joypad;
+    batch->lane_group[lane] = batch->group_count;
+    batch->groups[batch->group_count++] = g;
+    return 0;
+}
+
+/**
+ * Returns whether enough of the instructions so far ran in lockstep for it to
+ * pay.
+ */
+static bool batch_lockstep_pays(const batch_t *batch)
+{
+    return batch->lockstep_steps * 8 >=
+               batch->lockstep_slots * BATCH_MIN_SHARE &&
+           batch->lockstep_steps >= batch->alone_steps * BATCH_MIN_LOCKSTEP;
+}
+
+/**
+ * Runs each group in lockstep to the end of the frame, or until it no longer
+ * pays, which is checked every BATCH_CHECK_STEPS steps. Returns whether it
+ * paid. Groups are left where they stopped, ready to run alone.
+ */
+static bool batch_run_lockstep(batch_t *batch)
+{
+    const size_t n = batch->group_count;
+    unsigned steps = 0;
+    bool pays = true;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        struct batch_group_s *const g = batch->groups[i];
+
+        if (g->crashed)
+        {
+            batch->cycles[i] = UINT64_MAX;
+            batch->budget[i] = 0;
+            continue;
+        }
+
+        /* Set up the group as gb_run_until() would. */
+        g->gb.counter.deadline = batch->frame_end;
+        g->gb.stop_events = GB_STOP_ON_INVALID_OPCODE;
+        g->gb.stop_reason = GB_STOP_CYCLES;
+        batch_load_group(batch, i);
+    }
+
+    batch->lockstep_steps = 0;
+    batch->alone_steps = 0;
+    batch->lockstep_slots = 0;
+
+    /* The group furthest behind leads, and every group at the same PC runs
+     * its instruction with it. A group that cannot runs alone until it gets
+     * to the PC that another group is waiting at. */
+    for (;;)
+    {
+        size_t leader = 0;
+
+        for (i = 1; i < n; i++)
+            if (batch->cycles[i] < batch->cycles[leader])
+                leader = i;
+
+        if (batch->cycles[leader] >= batch->frame_end)
+            break;
+
+        if (!batch_step(batch, leader))
+            batch_run_group(batch, leader);
+
+        if (++steps % BATCH_CHECK_STEPS == 0 && !batch_lockstep_pays(batch))
+        {
+            pays = false;
+            break;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        struct batch_group_s *const g = batch->groups[i];
+
+        if (g->crashed)
+            continue;
+
+        batch_store_group(batch, i);
+        g->gb.counter.deadline = UINT64_MAX;
+        g->gb.stop_events = 0;
+    }
+
+    return pays && batch_lockstep_pays(batch);
+}
+
+size_t batch_run_frame(batch_t *batch)
+{
+    const size_t first_new = batch->group_count;
+    size_t running = 0;
+    size_t i;
+
+    for (i = 0; i < batch->group_count; i++)
+        batch->groups[i]->joypad_set = false;
+
+    /* The first lane of each group decides its input. Lanes with other
+     * input are split off into copies. */
+    for (i = 0; i < batch->lanes; i++)
+    {
+        struct batch_group_s *const g = batch->groups[batch->lane_group[i]];
+
+        if (!g->joypad_set)
+        {
+            g->joypad = batch->lane_joypad[i];
+            g->joypad_set = true;
+        }
+        else if (g->joypad != batch->lane_joypad[i] && !g->crashed &&
+                 batch_split_lane(batch, i, first_new) != 0)
+        {
+            /* Undo the splits of this frame. */
+            for (i = 0; i < batch->lanes; i++)
+                if (batch->lane_group[i] >= first_new)
+                    batch->lane_group[i] =
+                        batch->groups[batch->lane_group[i]]->parent_index;
+
+            while (batch->group_count > first_new)
+                batch_free_group(batch->groups[--batch->group_count]);
+
+            return (size_t)-1;
+        }
+    }
+
+    batch->frame_end += BATCH_FRAME_CYCLES;
+    for (i = 0; i < batch->group_count; i++)
+    {
+        struct batch_group_s *const g = batch->groups[i];
+
+        g->parent = NULL;
+        if (g->crashed)
+            continue;
+
+        g->gb.direct.joypad = g->joypad;
+        running++;
+    }
+
+    /* Groups only run in lockstep while enough of their instructions are
+     * shared. Otherwise they finish the frame alone, and are run alone for a
+     * number of frames that doubles each time that lockstep is tried again
+     * and does not pay. */
+    if (running < 2)
+    {
+        /* Nothing to run in lockstep with. */
+    }
+    else if (batch->alone_frames > 0)
+    {
+        batch->alone_frames--;
+    }
+    else if (batch_run_lockstep(batch))
+    {
+        batch->backoff = 1;
+        return running;
+    }
+    else
+    {
+        batch->alone_frames = batch->backoff;
+        if (batch->backoff < BATCH_MAX_BACKOFF)
+            batch->backoff *= 2;
+    }
+
+    for (i = 0; i < batch->group_count; i++)
+    {
+        struct batch_group_s *const g = batch->groups[i];
+
+        if (g->crashed || gb_get_cycles(&g->gb) >= batch->frame_end)
+            continue;
+
+        if (gb_run_until(&g->gb, GB_STOP_ON_INVALID_OPCODE,
+                         (uint_fast32_t)(batch->frame_end -
+                                         gb_get_cycles(&g->gb))) ==
+            GB_STOP_INVALID_OPCODE)
+            g->crashed = true;
+    }
+
+    return running;
+}
+
+const struct gb_s *batch_lane_gb(const batch_t *batch, size_t lane)
+{
+    return &batch->groups[batch->lane_group[lane]]->gb;
+}
+
+const void *batch_lane_fb(const batch_t *batch, size_t lane)
+{
+    return batch->groups[batch->lane_group[lane]]->fb;
+}
+
+bool batch_lane_crashed(const batch_t *batch, size_t lane)
+{
+    return batch->groups[batch->lane_group[lane]]->crashed;
+}
@@ -0,0 +1,79 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct gb_s;
+
+/**
+ * Runs many consoles of the same ROM, a frame at a time, such as for fuzzing
+ * or training. Lanes that have had the same input so far share one emulator
+ * context, and a lane is given a copy of its own the first time that its
+ * input differs.
+ *
+ * While the contexts are at the same instructions, they are run in lockstep.
+ * Their CPU registers are kept as a structure of arrays, and each instruction
+ * is run for every context at the same PC at once. Contexts that take a
+ * different branch carry on alone until they get back to an instruction that
+ * others are waiting at. Instructions that touch anything but ROM, WRAM and
+ * HRAM, interrupts, and the ends of LCD modes and events are stepped a
+ * context at a time with the core. Once too few instructions run in lockstep
+ * for it to pay, the contexts are run one after another with gb_run_until()
+ * instead, and lockstep is tried again less and less often.
+ *
+ * Consoles must not depend on anything but their input, so the serial port
+ * is not connected and the RTC follows the emulated clock.
+ */
+typedef struct batch_s batch_t;
+
+/**
+ * Starts the given number of lanes, all at the start of rom, which must stay
+ * allocated until the batch is destroyed.
+ *
+ * Returns NULL if the ROM is not supported, or there was not enough memory.
+ */
+batch_t *batch_create(const uint8_t *rom, size_t lanes);
+
+/**
+ * Frees the batch and every emulator context in it.
+ */
+void batch_destroy(batch_t *batch);
+
+/**
+ * Sets the joypad state of the lane for the following frames, using the
+ * JOYPAD_* bits of Peanut-GB, where a clear bit is a pressed button.
+ */
+void batch_set_joypad(batch_t *batch, size_t lane, uint8_t joypad);
+
+/**
+ * Runs every lane for one frame. Lanes that have hit an invalid opcode are
+ * not run.
+ *
+ * Returns the number of emulator contexts that were run, or (size_t)-1 if a
+ * context could not be copied because there was not enough memory. Lanes are
+ * left unchanged on failure.
+ */
+size_t batch_run_frame(batch_t *batch);
+
+/**
+ * Returns the emulator context of the lane, such as to read its WRAM. It is
+ * shared with other lanes, so must not be modified, and is only up to date
+ * between frames.
+ */
+const struct gb_s *batch_lane_gb(const batch_t *batch, size_t lane);
+
+/**
+ * Returns the last frame drawn by the lane, in the PEANUT_GB_PIXEL_FORMAT
+ * that batch.c was compiled with. Line n starts LCD_LINE_SIZE pixels after
+ * line n - 1.
+ */
+const void *batch_lane_fb(const batch_t *batch, size_t lane);
+
+/**
+ * Returns whether the lane has stopped at an invalid opcode.
+ */
+bool batch_lane_crashed(const batch_t *batch, size_t lane);
+
+#endif
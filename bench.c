@@ -3,7 +3,8 @@
  * Copyright (c) 2018-2023 Mahyar Koshkouei
  *
  * Performs a benchmark of Peanut-GB with a specified ROM.
- * Plays the ROM five times and prints the FPS for each play.
+ * Plays the ROM five times and prints the FPS and emulated clock speed for
+ * each play.
  */
 #ifndef ENABLE_LCD
 # define ENABLE_LCD 1
@@ -18,8 +19,20 @@
 # define PEANUT_GB_IS_LITTLE_ENDIAN 1
 #endif
 
+/* Draw straight into an RGB555 frame buffer. */
+#ifndef PEANUT_GB_PIXEL_FORMAT
+# define PEANUT_GB_PIXEL_FORMAT PEANUT_GB_PIXEL_RGB555
+#endif
+
+/* Call the callbacks in bench.h directly. */
+#define PEANUT_GB_ROM_READ gb_rom_read
+#define PEANUT_GB_CART_RAM_READ gb_cart_ram_read
+#define PEANUT_GB_CART_RAM_WRITE gb_cart_ram_write
+#define PEANUT_GB_ERROR gb_error
+
 /* Import emulator library. */
 #include "peanut_gb.h"
+#include "bench.h"
 
 #include <errno.h>
 #include <string.h>
@@ -27,44 +40,8 @@
 #include <stdlib.h>
 #include <time.h>
 
-struct priv_t
-{
-	/* Pointer to allocated memory holding GB file. */
-	uint8_t *rom;
-	/* Pointer to allocated memory holding save file. */
-	uint8_t *cart_ram;
-
-	/* Frame buffer */
-	uint16_t fb[LCD_HEIGHT][LCD_WIDTH];
-};
-
-/**
- * Returns a byte from the ROM file at the given address.
- */
-static uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
-{
-	const struct priv_t * const p = gb->direct.priv;
-	return p->rom[addr];
-}
-
-/**
- * Returns a byte from the cartridge RAM at the given address.
- */
-static uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
-{
-	const struct priv_t * const p = gb->direct.priv;
-	return p->cart_ram[addr];
-}
-
-/**
- * Writes a given byte to the cartridge RAM at the given address.
- */
-static void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
-		const uint8_t val)
-{
-	const struct priv_t * const p = gb->direct.priv;
-	p->cart_ram[addr] = val;
-}
+/* Copy of the core compiled by bench_fast.c. */
+PEANUT_GB_DECLARE_CORE(fast);
 
 /**
  * Returns a pointer to the allocated space containing the ROM. Must be freed.
@@ -95,49 +72,53 @@ static uint8_t *read_rom_to_ram(const char *file_name)
 }
 
 /**
- * Ignore all errors.
+ * Returns the wall clock time in seconds, if the host has a monotonic clock.
+ * clock() is only used otherwise, as it adds up the CPU time of every thread,
+ * including the render thread.
  */
-static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t addr)
+static double bench_seconds(void)
 {
-	const char* gb_err_str[GB_INVALID_MAX] = {
-		"UNKNOWN",
-		"INVALID OPCODE",
-		"INVALID READ",
-		"INVALID WRITE",
-		"HALT FOREVER"
-	};
-	struct priv_t *priv = gb->direct.priv;
-
-	fprintf(stderr, "Error %d occurred: %s at %04X\n. Exiting.\n",
-			gb_err, gb_err_str[gb_err], addr);
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
 
-	/* Free memory and then exit. */
-	free(priv->cart_ram);
-	free(priv->rom);
-	exit(EXIT_FAILURE);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
 }
 
 #if ENABLE_LCD
 /**
- * Draws scanline into framebuffer.
+ * Enlarges each frame once it has been drawn.
  */
-static void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[160],
-		const uint_fast8_t line)
+static void lcd_frame_done(struct gb_s *gb, const uint_fast8_t lines_drawn)
 {
 	struct priv_t *priv = gb->direct.priv;
-	const uint16_t palette[] = { 0x7FFF, 0x5294, 0x294A, 0x0000 };
+	const unsigned factor = scale_factor(priv->filter);
 
-	for (unsigned int x = 0; x < LCD_WIDTH; x++)
-	{
-		priv->fb[line][x] = palette[pixels[x] & LCD_COLOUR];
-	}
+	(void)lines_drawn;
+	scale_image(priv->filter, sizeof(gb_pixel_t),
+			priv->fb, sizeof(priv->fb[0]),
+			priv->scaled, LCD_WIDTH * factor * sizeof(gb_pixel_t),
+			LCD_WIDTH, LCD_HEIGHT);
 }
 #endif
 
 int main(int argc, char **argv)
 {
+	static const char *const filter_names[SCALE_FILTER_MAX] = {
+		"nearest2x", "nearest3x", "nearest4x", "scale2x", "scale3x"
+	};
 	uint_fast32_t frames_per_run = 64 * 1024;
 	char *rom_file_name = NULL;
+	int filter = -1;
+	bool render = true;
+	bool bg_cache = false;
+	const struct gb_core_s *core = &gb_core;
+#if PEANUT_GB_RENDER_THREAD
+	bool render_thread = false;
+#endif
 
 	for(int i = 1; i < argc; i++) {
 		if(strcmp(argv[i], "--frames") == 0)
@@ -145,12 +126,38 @@ int main(int argc, char **argv)
 				frames_per_run = 0;
 			else
 				frames_per_run = atoi(argv[i]);
+#if PEANUT_GB_RENDER_THREAD
+		else if(strcmp(argv[i], "--render-thread") == 0)
+			render_thread = true;
+#endif
+		else if(strcmp(argv[i], "--no-render") == 0)
+			render = false;
+		else if(strcmp(argv[i], "--fast-lcd") == 0)
+			core = &gb_core_fast;
+		else if(strcmp(argv[i], "--bg-cache") == 0)
+			bg_cache = true;
+		else if(strcmp(argv[i], "--scale") == 0)
+		{
+			/* Leave filter unset if the name is not found. */
+			filter = SCALE_FILTER_MAX;
+			if (++i < argc)
+				for(filter = 0; filter < SCALE_FILTER_MAX; filter++)
+					if(strcmp(argv[i], filter_names[filter]) == 0)
+						break;
+		}
 		else
 			rom_file_name = argv[i];
 	}
 
-	if(!rom_file_name || !frames_per_run) {
-		fprintf(stderr, "Syntax: %s [--frames <f>] <ROM>\n", argv[0]);
+	/* Only whole byte pixels may be scaled. */
+	if(!rom_file_name || !frames_per_run || filter == SCALE_FILTER_MAX ||
+			(filter >= 0 && (!ENABLE_LCD || LCD_LINE_SIZE != LCD_WIDTH))) {
+#if PEANUT_GB_RENDER_THREAD
+		fprintf(stderr, "Syntax: %s [--frames <f>] [--render-thread] [--scale <filter>] [--no-render] [--fast-lcd] [--bg-cache] <ROM>\n", argv[0]);
+#else
+		fprintf(stderr, "Syntax: %s [--frames <f>] [--scale <filter>] [--no-render] [--fast-lcd] [--bg-cache] <ROM>\n", argv[0]);
+#endif
+		fprintf(stderr, "Filters: nearest2x, nearest3x, nearest4x, scale2x, scale3x\n");
 		exit(EXIT_FAILURE);
 	}
 
@@ -160,7 +167,8 @@ int main(int argc, char **argv)
 		struct gb_s gb;
 		struct priv_t priv;
 
-		clock_t start_time;
+		double start_time;
+		uint64_t start_cycles;
 		uint_fast32_t frames = 0;
 		enum gb_init_error_e ret;
 
@@ -172,7 +180,7 @@ int main(int argc, char **argv)
 		}
 
 		/* Initialise context. */
-		ret = gb_init(&gb, &gb_rom_read, &gb_cart_ram_read,
+		ret = core->init(&gb, &gb_rom_read, &gb_cart_ram_read,
 				&gb_cart_ram_write, &gb_error, &priv);
 
 		if(ret != GB_INIT_NO_ERROR)
@@ -182,31 +190,71 @@ int main(int argc, char **argv)
 			exit(EXIT_FAILURE);
 		}
 
-		printf("Run %u: ", i);
+		printf("Run %u (%s): ", i, gb.core->name);
 		priv.cart_ram = malloc(gb_get_save_size(&gb));
 
 #if ENABLE_LCD
-		gb_init_lcd(&gb, &lcd_draw_line);
+		priv.scaled = NULL;
+		if(filter >= 0)
+		{
+			const unsigned factor = scale_factor(filter);
+
+			priv.filter = filter;
+			priv.scaled = malloc(LCD_WIDTH * LCD_HEIGHT * factor *
+					factor * sizeof(gb_pixel_t));
+		}
+
+		/* The default palette is shades of grey. */
+		gb_init_lcd_fb(&gb, priv.fb, sizeof(priv.fb[0]),
+				priv.scaled != NULL ? &lcd_frame_done : NULL);
 		// gb.direct.interlace = true;
+		priv.bg_cache = NULL;
+		if(bg_cache)
+		{
+			priv.bg_cache = malloc(sizeof(*priv.bg_cache));
+			gb_set_bg_cache(&gb, priv.bg_cache);
+		}
+# if PEANUT_GB_RENDER_THREAD
+		if(render_thread && gb_set_render_thread(&gb, true) != 0)
+		{
+			fprintf(stderr, "Unable to start render thread\n");
+			exit(EXIT_FAILURE);
+		}
+# endif
 #endif
 
-		start_time = clock();
+		/* Only emulate the LCD state, without drawing anything. */
+		if(!render)
+			gb.direct.render_mask = 0;
+
+		start_time = bench_seconds();
+		start_cycles = gb_get_cycles(&gb);
 
 		do
 		{
 			/* Execute CPU cycles until the screen has to be
 			 * redrawn. */
-			gb_run_frame(&gb);
+			gb.core->run_frame(&gb);
 		}
 		while(++frames < frames_per_run);
 
+#if ENABLE_LCD && PEANUT_GB_RENDER_THREAD
+		/* Include the time taken to draw the last frames. */
+		gb_set_render_thread(&gb, false);
+#endif
+
 		{
-			double duration =
-				(double)(clock() - start_time) / CLOCKS_PER_SEC;
+			double duration = bench_seconds() - start_time;
 			double fps = frames / duration;
-			printf("%f FPS, dur: %f\n", fps, duration);
+			double mhz = (gb_get_cycles(&gb) - start_cycles) /
+				duration / 1000000.0;
+			printf("%f FPS, %f MHz, dur: %f\n", fps, mhz, duration);
 		}
 
+#if ENABLE_LCD
+		free(priv.scaled);
+		free(priv.bg_cache);
+#endif
 		free(priv.cart_ram);
 		free(priv.rom);
 	}
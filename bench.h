@@ -0,0 +1,85 @@
+/**
+ * MIT License
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Benchmark context and callbacks, shared by each copy of Peanut-GB that the
+ * benchmark is linked with. Include after peanut_gb.h.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "scale.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct priv_t
+{
+	/* Pointer to allocated memory holding GB file. */
+	uint8_t *rom;
+	/* Pointer to allocated memory holding save file. */
+	uint8_t *cart_ram;
+
+	/* Frame buffer */
+	gb_pixel_t fb[LCD_HEIGHT][LCD_LINE_SIZE];
+
+	/* Filter used to enlarge each frame into scaled, if enabled. */
+	scale_filter_t filter;
+	gb_pixel_t *scaled;
+
+	/* Background cache, if enabled. */
+	struct gb_bg_cache_s *bg_cache;
+};
+
+/**
+ * Returns a byte from the ROM file at the given address.
+ */
+static uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->rom[addr];
+}
+
+/**
+ * Returns a byte from the cartridge RAM at the given address.
+ */
+static uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->cart_ram[addr];
+}
+
+/**
+ * Writes a given byte to the cartridge RAM at the given address.
+ */
+static void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		const uint8_t val)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	p->cart_ram[addr] = val;
+}
+
+/**
+ * Ignore all errors.
+ */
+static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t addr)
+{
+	const char* gb_err_str[GB_INVALID_MAX] = {
+		"UNKNOWN",
+		"INVALID OPCODE",
+		"INVALID READ",
+		"INVALID WRITE",
+		"HALT FOREVER"
+	};
+	struct priv_t *priv = gb->direct.priv;
+
+	fprintf(stderr, "Error %d occurred: %s at %04X\n. Exiting.\n",
+			gb_err, gb_err_str[gb_err], addr);
+
+	/* Free memory and then exit. */
+	free(priv->cart_ram);
+	free(priv->rom);
+	exit(EXIT_FAILURE);
+}
+
+#endif
@@ -0,0 +1,34 @@
+/**
+ * MIT License
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * A second copy of Peanut-GB compiled without the extra LCD accuracy code,
+ * which the benchmark runs instead of its own when given --fast-lcd.
+ * The remaining options must match those of bench.c.
+ */
+#ifndef ENABLE_LCD
+# define ENABLE_LCD 1
+#endif
+
+#ifndef ENABLE_SOUND
+# define ENABLE_SOUND 0
+#endif
+
+#ifdef __CC_NORCROFT
+# define PEANUT_GB_IS_LITTLE_ENDIAN 1
+#endif
+
+#ifndef PEANUT_GB_PIXEL_FORMAT
+# define PEANUT_GB_PIXEL_FORMAT PEANUT_GB_PIXEL_RGB555
+#endif
+
+/* Call the callbacks in bench.h directly. */
+#define PEANUT_GB_ROM_READ gb_rom_read
+#define PEANUT_GB_CART_RAM_READ gb_cart_ram_read
+#define PEANUT_GB_CART_RAM_WRITE gb_cart_ram_write
+#define PEANUT_GB_ERROR gb_error
+
+#define PEANUT_GB_HIGH_LCD_ACCURACY 0
+#define PEANUT_GB_VARIANT fast
+#include "peanut_gb.h"
+#include "bench.h"
@@ -7,22 +7,53 @@
 #define ENABLE_SOUND 0
 #define ENABLE_LCD 1
 
+/* Call the memory and error callbacks below directly. */
+#define PEANUT_GB_ROM_READ gb_rom_read
+#define PEANUT_GB_CART_RAM_READ gb_cart_ram_read
+#define PEANUT_GB_CART_RAM_WRITE gb_cart_ram_write
+#define PEANUT_GB_ERROR gb_error
+
 /* Import emulator library. */
 #include "peanut_gb.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "oslib/osbyte.h"
 #include "oslib/osfile.h"
 #include "oslib/wimp.h"
 
+/* Number of frames whose host time is averaged for automatic frame skip. */
+#define FRAME_TIMES 8
+
+/* A ROM image, shared by every instance that runs the same file. */
+typedef struct rom_image
+{
+    struct rom_image *next;
+    unsigned refs;
+
+    /* File that the image was read from, and its date stamp and size at
+     * the time. */
+    char *file_name;
+    bits load_addr;
+    bits exec_addr;
+    int size;
+
+    uint32_t hash;
+    uint8_t *data;
+} rom_image_t;
+
+/* Every ROM image in use. */
+static rom_image_t *rom_cache;
+
 struct emu_state
 {
     struct gb_s gb;
 
-    /* Pointer to allocated memory holding GB file. */
-    uint8_t *rom;
+    /* Shared ROM image, and its data. */
+    rom_image_t *rom_image;
+    const uint8_t *rom;
     /* Pointer to allocated memory holding save file. */
     uint8_t *cart_ram;
 
@@ -30,6 +61,20 @@ struct emu_state
     uint8_t *fb;
     size_t pitch;
     bool scale;
+
+    /* Whether any line was written to the frame buffer this frame. */
+    bool drawn;
+
+#if ENABLE_LCD
+    /* Pre-drawn background maps, or NULL if there was no memory for them. */
+    struct gb_bg_cache_s *bg_cache;
+
+    /* Host time of the last few frames in centiseconds, the next one to
+     * replace, and their sum. */
+    os_t frame_times[FRAME_TIMES];
+    unsigned next_frame_time;
+    os_t frame_time_sum;
+#endif
 };
 
 /**
@@ -96,47 +141,102 @@ static os_error *gb_init_error(const enum gb_init_error_e gb_err)
 
 #if ENABLE_LCD
 extern void copy_160_pixels(void *dst, const void *src);
-extern void copy_160_pixels_2x(void *dst, const void *src, void *dst2);
 
 /**
- * Draws scanline into framebuffer.
+ * Called once the emulator has drawn a frame into the frame buffer.
  */
-static void lcd_draw_line(struct gb_s *gb,
-                          const uint8_t *pixels,
-                          const uint_fast8_t line)
+static void lcd_frame_done(struct gb_s *gb, const uint_fast8_t lines_drawn)
 {
     emu_state_t *state = gb->direct.priv;
     uint8_t *fb = state->fb;
+    uint_fast8_t line;
+
+    /* The frame buffer already contains this frame. */
+    if (lines_drawn == 0)
+        return;
+
+    state->drawn = true;
 
+    /* Lines are drawn on every other row when scaling, so double them. */
     if (state->scale) {
-        fb += state->pitch * line * 2;
-        copy_160_pixels_2x(fb, pixels, fb + state->pitch);
-    } else {
-        fb += state->pitch * line;
-        copy_160_pixels(fb, pixels);
+        for (line = 0; line < LCD_HEIGHT; line++) {
+            copy_160_pixels(fb + state->pitch, fb);
+            fb += state->pitch * 2;
+        }
     }
 }
 #endif
 
 /**
- * Returns a pointer to the allocated space containing the ROM. Must be freed.
+ * Returns the FNV-1a hash of a ROM image.
+ */
+static uint32_t rom_hash(const uint8_t *data, int size)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+
+    return hash;
+}
+
+/**
+ * Releases a ROM image returned by rom_acquire(), freeing it once no instance
+ * is using it.
+ */
+static void rom_release(rom_image_t *image)
+{
+    rom_image_t **p;
+
+    if (!image || --image->refs > 0)
+        return;
+
+    for (p = &rom_cache; *p != image; p = &(*p)->next)
+        ;
+    *p = image->next;
+
+    free(image->data);
+    free(image->file_name);
+    free(image);
+}
+
+/**
+ * Returns the ROM image of a file, which must be released with rom_release().
+ * A file that has not changed since it was last read is not read again, and
+ * files with the same contents share one image.
  */
-static os_error *read_rom_to_ram(const char *file_name, uint8_t **prom)
+static os_error *rom_acquire(const char *file_name, rom_image_t **pimage)
 {
     os_error *err;
     fileswitch_object_type type;
+    bits load_addr, exec_addr;
     int rom_size;
     uint8_t *rom = NULL;
+    uint32_t hash;
+    rom_image_t *image;
 
-    *prom = NULL;
+    *pimage = NULL;
 
-    err = xosfile_read_stamped(file_name, &type, NULL, NULL, &rom_size, NULL, NULL);
+    err = xosfile_read_stamped(file_name, &type, &load_addr, &exec_addr, &rom_size, NULL, NULL);
     if(err != NULL)
         return err;
 
     if (type != fileswitch_IS_FILE)
         return xosfile_make_error(file_name, type);
 
+    for (image = rom_cache; image; image = image->next)
+    {
+        if (strcmp(image->file_name, file_name) == 0 &&
+            image->load_addr == load_addr && image->exec_addr == exec_addr &&
+            image->size == rom_size)
+        {
+            image->refs++;
+            *pimage = image;
+            return NULL;
+        }
+    }
+
     rom = malloc(rom_size);
     if (!rom) {
         return &err_nomem;
@@ -149,7 +249,41 @@ static os_error *read_rom_to_ram(const char *file_name, uint8_t **prom)
         return err;
     }
 
-    *prom = rom;
+    /* The same game may have been loaded from another file. */
+    hash = rom_hash(rom, rom_size);
+    for (image = rom_cache; image; image = image->next)
+    {
+        if (image->hash == hash && image->size == rom_size &&
+            memcmp(image->data, rom, rom_size) == 0)
+        {
+            free(rom);
+            image->refs++;
+            *pimage = image;
+            return NULL;
+        }
+    }
+
+    image = malloc(sizeof(*image));
+    if (image)
+        image->file_name = malloc(strlen(file_name) + 1);
+    if (!image || !image->file_name)
+    {
+        free(image);
+        free(rom);
+        return &err_nomem;
+    }
+
+    strcpy(image->file_name, file_name);
+    image->load_addr = load_addr;
+    image->exec_addr = exec_addr;
+    image->size = rom_size;
+    image->hash = hash;
+    image->data = rom;
+    image->refs = 1;
+    image->next = rom_cache;
+    rom_cache = image;
+
+    *pimage = image;
     return NULL;
 }
 
@@ -167,13 +301,14 @@ os_error *emu_create(emu_state_t **pstate, const char *rom_file_name)
         return &err_nomem;
     }
 
-    /* Copy input ROM file to allocated memory. */
-    err = read_rom_to_ram(rom_file_name, &state->rom);
+    /* Share the ROM with any other instance running the same game. */
+    err = rom_acquire(rom_file_name, &state->rom_image);
     if(err != NULL)
     {
         emu_free(state);
         return err;
     }
+    state->rom = state->rom_image->data;
 
     /* Initialise context. */
     ret = gb_init(&state->gb, &gb_rom_read, &gb_cart_ram_read,
@@ -193,7 +328,14 @@ os_error *emu_create(emu_state_t **pstate, const char *rom_file_name)
     }
 
 #if ENABLE_LCD
-    gb_init_lcd(&state->gb, &lcd_draw_line);
+    gb_init_lcd_fb(&state->gb, NULL, 0, &lcd_frame_done);
+    state->gb.direct.skip_unchanged = true;
+    state->gb.direct.deferred_render = true;
+    /* Keep emulating at full speed on slower machines. */
+    gb_set_auto_frame_skip(&state->gb, 3);
+    /* Scrolling games mostly copy their background from here. */
+    state->bg_cache = malloc(sizeof(*state->bg_cache));
+    gb_set_bg_cache(&state->gb, state->bg_cache);
 #endif
 
     *pstate = state;
@@ -254,14 +396,43 @@ bool emu_poll_input(emu_state_t *state)
     return !escape;
 }
 
-void emu_update(emu_state_t *state, uint8_t *fb, size_t pitch, osbool scale)
+bool emu_update(emu_state_t *state, uint8_t *fb, size_t pitch, osbool scale)
 {
+#if ENABLE_LCD
+    os_t start;
+    os_t elapsed;
+
+    /* Draw straight into the frame buffer, on every other row when scaling.
+     * Unchanged lines are only skipped when drawing to the same frame
+     * buffer as last time. */
+    gb_set_lcd_fb(&state->gb, fb, scale ? pitch * 2 : pitch);
+#endif
+
     state->fb = fb;
     state->pitch = pitch;
     state->scale = scale;
+    state->drawn = false;
 
     /* Execute CPU cycles until the screen has to be redrawn. */
+#if ENABLE_LCD
+    start = os_read_monotonic_time();
+    gb_run_frame(&state->gb);
+    elapsed = os_read_monotonic_time() - start;
+
+    /* Monotonic time is in centiseconds, so a frame takes either none or
+     * one or two of them. Report the average of the last few frames
+     * instead, which is close to the real time taken. */
+    state->frame_time_sum +=
+        elapsed - state->frame_times[state->next_frame_time];
+    state->frame_times[state->next_frame_time] = elapsed;
+    state->next_frame_time = (state->next_frame_time + 1) % FRAME_TIMES;
+    gb_report_frame_time(&state->gb,
+                         state->frame_time_sum * 10000 / FRAME_TIMES);
+#else
     gb_run_frame(&state->gb);
+#endif
+
+    return state->drawn;
 }
 
 void emu_reset(emu_state_t *state)
@@ -274,7 +445,10 @@ void emu_free(emu_state_t *state)
     if (!state)
         return;
 
+#if ENABLE_LCD
+    free(state->bg_cache);
+#endif
     free(state->cart_ram);
-    free(state->rom);
+    rom_release(state->rom_image);
     free(state);
 }
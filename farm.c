@@ -0,0 +1,392 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "farm.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Only the prototypes are needed to run consoles. */
+#define PEANUT_GB_HEADER_ONLY
+#include "peanut_gb.h"
+
+/* Slice run by default, which is one frame. */
+#define FARM_FRAME_CYCLES 70224
+
+/**
+ * Deque of consoles to run, indexed into the tasks of the run. Only its
+ * owner pushes and pops at the bottom, while other threads steal from the top.
+ */
+struct farm_deque_s
+{
+    atomic_long top;
+    atomic_long bottom;
+    /* Number of slots minus one. The number of slots is a power of two. */
+    long mask;
+    atomic_long *slots;
+};
+
+/* One console of the run. */
+struct farm_task_s
+{
+    struct gb_s *gb;
+    farm_stats_t stats;
+};
+
+struct farm_worker_s
+{
+    farm_t *farm;
+    pthread_t thread;
+    struct farm_deque_s deque;
+    /* State of the generator that picks which thread to steal from. */
+    uint32_t seed;
+};
+
+struct farm_s
+{
+    unsigned threads;
+    uint_fast32_t slice;
+    /* Worker 0 is run on the thread that calls farm_run(). */
+    struct farm_worker_s *workers;
+
+    pthread_mutex_t lock;
+    /* Signalled when a run starts or the pool is destroyed. */
+    pthread_cond_t start;
+    /* Signalled when the last thread finishes a run. */
+    pthread_cond_t finished;
+    unsigned generation;
+    unsigned running;
+    bool quit;
+
+    /* Current run. */
+    struct farm_task_s *tasks;
+    uint64_t cycles;
+    /* Number of consoles that still have slices to run. */
+    atomic_size_t remaining;
+};
+
+static double farm_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void farm_push(struct farm_deque_s *d, long task)
+{
+    const long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+
+    /* There are never more tasks than slots, so the deque never fills. */
+    atomic_store_explicit(&d->slots[b & d->mask], task, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+}
+
+/**
+ * Returns the task at the bottom of the thread's own deque, or -1 if it is
+ * empty.
+ */
+static long farm_pop(struct farm_deque_s *d)
+{
+    const long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    long t;
+    long task;
+
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t > b)
+    {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return -1;
+    }
+
+    task = atomic_load_explicit(&d->slots[b & d->mask], memory_order_relaxed);
+    if (t == b)
+    {
+        /* Last task, which a thief may be taking at the same time. */
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+            task = -1;
+
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+
+    return task;
+}
+
+/**
+ * Returns the task at the top of another thread's deque, or -1 if it is empty
+ * or another thread took it first.
+ */
+static long farm_steal(struct farm_deque_s *d)
+{
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    long b;
+    long task;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return -1;
+
+    task = atomic_load_explicit(&d->slots[t & d->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        return -1;
+
+    return task;
+}
+
+/**
+ * Steals a task from the other threads, starting at a random one. Returns -1
+ * if none had a task to take.
+ */
+static long farm_steal_any(struct farm_worker_s *w)
+{
+    farm_t *const farm = w->farm;
+    unsigned victim;
+    unsigned i;
+
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 17;
+    w->seed ^= w->seed << 5;
+    victim = w->seed % farm->threads;
+
+    for (i = 0; i < farm->threads; i++, victim = (victim + 1) % farm->threads)
+    {
+        long task;
+
+        if (&farm->workers[victim] == w)
+            continue;
+
+        task = farm_steal(&farm->workers[victim].deque);
+        if (task >= 0)
+            return task;
+    }
+
+    return -1;
+}
+
+/**
+ * Runs one slice of the console. Returns whether it has more to run.
+ */
+static bool farm_run_slice(const farm_t *farm, struct farm_task_s *t)
+{
+    const uint64_t left = farm->cycles - t->stats.cycles;
+    const double start = farm_now();
+
+    /* Each console is run by the copy of the core it was initialised by. */
+    t->stats.cycles += t->gb->core->run_cycles(t->gb,
+            left < farm->slice ? (uint_fast32_t)left : farm->slice);
+    t->stats.seconds += farm_now() - start;
+    return t->stats.cycles < farm->cycles;
+}
+
+/**
+ * Runs slices from the thread's own deque, or stolen from others, until every
+ * console has been run.
+ */
+static void farm_work(struct farm_worker_s *w)
+{
+    farm_t *const farm = w->farm;
+
+    while (atomic_load_explicit(&farm->remaining, memory_order_acquire) > 0)
+    {
+        long task = farm_pop(&w->deque);
+
+        if (task < 0)
+            task = farm_steal_any(w);
+
+        if (task < 0)
+        {
+            sched_yield();
+            continue;
+        }
+
+        /* Keep the console on this thread while it has slices left. */
+        if (farm_run_slice(farm, &farm->tasks[task]))
+            farm_push(&w->deque, task);
+        else
+            atomic_fetch_sub_explicit(&farm->remaining, 1,
+                                      memory_order_release);
+    }
+}
+
+static void *farm_thread(void *arg)
+{
+    struct farm_worker_s *const w = arg;
+    farm_t *const farm = w->farm;
+    unsigned generation = 0;
+
+    pthread_mutex_lock(&farm->lock);
+    for (;;)
+    {
+        while (farm->generation == generation && !farm->quit)
+            pthread_cond_wait(&farm->start, &farm->lock);
+
+        if (farm->quit)
+            break;
+
+        generation = farm->generation;
+        pthread_mutex_unlock(&farm->lock);
+
+        farm_work(w);
+
+        pthread_mutex_lock(&farm->lock);
+        if (--farm->running == 0)
+            pthread_cond_signal(&farm->finished);
+    }
+    pthread_mutex_unlock(&farm->lock);
+
+    return NULL;
+}
+
+farm_t *farm_create(unsigned threads, uint_fast32_t slice_cycles)
+{
+    farm_t *farm;
+    unsigned i;
+
+    if (threads == 0)
+    {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned)cpus : 1;
+    }
+
+    farm = calloc(1, sizeof(*farm));
+    if (farm == NULL)
+        return NULL;
+
+    farm->workers = calloc(threads, sizeof(*farm->workers));
+    if (farm->workers == NULL)
+    {
+        free(farm);
+        return NULL;
+    }
+
+    farm->threads = threads;
+    farm->slice = slice_cycles ? slice_cycles : FARM_FRAME_CYCLES;
+    pthread_mutex_init(&farm->lock, NULL);
+    pthread_cond_init(&farm->start, NULL);
+    pthread_cond_init(&farm->finished, NULL);
+
+    for (i = 0; i < threads; i++)
+    {
+        farm->workers[i].farm = farm;
+        farm->workers[i].seed = 2463534242u + i;
+    }
+
+    for (i = 1; i < threads; i++)
+    {
+        if (pthread_create(&farm->workers[i].thread, NULL, farm_thread,
+                           &farm->workers[i]) != 0)
+        {
+            /* Only stop the threads that were created. */
+            farm->threads = i;
+            farm_destroy(farm);
+            return NULL;
+        }
+    }
+
+    return farm;
+}
+
+void farm_destroy(farm_t *farm)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&farm->lock);
+    farm->quit = true;
+    pthread_cond_broadcast(&farm->start);
+    pthread_mutex_unlock(&farm->lock);
+
+    for (i = 1; i < farm->threads; i++)
+        pthread_join(farm->workers[i].thread, NULL);
+
+    pthread_cond_destroy(&farm->finished);
+    pthread_cond_destroy(&farm->start);
+    pthread_mutex_destroy(&farm->lock);
+    free(farm->workers);
+    free(farm);
+}
+
+int farm_run(farm_t *farm, struct gb_s *const gb[], size_t count,
+             uint64_t cycles, farm_stats_t stats[], farm_stats_t *total)
+{
+    const double start = farm_now();
+    atomic_long *slots;
+    long size = 1;
+    size_t i;
+
+    /* Any thread may end up holding every console. */
+    while ((size_t)size < count)
+        size <<= 1;
+
+    farm->tasks = malloc(count * sizeof(*farm->tasks));
+    slots = malloc(farm->threads * size * sizeof(*slots));
+    if (farm->tasks == NULL || slots == NULL)
+    {
+        free(farm->tasks);
+        free(slots);
+        return -1;
+    }
+
+    for (i = 0; i < farm->threads; i++)
+    {
+        struct farm_deque_s *const d = &farm->workers[i].deque;
+
+        atomic_init(&d->top, 0);
+        atomic_init(&d->bottom, 0);
+        d->mask = size - 1;
+        d->slots = slots + i * size;
+    }
+
+    /* Deal the consoles out to the threads. */
+    for (i = 0; i < count; i++)
+    {
+        farm->tasks[i].gb = gb[i];
+        farm->tasks[i].stats.cycles = 0;
+        farm->tasks[i].stats.seconds = 0;
+        farm_push(&farm->workers[i % farm->threads].deque, (long)i);
+    }
+
+    farm->cycles = cycles;
+    atomic_init(&farm->remaining, cycles ? count : 0);
+
+    pthread_mutex_lock(&farm->lock);
+    farm->generation++;
+    farm->running = farm->threads - 1;
+    pthread_cond_broadcast(&farm->start);
+    pthread_mutex_unlock(&farm->lock);
+
+    farm_work(&farm->workers[0]);
+
+    pthread_mutex_lock(&farm->lock);
+    while (farm->running > 0)
+        pthread_cond_wait(&farm->finished, &farm->lock);
+    pthread_mutex_unlock(&farm->lock);
+
+    if (total)
+    {
+        total->cycles = 0;
+        total->seconds = farm_now() - start;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (stats)
+            stats[i] = farm->tasks[i].stats;
+        if (total)
+            total->cycles += farm->tasks[i].stats.cycles;
+    }
+
+    free(slots);
+    free(farm->tasks);
+    farm->tasks = NULL;
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef FARM_H
+#define FARM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct gb_s;
+
+/**
+ * A pool of threads that runs many independent consoles at once. Each console
+ * is run a slice of cycles at a time. Every thread keeps a deque of consoles
+ * to run, and a thread whose deque is empty steals consoles from the others,
+ * so all threads are kept busy until the last slice is run.
+ *
+ * The callbacks of each console are called on whichever thread runs it, but
+ * never on two threads at once, so they must only share data between
+ * consoles safely.
+ */
+typedef struct farm_s farm_t;
+
+/* Throughput of one console, or of all consoles run by farm_run(). */
+typedef struct
+{
+    /* Cycles run. */
+    uint64_t cycles;
+    /* For one console, the time spent running its slices. For all of them,
+     * the time taken by farm_run(). */
+    double seconds;
+} farm_stats_t;
+
+/**
+ * Creates a pool of the given number of threads, including the thread that
+ * calls farm_run(), or one for each online CPU if threads is 0. Consoles are
+ * run slice_cycles at a time, or a frame at a time if slice_cycles is 0.
+ *
+ * Returns NULL if there was not enough memory, or a thread could not be
+ * created.
+ */
+farm_t *farm_create(unsigned threads, uint_fast32_t slice_cycles);
+
+/**
+ * Stops the threads and frees the pool.
+ */
+void farm_destroy(farm_t *farm);
+
+/**
+ * Runs each of the count consoles in gb for the given number of cycles, and
+ * returns once they have all been run. If stats is not NULL, it is set to the
+ * throughput of each console, and if total is not NULL, it is set to the
+ * throughput of all of them.
+ *
+ * Returns 0 on success, or -1 if there was not enough memory.
+ */
+int farm_run(farm_t *farm, struct gb_s *const gb[], size_t count,
+             uint64_t cycles, farm_stats_t stats[], farm_stats_t *total);
+
+#endif
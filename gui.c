@@ -422,8 +422,8 @@ void gui_run(void)
             while (instance) {
                 if (instance == instance_focus)
                     emu_poll_input(instance->state);
-                emu_update(instance->state, instance->pixels, instance->pitch, false);
-                update_sprite(instance->area, instance->id, &instance->factors, instance->trans_tab, instance->w);
+                if (emu_update(instance->state, instance->pixels, instance->pitch, false))
+                    update_sprite(instance->area, instance->id, &instance->factors, instance->trans_tab, instance->w);
                 instance = instance->next;
             }
             }
@@ -0,0 +1,615 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "link.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Only the prototypes are needed to run linked consoles. */
+#define PEANUT_GB_HEADER_ONLY
+#include "peanut_gb.h"
+
+/* How long to wait for a reply to a byte sent with the internal clock before
+ * behaving as if no cable is connected. */
+#ifndef LINK_TIMEOUT_MS
+# define LINK_TIMEOUT_MS 1000
+#endif
+
+/* As LINK_TIMEOUT_MS, in emulated cycles, for consoles run by
+ * link_run_pair(). One second by default. */
+#ifndef LINK_TIMEOUT_CYCLES
+# define LINK_TIMEOUT_CYCLES 4194304
+#endif
+
+/* Bytes are sent as two byte messages: the type followed by the byte. */
+#define LINK_MSG_SIZE   2
+/* Byte clocked by the sender. */
+#define LINK_MSG_MASTER 'M'
+/* Reply to a LINK_MSG_MASTER message. */
+#define LINK_MSG_SLAVE  'S'
+
+#define LINK_BUF_SIZE   256
+
+/* How far ahead of the other console link_run_pair() lets each console run. */
+#ifndef LINK_QUANTUM_CYCLES
+# define LINK_QUANTUM_CYCLES 4096
+#endif
+
+typedef enum
+{
+    LINK_IDLE,
+    LINK_MASTER,
+    LINK_SLAVE
+} link_state_t;
+
+/**
+ * One direction of a link between consoles in the same process. Only the
+ * sending thread writes head, and only the receiving thread writes tail.
+ */
+struct link_ring_s
+{
+    atomic_uint head;
+    atomic_uint tail;
+    uint8_t buf[LINK_BUF_SIZE];
+};
+
+/* Shared by both ends of a link made by link_open_pair(). */
+struct link_pair_s
+{
+    struct link_ring_s ring[2];
+    /* Number of ends that have not been closed. */
+    atomic_int open;
+};
+
+struct link_s
+{
+    /* Link to a console in the same process, or NULL. Ends send on
+     * ring[side] and receive on the other ring. */
+    struct link_pair_s *pair;
+    unsigned side;
+
+    int in_fd;
+    int out_fd;
+    /* Socket that the other emulator connects to, or -1. */
+    int listen_fd;
+    /* Path of listen_fd, removed when the link is closed. */
+    char *path;
+    bool disconnected;
+
+    /* Transfer started by link_send(). */
+    link_state_t state;
+    uint8_t reply;
+    struct timespec started;
+    /* Cycle count of the console using the link in link_run_pair() when the
+     * transfer started, or UINT64_MAX if it was started outside it. */
+    uint64_t started_cycles;
+    /* Console using the link in link_run_pair(), or NULL. */
+    struct link_runner_s *runner;
+
+    /* Messages are batched, so that each poll makes at most one read and
+     * one write. */
+    uint8_t in[LINK_BUF_SIZE];
+    size_t in_len;
+    uint8_t out[LINK_BUF_SIZE];
+    size_t out_len;
+};
+
+static bool set_non_blocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+static link_t *link_new(int in_fd, int out_fd, int listen_fd)
+{
+    link_t *link = calloc(1, sizeof(link_t));
+
+    if (!link)
+        return NULL;
+
+    link->in_fd = in_fd;
+    link->out_fd = out_fd;
+    link->listen_fd = listen_fd;
+    link->state = LINK_IDLE;
+    return link;
+}
+
+link_t *link_open(const char *path)
+{
+    struct sockaddr_un addr;
+    link_t *link = NULL;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return NULL;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        if (!set_non_blocking(fd) || !(link = link_new(fd, fd, -1)))
+        {
+            close(fd);
+            return NULL;
+        }
+
+        return link;
+    }
+
+    /* Only listen if nobody is listening there, rather than if the path
+     * could not be reached at all. */
+    if (errno != ECONNREFUSED && errno != ENOENT)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    /* Remove a socket left behind by an emulator that exited, but never
+     * anything else that is at the path. */
+    if (errno == ECONNREFUSED)
+    {
+        struct stat st;
+
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(path);
+    }
+
+    /* A socket that failed to connect may not be bound, so start again with
+     * a new one and wait for the other emulator to connect. */
+    close(fd);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return NULL;
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    /* Closing the link removes the socket again, which needs its path. */
+    if (listen(fd, 1) == -1 || !set_non_blocking(fd) ||
+        !(link = link_new(-1, -1, fd)) ||
+        !(link->path = malloc(strlen(path) + 1)))
+    {
+        if (link)
+            link_close(link);
+        else
+            close(fd);
+
+        unlink(path);
+        return NULL;
+    }
+
+    strcpy(link->path, path);
+    return link;
+}
+
+link_t *link_open_fds(int in_fd, int out_fd)
+{
+    if (!set_non_blocking(in_fd) || !set_non_blocking(out_fd))
+        return NULL;
+
+    return link_new(in_fd, out_fd, -1);
+}
+
+int link_open_pair(link_t *links[2])
+{
+    struct link_pair_s *pair = calloc(1, sizeof(struct link_pair_s));
+    unsigned i;
+
+    if (!pair)
+        return -1;
+
+    for (i = 0; i < 2; i++)
+    {
+        atomic_init(&pair->ring[i].head, 0);
+        atomic_init(&pair->ring[i].tail, 0);
+    }
+
+    atomic_init(&pair->open, 2);
+    links[0] = link_new(-1, -1, -1);
+    links[1] = link_new(-1, -1, -1);
+    if (!links[0] || !links[1])
+    {
+        free(links[0]);
+        free(links[1]);
+        free(pair);
+        return -1;
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        links[i]->pair = pair;
+        links[i]->side = i;
+    }
+
+    return 0;
+}
+
+void link_close(link_t *link)
+{
+    if (!link)
+        return;
+
+    /* The last end to be closed frees the rings. */
+    if (link->pair && atomic_fetch_sub(&link->pair->open, 1) == 1)
+        free(link->pair);
+
+    if (link->in_fd != -1)
+        close(link->in_fd);
+
+    if (link->out_fd != -1 && link->out_fd != link->in_fd)
+        close(link->out_fd);
+
+    if (link->listen_fd != -1)
+        close(link->listen_fd);
+
+    if (link->path)
+    {
+        unlink(link->path);
+        free(link->path);
+    }
+
+    free(link);
+}
+
+/**
+ * As link_poll(), for a link to a console in the same process.
+ */
+static bool link_poll_pair(link_t *link)
+{
+    struct link_ring_s *tx = &link->pair->ring[link->side];
+    struct link_ring_s *rx = &link->pair->ring[!link->side];
+    unsigned head, tail, n, i;
+
+    if (atomic_load_explicit(&link->pair->open, memory_order_relaxed) < 2)
+        return false;
+
+    head = atomic_load_explicit(&tx->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&tx->tail, memory_order_acquire);
+    n = LINK_BUF_SIZE - (head - tail);
+    if (n > link->out_len)
+        n = link->out_len;
+
+    for (i = 0; i < n; i++)
+        tx->buf[(head + i) % LINK_BUF_SIZE] = link->out[i];
+
+    atomic_store_explicit(&tx->head, head + n, memory_order_release);
+    link->out_len -= n;
+    memmove(link->out, link->out + n, link->out_len);
+
+    tail = atomic_load_explicit(&rx->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&rx->head, memory_order_acquire);
+    n = head - tail;
+    if (n > sizeof(link->in) - link->in_len)
+        n = sizeof(link->in) - link->in_len;
+
+    for (i = 0; i < n; i++)
+        link->in[link->in_len++] = rx->buf[(tail + i) % LINK_BUF_SIZE];
+
+    atomic_store_explicit(&rx->tail, tail + n, memory_order_release);
+    return true;
+}
+
+/**
+ * Accepts the other emulator if it has connected, sends queued messages and
+ * reads any that have arrived. Returns false if there is no connection.
+ */
+static bool link_poll(link_t *link)
+{
+    ssize_t n;
+
+    if (link->pair)
+        return link_poll_pair(link);
+
+    if (link->in_fd == -1)
+    {
+        int fd;
+
+        if (link->listen_fd == -1)
+            return false;
+
+        fd = accept(link->listen_fd, NULL, NULL);
+        if (fd == -1 || !set_non_blocking(fd))
+        {
+            if (fd != -1)
+                close(fd);
+
+            return false;
+        }
+
+        link->in_fd = fd;
+        link->out_fd = fd;
+        close(link->listen_fd);
+        link->listen_fd = -1;
+    }
+
+    if (link->disconnected)
+        return false;
+
+    while (link->out_len > 0)
+    {
+        /* Do not raise SIGPIPE if the other emulator has exited. */
+        n = send(link->out_fd, link->out, link->out_len, MSG_NOSIGNAL);
+        if (n == -1 && errno == ENOTSOCK)
+            n = write(link->out_fd, link->out, link->out_len);
+
+        if (n == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            if (errno == EINTR)
+                continue;
+
+            link->disconnected = true;
+            return false;
+        }
+
+        link->out_len -= n;
+        memmove(link->out, link->out + n, link->out_len);
+    }
+
+    if (link->in_len == sizeof(link->in))
+        return true;
+
+    n = read(link->in_fd, link->in + link->in_len,
+             sizeof(link->in) - link->in_len);
+    if (n > 0)
+    {
+        link->in_len += n;
+    }
+    else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                        errno != EINTR))
+    {
+        link->disconnected = true;
+        return false;
+    }
+
+    return true;
+}
+
+static void link_queue(link_t *link, uint8_t type, uint8_t byte)
+{
+    /* Messages are only queued while waiting for a reply, so the buffer
+     * can only fill if the other emulator has stopped reading. */
+    if (link->out_len + LINK_MSG_SIZE > sizeof(link->out))
+        return;
+
+    link->out[link->out_len++] = type;
+    link->out[link->out_len++] = byte;
+}
+
+static long link_elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 +
+           (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/* State of one console run by link_run_pair(). */
+struct link_runner_s
+{
+    struct gb_s *gb;
+    uint64_t start;
+    uint64_t cycles;
+    /* Cycles run so far, read by the other console's thread. */
+    atomic_uint_fast64_t done;
+    const struct link_runner_s *other;
+};
+
+/**
+ * Publishes how far the console has run, then waits while it is a quantum or
+ * more ahead of the other console. Returns the number of cycles it may run up
+ * to before calling this again.
+ */
+static uint64_t link_runner_sync(struct link_runner_s *r)
+{
+    const uint64_t done = gb_get_cycles(r->gb) - r->start;
+    uint64_t limit;
+
+    atomic_store_explicit(&r->done, done, memory_order_release);
+    for (;;)
+    {
+        limit = atomic_load_explicit(&r->other->done, memory_order_acquire) +
+                LINK_QUANTUM_CYCLES;
+        if (done < limit)
+            break;
+
+        sched_yield();
+    }
+
+    return limit < r->cycles ? limit : r->cycles;
+}
+
+void link_send(link_t *link, uint8_t byte, bool internal_clock)
+{
+    if (internal_clock)
+    {
+        link_queue(link, LINK_MSG_MASTER, byte);
+        link->state = LINK_MASTER;
+        clock_gettime(CLOCK_MONOTONIC, &link->started);
+        link->started_cycles =
+            link->runner ? gb_get_cycles(link->runner->gb) : UINT64_MAX;
+    }
+    else
+    {
+        link->reply = byte;
+        link->state = LINK_SLAVE;
+    }
+
+    link_poll(link);
+}
+
+/**
+ * Returns whether the byte sent with the internal clock has had no reply for
+ * too long. Between consoles in the same process, that is measured in
+ * emulated cycles, so that the result does not depend on how busy the host
+ * is. Once the console has waited long enough, the other console is waited
+ * for until it is as far on, so that any reply it sent by then has arrived.
+ * Consoles not run by link_run_pair() wait for the reply for ever.
+ */
+static bool link_expired(link_t *link)
+{
+    struct link_runner_s *const r = link->runner;
+    uint64_t since;
+
+    if (!link->pair)
+        return link_elapsed_ms(&link->started) >= LINK_TIMEOUT_MS;
+
+    if (!r || link->started_cycles == UINT64_MAX)
+        return false;
+
+    /* The transfer may have started in an earlier link_run_pair(). */
+    since = link->started_cycles < r->start ?
+                0 : link->started_cycles - r->start;
+    if (gb_get_cycles(r->gb) - r->start < since + LINK_TIMEOUT_CYCLES)
+        return false;
+
+    /* Let the other console run on past this one while waiting. */
+    link_runner_sync(r);
+    while (atomic_load_explicit(&r->other->done, memory_order_acquire) <
+           since + LINK_TIMEOUT_CYCLES)
+        sched_yield();
+
+    return true;
+}
+
+static link_status_t link_receive_msg(link_t *link, uint8_t *byte)
+{
+    const bool expired = link->state == LINK_MASTER && link_expired(link);
+
+    if (!link_poll(link))
+    {
+        link->state = LINK_IDLE;
+        return LINK_DISCONNECTED;
+    }
+
+    while (link->in_len >= LINK_MSG_SIZE)
+    {
+        const uint8_t type = link->in[0];
+        const uint8_t value = link->in[1];
+
+        /* Keep bytes clocked by the other console until this one is ready
+         * to shift its own byte out in reply. */
+        if (type == LINK_MSG_MASTER && link->state == LINK_IDLE)
+            break;
+
+        link->in_len -= LINK_MSG_SIZE;
+        memmove(link->in, link->in + LINK_MSG_SIZE, link->in_len);
+
+        if (type == LINK_MSG_MASTER)
+        {
+            /* If both consoles use their internal clock, they each receive
+             * the other's byte. */
+            if (link->state == LINK_SLAVE)
+            {
+                link_queue(link, LINK_MSG_SLAVE, link->reply);
+                link_poll(link);
+            }
+
+            link->state = LINK_IDLE;
+            *byte = value;
+            return LINK_RECEIVED;
+        }
+
+        if (type == LINK_MSG_SLAVE && link->state == LINK_MASTER)
+        {
+            link->state = LINK_IDLE;
+            *byte = value;
+            return LINK_RECEIVED;
+        }
+
+        /* Discard replies to transfers that timed out. */
+    }
+
+    if (link->state == LINK_MASTER && expired)
+    {
+        link->state = LINK_IDLE;
+        return LINK_DISCONNECTED;
+    }
+
+    return LINK_PENDING;
+}
+
+link_status_t link_receive(link_t *link, uint8_t *byte)
+{
+    const link_status_t status = link_receive_msg(link, byte);
+
+    /* The console may be in a HALT that lasts until the byte arrives, so
+     * let the other console catch up from here too. */
+    if (status == LINK_PENDING && link->runner)
+        link_runner_sync(link->runner);
+
+    return status;
+}
+
+static void *link_run_thread(void *arg)
+{
+    struct link_runner_s *const r = arg;
+
+    while (gb_get_cycles(r->gb) - r->start < r->cycles)
+    {
+        const uint64_t limit = link_runner_sync(r);
+        const uint64_t done = gb_get_cycles(r->gb) - r->start;
+
+        /* Run the console with the copy of the core it was initialised by. */
+        r->gb->core->run_cycles(r->gb, (uint_fast32_t)(limit - done));
+    }
+
+    /* Never make the other console wait once this one has finished. */
+    atomic_store_explicit(&r->done, UINT64_MAX - LINK_QUANTUM_CYCLES,
+                          memory_order_release);
+    return NULL;
+}
+
+int link_run_pair(struct gb_s *gb[2], link_t *links[2], uint64_t cycles)
+{
+    struct link_runner_s r[2];
+    pthread_t thread;
+    unsigned i;
+
+    for (i = 0; i < 2; i++)
+    {
+        r[i].gb = gb[i];
+        r[i].start = gb_get_cycles(gb[i]);
+        r[i].cycles = cycles;
+        r[i].other = &r[!i];
+        atomic_init(&r[i].done, 0);
+        links[i]->runner = &r[i];
+    }
+
+    /* Run the second console on a new thread, and the first on this one. */
+    if (pthread_create(&thread, NULL, link_run_thread, &r[1]) != 0)
+    {
+        links[0]->runner = NULL;
+        links[1]->runner = NULL;
+        return -1;
+    }
+
+    link_run_thread(&r[0]);
+    pthread_join(thread, NULL);
+    links[0]->runner = NULL;
+    links[1]->runner = NULL;
+    return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct gb_s;
+
+/**
+ * A link cable to another emulator, over a UNIX domain socket, a pair of
+ * pipes or memory shared with another thread. Nothing blocks: bytes are sent
+ * and received as they become available while both emulators keep running.
+ *
+ * To connect it to Peanut-GB, call link_send() from the function given to
+ * gb_init_serial() as gb_serial_tx, passing whether bit 0 of the SC register
+ * is set, and link_receive() from gb_serial_rx, returning
+ * GB_SERIAL_RX_SUCCESS, GB_SERIAL_RX_PENDING or GB_SERIAL_RX_NO_CONNECTION
+ * for each result.
+ */
+typedef struct link_s link_t;
+
+/* Result of link_receive(). */
+typedef enum
+{
+    LINK_RECEIVED,
+    LINK_PENDING,
+    LINK_DISCONNECTED
+} link_status_t;
+
+/**
+ * Connects to the other emulator using the UNIX socket at path. If no other
+ * emulator is listening there yet, listens for one to connect instead, and the
+ * link stays disconnected until it does.
+ *
+ * Returns NULL if the socket could not be created, or if something other
+ * than a socket is at path.
+ */
+link_t *link_open(const char *path);
+
+/**
+ * Connects to the other emulator using file descriptors that are already
+ * open, such as a pair of pipes or one end of a socketpair(), which may be
+ * given as both in_fd and out_fd. The link takes ownership of them.
+ *
+ * Returns NULL if there was not enough memory.
+ */
+link_t *link_open_fds(int in_fd, int out_fd);
+
+/**
+ * Connects two consoles in the same process, which may run on different
+ * threads. Bytes are passed between them through memory without locks. Sets
+ * links[0] and links[1] to the two ends, which must each be closed.
+ *
+ * Returns 0 on success, or -1 if there was not enough memory.
+ */
+int link_open_pair(link_t *links[2]);
+
+/**
+ * Closes the connection and frees the link.
+ */
+void link_close(link_t *link);
+
+/**
+ * Starts a transfer of byte. If internal_clock is set this console clocks the
+ * transfer, and the byte is sent straight away. Otherwise it is sent in reply
+ * to the next byte received from the other console.
+ */
+void link_send(link_t *link, uint8_t byte, bool internal_clock);
+
+/**
+ * Sets byte to the byte received from the other console for the transfer
+ * started by link_send() and returns LINK_RECEIVED, or returns LINK_PENDING if
+ * it has not arrived yet. Returns LINK_DISCONNECTED if there is no other
+ * console, or if it did not reply within LINK_TIMEOUT_MS. Consoles linked by
+ * link_open_pair() instead wait LINK_TIMEOUT_CYCLES of emulated time when run
+ * by link_run_pair(), so that the result does not depend on the host, and
+ * otherwise wait for the reply for ever.
+ */
+link_status_t link_receive(link_t *link, uint8_t *byte);
+
+/**
+ * Runs two consoles connected by link_open_pair() for the given number of
+ * cycles each, with the first on the calling thread and the second on a new
+ * thread. The serial functions of gb[i] must use links[i].
+ *
+ * The consoles only wait for each other if one gets more than
+ * LINK_QUANTUM_CYCLES ahead, so a byte sent by one is answered by the other
+ * within about that many cycles. Each pair uses its own threads, so many
+ * pairs may be run at once.
+ *
+ * Returns 0 on success, or -1 if the thread could not be created.
+ */
+int link_run_pair(struct gb_s *gb[2], link_t *links[2], uint64_t cycles);
+
+#endif
@@ -47,6 +47,13 @@
 #include <string.h>	/* Required for memset */
 #include <time.h>	/* Required for tm struct */
 
+#if PEANUT_GB_RENDER_THREAD
+# include <pthread.h>
+# include <sched.h>
+# include <semaphore.h>
+# include <stdatomic.h>
+#endif
+
 /**
 * If PEANUT_GB_IS_LITTLE_ENDIAN is positive, then Peanut-GB will be configured
 * for a little endian platform. If 0, then big endian.
@@ -116,6 +123,30 @@
 # define PEANUT_GB_USE_NIBBLE_FOR_PALETTE PEANUT_GB_USE_DOUBLE_WIDTH_PALETTE
 #endif
 
+/**
+ * Pixel formats that may be selected with PEANUT_GB_PIXEL_FORMAT.
+ *
+ * PEANUT_GB_PIXEL_INDEX8 outputs one byte per pixel holding the shade and
+ * layer of the pixel, as described for lcd_draw_line.
+ * The other formats convert each pixel through a 16 entry look-up table set
+ * with gb_set_lcd_palette(), indexed by the shade in bits 1-0 and the layer in
+ * bits 3-2 (OBJ0 = 0b00, OBJ1 = 0b01, BG = 0b10):
+ * - PEANUT_GB_PIXEL_INDEX4 packs two 4-bit pixels in each byte, with the left
+ *   pixel in the least significant nibble. Entries are masked to 4 bits.
+ * - PEANUT_GB_PIXEL_RGB555 and PEANUT_GB_PIXEL_RGB565 output one uint16_t
+ *   per pixel.
+ * - PEANUT_GB_PIXEL_XRGB8888 outputs one uint32_t per pixel.
+ */
+#define PEANUT_GB_PIXEL_INDEX8		0
+#define PEANUT_GB_PIXEL_INDEX4		1
+#define PEANUT_GB_PIXEL_RGB555		2
+#define PEANUT_GB_PIXEL_RGB565		3
+#define PEANUT_GB_PIXEL_XRGB8888	4
+
+#ifndef PEANUT_GB_PIXEL_FORMAT
+# define PEANUT_GB_PIXEL_FORMAT PEANUT_GB_PIXEL_INDEX8
+#endif
+
 /* Adds more code to improve LCD rendering accuracy. */
 #ifndef PEANUT_GB_HIGH_LCD_ACCURACY
 # define PEANUT_GB_HIGH_LCD_ACCURACY 1
@@ -126,10 +157,96 @@
 # define PEANUT_GB_USE_INTRINSICS 1
 #endif
 
+/**
+ * If PEANUT_GB_RENDER_THREAD is enabled, gb_set_render_thread() may be used to
+ * draw the screen on a separate thread while the CPU continues to be emulated.
+ * Requires POSIX threads and C11 atomics.
+ */
+#ifndef PEANUT_GB_RENDER_THREAD
+# define PEANUT_GB_RENDER_THREAD 0
+#endif
+
 /* Only include function prototypes. At least one file must *not* have this
  * defined. */
 // #define PEANUT_GB_HEADER_ONLY
 
+/**
+ * The core may be compiled several times with different options, such as
+ * PEANUT_GB_HIGH_LCD_ACCURACY or ENABLE_SOUND, by defining PEANUT_GB_VARIANT
+ * to a unique name in each additional file that includes this header. Every
+ * external function of that copy is then suffixed with the name, so that
+ * gb_init() becomes gb_init_<name>(), and its entry points are exported as
+ * gb_core_<name> (see struct gb_core_s). Each copy keeps its own options
+ * constant folded. All copies in a program must use the same pixel format.
+ */
+// #define PEANUT_GB_VARIANT fast
+
+/**
+ * The callbacks may be bound at compile time instead of being called through
+ * the pointers given to gb_init() and gb_init_lcd(), so that the compiler can
+ * inline them into the core. Define any of the following to the name of a
+ * function with the same parameters as the callback, which must be defined
+ * static in the same file after this header is included. The pointers given
+ * for bound callbacks are ignored and may be NULL, except that lcd_draw_line
+ * must still be given to gb_init_lcd() to enable drawing.
+ */
+// #define PEANUT_GB_ROM_READ		gb_rom_read
+// #define PEANUT_GB_CART_RAM_READ	gb_cart_ram_read
+// #define PEANUT_GB_CART_RAM_WRITE	gb_cart_ram_write
+// #define PEANUT_GB_ERROR		gb_error
+// #define PEANUT_GB_LCD_DRAW_LINE	lcd_draw_line
+
+#ifdef PEANUT_GB_VARIANT
+# define PGB_VARIANT_CAT_(a, b)		a ## _ ## b
+# define PGB_VARIANT_CAT(a, b)		PGB_VARIANT_CAT_(a, b)
+# define PGB_VARIANT(name)		PGB_VARIANT_CAT(name, PEANUT_GB_VARIANT)
+# define PGB_VARIANT_STR_(v)		#v
+# define PGB_VARIANT_STR(v)		PGB_VARIANT_STR_(v)
+# define PGB_VARIANT_NAME		PGB_VARIANT_STR(PEANUT_GB_VARIANT)
+# define __gb_read			PGB_VARIANT(__gb_read)
+# define __gb_write			PGB_VARIANT(__gb_write)
+# define __gb_execute_cb		PGB_VARIANT(__gb_execute_cb)
+# define __gb_draw_line			PGB_VARIANT(__gb_draw_line)
+# define __gb_step_cpu			PGB_VARIANT(__gb_step_cpu)
+# define gb_run_frame			PGB_VARIANT(gb_run_frame)
+# define gb_run_cycles			PGB_VARIANT(gb_run_cycles)
+# define gb_run_until			PGB_VARIANT(gb_run_until)
+# define gb_set_stop_ly			PGB_VARIANT(gb_set_stop_ly)
+# define gb_set_breakpoint		PGB_VARIANT(gb_set_breakpoint)
+# define gb_get_save_size_s		PGB_VARIANT(gb_get_save_size_s)
+# define gb_get_save_size		PGB_VARIANT(gb_get_save_size)
+# define gb_init_serial			PGB_VARIANT(gb_init_serial)
+# define gb_colour_hash			PGB_VARIANT(gb_colour_hash)
+# define gb_get_cycles			PGB_VARIANT(gb_get_cycles)
+# define gb_reset			PGB_VARIANT(gb_reset)
+# define gb_init			PGB_VARIANT(gb_init)
+# define gb_get_rom_name		PGB_VARIANT(gb_get_rom_name)
+# define gb_invalidate_lcd		PGB_VARIANT(gb_invalidate_lcd)
+# define gb_init_lcd			PGB_VARIANT(gb_init_lcd)
+# define gb_init_lcd_fb			PGB_VARIANT(gb_init_lcd_fb)
+# define gb_set_lcd_fb			PGB_VARIANT(gb_set_lcd_fb)
+# define gb_set_lcd_palette		PGB_VARIANT(gb_set_lcd_palette)
+# define gb_set_frame_skip		PGB_VARIANT(gb_set_frame_skip)
+# define gb_set_auto_frame_skip		PGB_VARIANT(gb_set_auto_frame_skip)
+# define gb_report_frame_time		PGB_VARIANT(gb_report_frame_time)
+# define gb_get_frame_stats		PGB_VARIANT(gb_get_frame_stats)
+# define gb_set_render_thread		PGB_VARIANT(gb_set_render_thread)
+# define gb_sync_render_thread		PGB_VARIANT(gb_sync_render_thread)
+# define gb_set_bg_cache		PGB_VARIANT(gb_set_bg_cache)
+# define gb_set_bootrom			PGB_VARIANT(gb_set_bootrom)
+# define gb_tick_rtc			PGB_VARIANT(gb_tick_rtc)
+# define gb_set_rtc			PGB_VARIANT(gb_set_rtc)
+# define gb_sync_rtc			PGB_VARIANT(gb_sync_rtc)
+# define gb_save_rtc			PGB_VARIANT(gb_save_rtc)
+# define gb_load_rtc			PGB_VARIANT(gb_load_rtc)
+# define gb_state_size			PGB_VARIANT(gb_state_size)
+# define gb_state_save			PGB_VARIANT(gb_state_save)
+# define gb_state_load			PGB_VARIANT(gb_state_load)
+# define gb_core			PGB_VARIANT(gb_core)
+#else
+# define PGB_VARIANT_NAME		"default"
+#endif
+
 /** Internal source code. **/
 /* Interrupt masks */
 #define VBLANK_INTR	0x01
@@ -172,11 +289,15 @@
 /* Serial clock locked to 8192Hz on DMG.
  * 4194304 / (8192 / 8) = 4096 clock cycles for sending 1 byte. */
 #define SERIAL_CYCLES       4096
+/* How often the front-end is asked again for a byte it has not received. */
+#define SERIAL_POLL_CYCLES  512
 
 /* Calculating VSYNC. */
 #define DMG_CLOCK_FREQ      4194304.0
 #define SCREEN_REFRESH_CYCLES 70224.0
 #define VERTICAL_SYNC       (DMG_CLOCK_FREQ/SCREEN_REFRESH_CYCLES)
+/* Duration of one frame in microseconds. */
+#define FRAME_US            ((int_fast32_t)(1000000.0 / VERTICAL_SYNC))
 
 /* Real Time Clock is locked to 1Hz. */
 #define RTC_CYCLES	((uint_fast32_t)DMG_CLOCK_FREQ)
@@ -242,6 +363,8 @@
 #define VRAM_BMAP_2         (0x9C00 - VRAM_ADDR)
 #define VRAM_TILES_3        (0x8000 - VRAM_ADDR + VRAM_BANK_SIZE)
 #define VRAM_TILES_4        (0x8800 - VRAM_ADDR + VRAM_BANK_SIZE)
+/* Number of tiles in 0x8000-0x97FF. */
+#define NUM_TILES           0x180
 
 /* Interrupt jump addresses */
 #define VBLANK_INTR_ADDR    0x0040
@@ -258,6 +381,12 @@
 #define OBJ_FLIP_X          0x20
 #define OBJ_PALETTE         0x10
 
+/* Layers drawn, for direct.render_mask. */
+#define GB_RENDER_BG        0x01
+#define GB_RENDER_WINDOW    0x02
+#define GB_RENDER_OBJ       0x04
+#define GB_RENDER_ALL       0x07
+
 /* Joypad buttons */
 #define JOYPAD_A            0x01
 #define JOYPAD_B            0x02
@@ -521,13 +650,104 @@ struct cpu_registers_s
 struct count_s
 {
 	uint_fast16_t lcd_count;	/* LCD Timing */
-	uint_fast16_t div_count;	/* Divider Register Counter */
-	uint_fast16_t tima_count;	/* Timer Counter */
-	uint_fast16_t serial_count;	/* Serial Counter */
-	uint_fast32_t rtc_count;	/* RTC Counter */
+	uint_fast16_t tima_count;	/* Timer Counter at tima_base */
+	uint_fast32_t rtc_count;	/* RTC Counter at rtc_base */
 	uint_fast32_t lcd_off_count;	/* Cycles LCD has been disabled */
+
+	/* Cycles emulated since gb_init(). DIV and TIMA are calculated from
+	 * this when they are read. */
+	uint64_t cycles;
+	/* Cycle at which DIV was last 0. */
+	uint64_t div_base;
+	/* Cycle at which TIMA and tima_count were last brought up to date. */
+	uint64_t tima_base;
+	/* Cycle at which TIMA next overflows, or UINT64_MAX if the timer is
+	 * stopped. */
+	uint64_t timer_event;
+	/* Cycle at which the current serial transfer completes, or UINT64_MAX
+	 * if there is none. */
+	uint64_t serial_event;
+	/* Earliest cycle at which an event is due. */
+	uint64_t next_event;
+	/* Cycle at which the RTC and rtc_count were last brought up to date. */
+	uint64_t rtc_base;
+	/* Cycle at which gb_run_cycles() stops, even during HALT. UINT64_MAX
+	 * otherwise. */
+	uint64_t deadline;
+	/* Cycles of the next step of a HALT stopped at the deadline. */
+	uint_fast16_t halt_cycles;
+};
+
+/**
+ * Sprites found on each line, highest priority first. Rebuilt by
+ * __gb_index_sprites() before drawing a line if dirty is set, which happens
+ * when OAM is modified, or if a line is drawn with a different LCDC_OBJ_SIZE
+ * to obj_size.
+ */
+struct lcd_sprite_index_s
+{
+	uint8_t count[LCD_HEIGHT];
+	uint8_t sprites[LCD_HEIGHT][NUM_SPRITES];
+	bool dirty;
+	uint8_t obj_size;
+};
+
+/**
+ * Everything that the contents of a line depend on. The generation counters
+ * are incremented whenever the corresponding memory is changed, so two lines
+ * with equal state are drawn identically.
+ */
+struct lcd_line_s
+{
+	uint32_t tile_gen;	/* VRAM tile data (0x8000-0x97FF) */
+	uint32_t map_gen[2];	/* VRAM tile maps (0x9800, 0x9C00) */
+	uint32_t oam_gen;	/* OAM */
+
+	uint8_t LCDC;
+	uint8_t SCY;
+	uint8_t SCX;
+	uint8_t WX;
+	uint8_t BGP;
+	uint8_t OBP0;
+	uint8_t OBP1;
+	/* Line of the window to draw, or 0xFF if the window is not drawn. */
+	uint8_t win_line;
+};
+
+/**
+ * Both tile maps drawn in advance, so that the background and window of a
+ * line are copied from here instead of being decoded from the tiles. Allocated
+ * by the front-end and given to gb_set_bg_cache(). Each map entry is redrawn
+ * when it is next used after its tile index or tile data change.
+ */
+struct gb_bg_cache_s
+{
+	/* Colour number (0-3) of each pixel of the 256x256 maps. */
+	uint8_t pixels[2][256][256];
+	/* Tile that each map entry was drawn with, or 0xFFFF if the entry was
+	 * not drawn, and the generation of that tile when it was drawn. */
+	uint16_t tile[2][0x400];
+	uint32_t gen[2][0x400];
 };
 
+/* Type of each pixel output, and the number of them in each line. */
+#if PEANUT_GB_PIXEL_FORMAT == PEANUT_GB_PIXEL_INDEX8
+typedef uint8_t gb_pixel_t;
+# define LCD_LINE_SIZE	LCD_WIDTH
+#elif PEANUT_GB_PIXEL_FORMAT == PEANUT_GB_PIXEL_INDEX4
+typedef uint8_t gb_pixel_t;
+# define LCD_LINE_SIZE	(LCD_WIDTH / 2)
+#elif PEANUT_GB_PIXEL_FORMAT == PEANUT_GB_PIXEL_RGB555 || \
+	PEANUT_GB_PIXEL_FORMAT == PEANUT_GB_PIXEL_RGB565
+typedef uint16_t gb_pixel_t;
+# define LCD_LINE_SIZE	LCD_WIDTH
+#elif PEANUT_GB_PIXEL_FORMAT == PEANUT_GB_PIXEL_XRGB8888
+typedef uint32_t gb_pixel_t;
+# define LCD_LINE_SIZE	LCD_WIDTH
+#else
+# error Unknown PEANUT_GB_PIXEL_FORMAT
+#endif
+
 #if ENABLE_LCD
 	/* Bit mask for the shade of pixel to display */
 	#define LCD_COLOUR	0x03
@@ -561,6 +781,11 @@ struct count_s
 	#define LCD_PALETTE_BG	0
 	#define LCD_PALETTE_ALL 0
 # endif
+
+# if PEANUT_GB_PIXEL_FORMAT != PEANUT_GB_PIXEL_INDEX8 && \
+	PEANUT_GB_USE_DOUBLE_WIDTH_PALETTE
+#  error PEANUT_GB_USE_DOUBLE_WIDTH_PALETTE requires PEANUT_GB_PIXEL_INDEX8
+# endif
 #endif
 
 /**
@@ -598,9 +823,49 @@ enum gb_init_error_e
 enum gb_serial_rx_ret_e
 {
 	GB_SERIAL_RX_SUCCESS = 0,
-	GB_SERIAL_RX_NO_CONNECTION = 1
+	GB_SERIAL_RX_NO_CONNECTION = 1,
+	/* The byte has not arrived yet. The transfer is held open and the
+	 * receive function is called again shortly, while emulation
+	 * continues. */
+	GB_SERIAL_RX_PENDING = 2
+};
+
+/**
+ * Reasons for gb_run_until() to return.
+ */
+enum gb_stop_reason_e
+{
+	/* The given number of cycles have been run. */
+	GB_STOP_CYCLES = 0,
+	/* The LCD has entered VBlank. */
+	GB_STOP_VBLANK,
+	/* LY has changed to the line given to gb_set_stop_ly(). */
+	GB_STOP_LY,
+	/* A serial transfer has completed. */
+	GB_STOP_SERIAL,
+	/* The joypad register has been read. */
+	GB_STOP_JOYPAD_READ,
+	/* PC has reached the address given to gb_set_breakpoint(). */
+	GB_STOP_BREAKPOINT,
+	/* An invalid opcode was read. PC is left at its address. */
+	GB_STOP_INVALID_OPCODE
 };
 
+/* Events given to gb_run_until() to stop on, which may be ORed together. */
+#define GB_STOP_ON_VBLANK		(1 << GB_STOP_VBLANK)
+#define GB_STOP_ON_LY			(1 << GB_STOP_LY)
+#define GB_STOP_ON_SERIAL		(1 << GB_STOP_SERIAL)
+#define GB_STOP_ON_JOYPAD_READ		(1 << GB_STOP_JOYPAD_READ)
+#define GB_STOP_ON_BREAKPOINT		(1 << GB_STOP_BREAKPOINT)
+#define GB_STOP_ON_INVALID_OPCODE	(1 << GB_STOP_INVALID_OPCODE)
+
+/* Size of the RTC in save files, as written by gb_save_rtc(). */
+#define GB_RTC_SAVE_SIZE	48
+
+/* Version of the format written by gb_state_save(). Increased whenever the
+ * format changes, and older states are then rejected by gb_state_load(). */
+#define GB_STATE_VERSION	1
+
 union cart_rtc
 {
 	struct
@@ -666,10 +931,25 @@ struct gb_s
 	/* Read byte from boot ROM at given address. */
 	uint8_t (*gb_bootrom_read)(struct gb_s*, const uint_fast16_t addr);
 
+	/* Copy of the core that initialised this context. */
+	const struct gb_core_s *core;
+
+	/* GB_STOP_ON_* events that gb_run_until() is waiting for, and the
+	 * reason it stopped. */
+	uint8_t stop_events;
+	uint8_t stop_reason;
+	/* Line for GB_STOP_ON_LY. */
+	uint8_t stop_ly;
+	/* Address for GB_STOP_ON_BREAKPOINT. */
+	uint16_t breakpoint;
+
 	struct
 	{
 		bool gb_halt	: 1;
 		bool gb_ime	: 1;
+		/* Set if gb_run_cycles() stopped during HALT, before any
+		 * interrupt. */
+		bool halt_stopped : 1;
 		/* gb_frame is set when 0.016742706298828125 seconds have
 		 * passed. It is likely that a new frame has been drawn since
 		 * then, but it is possible that the LCD was switched off and
@@ -678,6 +958,9 @@ struct gb_s
 		bool lcd_blank	: 1;
 		/* Set if MBC3O cart is used. */
 		bool cart_is_mbc3O : 1;
+		/* Set if the RTC follows the host clock given to gb_sync_rtc()
+		 * rather than the emulated clock. */
+		bool rtc_host_sync : 1;
 	};
 
 	/* Cartridge information:
@@ -698,6 +981,8 @@ struct gb_s
 	uint8_t cart_mode_select;
 
 	union cart_rtc rtc_latched, rtc_real;
+	/* Host time of the last call to gb_sync_rtc(). */
+	int64_t rtc_host_time;
 
 	struct cpu_registers_s cpu_reg;
 	//struct gb_registers_s gb_reg;
@@ -715,7 +1000,12 @@ struct gb_s
 		 * Draw line on screen.
 		 *
 		 * \param gb_s		emulator context
-		 * \param pixels	The 160 pixels to draw.
+		 * \param pixels	The 160 pixels to draw, or NULL if
+		 * 			direct.skip_unchanged is set and the
+		 * 			line is identical to the last time it
+		 * 			was drawn.
+		 * 			Pixels are in PEANUT_GB_PIXEL_FORMAT.
+		 * 			For PEANUT_GB_PIXEL_INDEX8:
 		 * 			Bits 1-0 are the colour to draw.
 		 * 			Bits 5-4 are the palette, where:
 		 * 				OBJ0 = 0b00,
@@ -731,19 +1021,83 @@ struct gb_s
 		 * guaranteed to be between 0-144 inclusive.
 		 */
 		void (*lcd_draw_line)(struct gb_s *gb,
-				const uint8_t *pixels,
+				const gb_pixel_t *pixels,
 				const uint_fast8_t line);
 
-		/* Palettes */
-		uint8_t bg_palette[4];
-		uint8_t sp_palette[8];
+		/* Framebuffer that lines are drawn straight into instead of
+		 * calling lcd_draw_line, if set with gb_init_lcd_fb(). Line n
+		 * is drawn at fb + (fb_pitch * n) bytes. */
+		uint8_t *fb;
+		size_t fb_pitch;
+		/* Called at the start of VBLANK when drawing into fb. May be
+		 * NULL. lines_drawn is the number of lines written to the
+		 * framebuffer since the previous call. */
+		void (*lcd_frame_done)(struct gb_s *gb,
+				const uint_fast8_t lines_drawn);
+		uint8_t lines_drawn;
+
+		/* Look-up table converting pixels to PEANUT_GB_PIXEL_FORMAT,
+		 * set with gb_set_lcd_palette(). Unused for
+		 * PEANUT_GB_PIXEL_INDEX8. */
+		uint32_t palette[16];
 
 		uint8_t window_clear;
 		uint8_t WY;
 
+		/* Sprites found on each line. */
+		struct lcd_sprite_index_s sprite_index;
+
+		/* Generation counters of VRAM and OAM, incremented whenever
+		 * their contents change. */
+		uint32_t tile_gen;
+		uint32_t map_gen[2];
+		uint32_t oam_gen;
+		/* Generation of each tile, incremented whenever it changes. */
+		uint32_t tile_gens[NUM_TILES];
+
+		/* Tile maps drawn in advance, if set with gb_set_bg_cache(). */
+		struct gb_bg_cache_s *bg_cache;
+
+		/* State that each line was last drawn with. */
+		struct lcd_line_s lines[LCD_HEIGHT];
+		/* State of each line captured during the current frame. */
+		struct lcd_line_s captured[LCD_HEIGHT];
+
+		/* Lines captured but not yet drawn when deferred rendering
+		 * is enabled. */
+		uint8_t pending[LCD_HEIGHT];
+		uint8_t pending_count;
+
+		/* Render thread, if enabled with gb_set_render_thread(). */
+		struct gb_render_worker_s *worker;
+		/* 256 byte pages of VRAM modified since they were last sent
+		 * to the render thread. */
+		uint32_t vram_dirty;
+
+		/* Frame skip of skip_render in every skip_period frames, set
+		 * with gb_set_frame_skip(). Disabled if skip_period is 0. */
+		uint8_t skip_render;
+		uint8_t skip_period;
+		uint8_t skip_phase;
+		/* Most frames that may be skipped in a row by automatic frame
+		 * skip, or 0 if disabled. */
+		uint8_t skip_auto_max;
+		/* Number of frames skipped in a row. */
+		uint8_t skip_run;
+		/* Host time in microseconds that emulation is behind real
+		 * time, as reported with gb_report_frame_time(). */
+		int32_t skip_debt;
+
+		/* Number of frames drawn and skipped. */
+		uint32_t frames_rendered;
+		uint32_t frames_skipped;
+
 		/* Only support 30fps frame skip. */
 		bool frame_skip_count : 1;
 		bool interlace_count : 1;
+		/* Set if the current frame is skipped by gb_set_frame_skip()
+		 * or automatic frame skip. */
+		bool skip_frame : 1;
 	} display;
 
 	/**
@@ -760,6 +1114,22 @@ struct gb_s
 		 */
 		bool interlace : 1;
 		bool frame_skip : 1;
+		/* Set to skip drawing lines that are identical to the last
+		 * time they were drawn. lcd_draw_line is still called for
+		 * these lines, but with pixels set to NULL. */
+		bool skip_unchanged : 1;
+		/* Set to draw each frame in one pass at the start of VBLANK,
+		 * or before VRAM or OAM are modified, instead of drawing each
+		 * line as it is reached. The register values used by each
+		 * line are recorded, so mid-frame changes are still shown. */
+		bool deferred_render : 1;
+
+		/* Layers to draw, as GB_RENDER_* bits. If 0, no pixel work is
+		 * done and the front-end is not called for any line, but the
+		 * LCD state is still tracked so that drawing can be enabled
+		 * again at any time, such as to take a screenshot. Set to
+		 * GB_RENDER_ALL by gb_init_lcd(). */
+		uint8_t render_mask;
 
 		union
 		{
@@ -786,8 +1156,90 @@ struct gb_s
 	} direct;
 };
 
+/**
+ * Entry points of one compiled copy of the core. Initialising a context with
+ * the init function of a table selects that copy for the context, and
+ * gb->core then points to the same table, so code that runs contexts of any
+ * copy, and saves or loads their state, should call through it.
+ * Other functions, such as gb_init_lcd(), may be called from any copy, but the
+ * render thread draws with the options of the copy that started it.
+ */
+struct gb_core_s
+{
+	/* PEANUT_GB_VARIANT of this copy, or "default". */
+	const char *name;
+	enum gb_init_error_e (*init)(struct gb_s *gb,
+			uint8_t (*gb_rom_read)(struct gb_s*, const uint_fast32_t),
+			uint8_t (*gb_cart_ram_read)(struct gb_s*, const uint_fast32_t),
+			void (*gb_cart_ram_write)(struct gb_s*, const uint_fast32_t, const uint8_t),
+			void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
+			void *priv);
+	void (*reset)(struct gb_s *gb);
+	void (*run_frame)(struct gb_s *gb);
+	uint_fast32_t (*run_cycles)(struct gb_s *gb, uint_fast32_t cycles);
+	enum gb_stop_reason_e (*run_until)(struct gb_s *gb,
+			const uint_fast8_t events, uint_fast32_t cycles);
+	size_t (*state_size)(const struct gb_s *gb);
+	int (*state_save)(struct gb_s *gb, uint8_t *state, const size_t size);
+	int (*state_load)(struct gb_s *gb, const uint8_t *state,
+			const size_t size);
+};
+
+/* Declares the table of a copy compiled with PEANUT_GB_VARIANT set to name. */
+#define PEANUT_GB_DECLARE_CORE(name) \
+	extern const struct gb_core_s gb_core_ ## name
+
+/* Table of the copy of the core compiled by this file, or of the copy compiled
+ * without PEANUT_GB_VARIANT when PEANUT_GB_HEADER_ONLY is defined. */
+extern const struct gb_core_s gb_core;
+
 #ifndef PEANUT_GB_HEADER_ONLY
 
+/* Callbacks, either bound at compile time or called through the pointers in
+ * the emulator context. */
+#ifdef PEANUT_GB_ROM_READ
+static uint8_t PEANUT_GB_ROM_READ(struct gb_s *gb, const uint_fast32_t addr);
+# define PGB_ROM_READ(gb, addr)		PEANUT_GB_ROM_READ(gb, addr)
+#else
+# define PGB_ROM_READ(gb, addr)		(gb)->gb_rom_read(gb, addr)
+#endif
+
+#ifdef PEANUT_GB_CART_RAM_READ
+static uint8_t PEANUT_GB_CART_RAM_READ(struct gb_s *gb,
+		const uint_fast32_t addr);
+# define PGB_CART_RAM_READ(gb, addr)	PEANUT_GB_CART_RAM_READ(gb, addr)
+#else
+# define PGB_CART_RAM_READ(gb, addr)	(gb)->gb_cart_ram_read(gb, addr)
+#endif
+
+#ifdef PEANUT_GB_CART_RAM_WRITE
+static void PEANUT_GB_CART_RAM_WRITE(struct gb_s *gb,
+		const uint_fast32_t addr, const uint8_t val);
+# define PGB_CART_RAM_WRITE(gb, addr, val) \
+	PEANUT_GB_CART_RAM_WRITE(gb, addr, val)
+#else
+# define PGB_CART_RAM_WRITE(gb, addr, val) \
+	(gb)->gb_cart_ram_write(gb, addr, val)
+#endif
+
+#ifdef PEANUT_GB_ERROR
+static void PEANUT_GB_ERROR(struct gb_s *gb, const enum gb_error_e gb_err,
+		const uint16_t addr);
+# define PGB_ERROR(gb, err, addr)	PEANUT_GB_ERROR(gb, err, addr)
+#else
+# define PGB_ERROR(gb, err, addr)	(gb)->gb_error(gb, err, addr)
+#endif
+
+#if ENABLE_LCD && defined(PEANUT_GB_LCD_DRAW_LINE)
+static void PEANUT_GB_LCD_DRAW_LINE(struct gb_s *gb,
+		const gb_pixel_t *pixels, const uint_fast8_t line);
+# define PGB_LCD_DRAW_LINE(gb, pixels, line) \
+	PEANUT_GB_LCD_DRAW_LINE(gb, pixels, line)
+#else
+# define PGB_LCD_DRAW_LINE(gb, pixels, line) \
+	(gb)->display.lcd_draw_line(gb, pixels, line)
+#endif
+
 #define IO_JOYP	0x00
 #define IO_SB	0x01
 #define IO_SC	0x02
@@ -813,6 +1265,9 @@ struct gb_s
 
 #define IO_TAC_RATE_MASK	0x3
 #define IO_TAC_ENABLE_MASK	0x4
+/* TIMA is incremented every 1 << PGB_TAC_SHIFT(TAC) cycles, which is 1024, 16,
+ * 64 or 256 cycles for each rate. */
+#define PGB_TAC_SHIFT(tac)	(((((tac) - 1) & IO_TAC_RATE_MASK) * 2) + 4)
 
 /* LCD Mode defines. */
 #define IO_STAT_MODE_HBLANK		0
@@ -821,6 +1276,259 @@ struct gb_s
 #define IO_STAT_MODE_LCD_DRAW		3
 #define IO_STAT_MODE_VBLANK_OR_TRANSFER_MASK 0x1
 
+#if ENABLE_LCD
+static void __gb_flush_lines(struct gb_s *gb);
+
+/* Draws any deferred lines before memory that they depend on is modified. */
+# define PGB_FLUSH_LINES(gb)						\
+	do {								\
+		if((gb)->display.pending_count != 0)			\
+			__gb_flush_lines(gb);				\
+	} while(0)
+#else
+# define PGB_FLUSH_LINES(gb) do {} while(0)
+#endif
+
+/**
+ * Returns the current value of DIV.
+ */
+static uint8_t __gb_read_div(const struct gb_s *gb)
+{
+	return (uint8_t)((gb->counter.cycles - gb->counter.div_base) /
+			 DIV_CYCLES);
+}
+
+/**
+ * Returns the current value of TIMA. Any overflow up to the current cycle has
+ * already been handled by __gb_update_timer().
+ */
+static uint8_t __gb_read_tima(const struct gb_s *gb)
+{
+	const uint8_t tac = gb->hram_io[IO_TAC];
+
+	if(!(tac & IO_TAC_ENABLE_MASK))
+		return gb->hram_io[IO_TIMA];
+
+	return gb->hram_io[IO_TIMA] + (uint8_t)((gb->counter.tima_count +
+			(gb->counter.cycles - gb->counter.tima_base)) >>
+			PGB_TAC_SHIFT(tac));
+}
+
+/**
+ * Sets next_event to the earliest of the scheduled events.
+ */
+static void __gb_schedule(struct gb_s *gb)
+{
+	gb->counter.next_event = gb->counter.timer_event;
+
+	if(gb->counter.serial_event < gb->counter.next_event)
+		gb->counter.next_event = gb->counter.serial_event;
+}
+
+/**
+ * Brings TIMA up to date with the current cycle, requesting the timer
+ * interrupt for each overflow and reloading TIMA from TMA, and schedules the
+ * next overflow.
+ */
+static void __gb_update_timer(struct gb_s *gb)
+{
+	const uint8_t tac = gb->hram_io[IO_TAC];
+
+	if(tac & IO_TAC_ENABLE_MASK)
+	{
+		const uint_fast8_t shift = PGB_TAC_SHIFT(tac);
+		const uint64_t count = gb->counter.tima_count +
+			(gb->counter.cycles - gb->counter.tima_base);
+		uint64_t ticks = count >> shift;
+
+		while(ticks >= (uint_fast16_t)(0x100 - gb->hram_io[IO_TIMA]))
+		{
+			ticks -= 0x100 - gb->hram_io[IO_TIMA];
+			gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
+			gb->hram_io[IO_IF] |= TIMER_INTR;
+		}
+
+		gb->hram_io[IO_TIMA] += (uint8_t)ticks;
+		gb->counter.tima_count = count & ((1 << shift) - 1);
+		gb->counter.tima_base = gb->counter.cycles;
+		gb->counter.timer_event = gb->counter.cycles +
+			((uint64_t)(0x100 - gb->hram_io[IO_TIMA]) << shift) -
+			gb->counter.tima_count;
+	}
+	else
+	{
+		gb->counter.tima_base = gb->counter.cycles;
+		gb->counter.timer_event = UINT64_MAX;
+	}
+
+	__gb_schedule(gb);
+}
+
+/**
+ * Starts a serial transfer of SB, which completes SERIAL_CYCLES later.
+ */
+static void __gb_start_serial(struct gb_s *gb)
+{
+	if(gb->gb_serial_tx != NULL)
+		(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
+
+	gb->counter.serial_event = gb->counter.cycles + SERIAL_CYCLES;
+	__gb_schedule(gb);
+}
+
+/**
+ * Stops gb_run_until() once the current step is done, if it is waiting for
+ * the event of the given reason.
+ */
+static void __gb_stop_event(struct gb_s *gb,
+		const enum gb_stop_reason_e reason)
+{
+	if(!(gb->stop_events & (1 << reason)))
+		return;
+
+	gb->stop_events = 0;
+	gb->stop_reason = reason;
+	gb->counter.deadline = 0;
+}
+
+/**
+ * Completes the current serial transfer with the byte received by the
+ * front-end, or keeps it open if the byte has not arrived yet.
+ */
+static void __gb_finish_serial(struct gb_s *gb)
+{
+	enum gb_serial_rx_ret_e ret = GB_SERIAL_RX_NO_CONNECTION;
+	uint8_t rx;
+
+	if(gb->gb_serial_rx != NULL)
+		ret = gb->gb_serial_rx(gb, &rx);
+
+	if(ret == GB_SERIAL_RX_SUCCESS)
+	{
+		gb->hram_io[IO_SB] = rx;
+	}
+	else if(ret == GB_SERIAL_RX_PENDING)
+	{
+		gb->counter.serial_event = gb->counter.cycles +
+			SERIAL_POLL_CYCLES;
+		__gb_schedule(gb);
+		return;
+	}
+	else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
+	{
+		/* If using internal clock, and console is not attached to
+		 * any external peripheral, shifted bits are replaced with
+		 * logic 1. */
+		gb->hram_io[IO_SB] = 0xFF;
+	}
+	else
+	{
+		/* If using external clock, and console is not attached to
+		 * any external peripheral, bits are not shifted, so SB is not
+		 * modified. Wait for another transfer. */
+		__gb_start_serial(gb);
+		return;
+	}
+
+	/* Inform game of serial TX/RX completion. */
+	gb->hram_io[IO_SC] &= 0x01;
+	gb->hram_io[IO_IF] |= SERIAL_INTR;
+	gb->counter.serial_event = UINT64_MAX;
+	__gb_schedule(gb);
+	__gb_stop_event(gb, GB_STOP_SERIAL);
+}
+
+/**
+ * Handles every event that is due by the current cycle.
+ */
+static void __gb_run_events(struct gb_s *gb)
+{
+	if(gb->counter.cycles >= gb->counter.serial_event)
+		__gb_finish_serial(gb);
+
+	if(gb->counter.cycles >= gb->counter.timer_event)
+		__gb_update_timer(gb);
+}
+
+/**
+ * Advances an RTC register that counts from 0 to limit - 1 by n. A register
+ * set to limit or higher counts up to max and then wraps to 0 without carrying
+ * into the next register, as on hardware. Returns the carry into the next
+ * register.
+ */
+static uint_fast32_t __gb_advance_rtc_reg(uint8_t *reg, uint_fast32_t n,
+		const uint_fast8_t limit, const uint_fast8_t max)
+{
+	uint_fast32_t total;
+
+	if(PGB_UNLIKELY(*reg >= limit))
+	{
+		const uint_fast8_t to_zero = max + 1 - *reg;
+
+		if(n < to_zero)
+		{
+			*reg += n;
+			return 0;
+		}
+
+		n -= to_zero;
+		*reg = 0;
+	}
+
+	total = *reg + n;
+	*reg = total % limit;
+	return total / limit;
+}
+
+/**
+ * Advances the RTC by the given number of seconds, unless it is halted.
+ */
+static void __gb_advance_rtc(union cart_rtc *rtc, uint_fast32_t secs)
+{
+	uint_fast32_t days;
+
+	if(rtc->reg.high & 0x40)
+		return;
+
+	secs = __gb_advance_rtc_reg(&rtc->reg.sec, secs, 60, 63);
+	secs = __gb_advance_rtc_reg(&rtc->reg.min, secs, 60, 63);
+	days = __gb_advance_rtc_reg(&rtc->reg.hour, secs, 24, 31);
+	if(days == 0)
+		return;
+
+	/* The day counter is 9 bits, with bit 8 in bit 0 of high. */
+	days += ((rtc->reg.high & 1) << 8) | rtc->reg.yday;
+	if(days > 0x1FF)
+		rtc->reg.high |= 0x80; /* Overflow bit */
+
+	rtc->reg.yday = days & 0xFF;
+	rtc->reg.high = (rtc->reg.high & 0xFE) | ((days >> 8) & 1);
+}
+
+/**
+ * Brings the MBC3 RTC up to date with the current cycle. The RTC is only
+ * calculated when it is latched or written.
+ */
+static void __gb_update_rtc(struct gb_s *gb)
+{
+	uint64_t count;
+
+	if(gb->mbc != 3)
+		return;
+
+	count = gb->counter.rtc_count +
+		(gb->counter.cycles - gb->counter.rtc_base);
+	gb->counter.rtc_base = gb->counter.cycles;
+
+	/* The RTC does not count while halted, or when it follows the host
+	 * clock instead. */
+	if(gb->rtc_host_sync || (gb->rtc_real.reg.high & 0x40))
+		return;
+
+	gb->counter.rtc_count = count % RTC_CYCLES;
+	__gb_advance_rtc(&gb->rtc_real, (uint_fast32_t)(count / RTC_CYCLES));
+}
+
 /**
  * Internal function used to read bytes.
  * addr is host platform endian.
@@ -841,17 +1549,17 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 	case 0x1:
 	case 0x2:
 	case 0x3:
-		return gb->gb_rom_read(gb, addr);
+		return PGB_ROM_READ(gb, addr);
 
 	case 0x4:
 	case 0x5:
 	case 0x6:
 	case 0x7:
 		if(gb->mbc == 1 && gb->cart_mode_select)
-			return gb->gb_rom_read(gb,
-					       addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE);
+			return PGB_ROM_READ(gb,
+					    addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE);
 		else
-			return gb->gb_rom_read(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
+			return PGB_ROM_READ(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
 
 	case 0x8:
 	case 0x9:
@@ -869,16 +1577,16 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 			{
 				/* Only 9 bits are available in address. */
 				addr &= 0x1FF;
-				return gb->gb_cart_ram_read(gb, addr);
+				return PGB_CART_RAM_READ(gb, addr);
 			}
 			else if((gb->cart_mode_select || gb->mbc != 1) &&
 					gb->cart_ram_bank < gb->num_ram_banks)
 			{
-				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR +
-							    (gb->cart_ram_bank * CRAM_BANK_SIZE));
+				return PGB_CART_RAM_READ(gb, addr - CART_RAM_ADDR +
+							 (gb->cart_ram_bank * CRAM_BANK_SIZE));
 			}
 			else
-				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR);
+				return PGB_CART_RAM_READ(gb, addr - CART_RAM_ADDR);
 		}
 
 		return 0xFF;
@@ -921,6 +1629,16 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 #endif
 		}
 
+		/* Timer registers are only calculated when read. */
+		if(addr == 0xFF04)
+			return __gb_read_div(gb);
+
+		if(addr == 0xFF05)
+			return __gb_read_tima(gb);
+
+		if(addr == 0xFF00)
+			__gb_stop_event(gb, GB_STOP_JOYPAD_READ);
+
 		/* HRAM */
 		if(addr >= IO_ADDR)
 			return gb->hram_io[addr - IO_ADDR];
@@ -928,7 +1646,7 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 
 
 	/* Return address that caused read error. */
-	(gb->gb_error)(gb, GB_INVALID_READ, addr);
+	PGB_ERROR(gb, GB_INVALID_READ, addr);
 	PGB_UNREACHABLE();
 }
 
@@ -1027,7 +1745,10 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 	case 0x7:
 		val &= 1;
 		if(gb->mbc == 3 && val && gb->cart_mode_select == 0)
+		{
+			__gb_update_rtc(gb);
 			memcpy(&gb->rtc_latched.bytes, &gb->rtc_real.bytes, sizeof(gb->rtc_latched.bytes));
+		}
 
 		/* Set banking mode select. */
 		gb->cart_mode_select = val;
@@ -1035,7 +1756,22 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 
 	case 0x8:
 	case 0x9:
-		gb->vram[addr - VRAM_ADDR] = val;
+		if(gb->vram[addr - VRAM_ADDR] != val)
+		{
+			PGB_FLUSH_LINES(gb);
+			gb->vram[addr - VRAM_ADDR] = val;
+#if PEANUT_GB_RENDER_THREAD
+			gb->display.vram_dirty |= (uint32_t)1 << ((addr >> 8) & 0x1F);
+#endif
+
+			if(addr < VRAM_BMAP_1 + VRAM_ADDR)
+			{
+				gb->display.tile_gen++;
+				gb->display.tile_gens[(addr - VRAM_ADDR) >> 4]++;
+			}
+			else
+				gb->display.map_gen[(addr >> 10) & 1]++;
+		}
 		return;
 
 	case 0xA:
@@ -1048,6 +1784,8 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			uint8_t reg = gb->cart_ram_bank - 0x08;
 			//if(reg == 0) gb->counter.rtc_count = 0;
 
+			/* Count up to this write with the old halt bit. */
+			__gb_update_rtc(gb);
 			gb->rtc_real.bytes[reg] = val & rtc_reg_mask[reg];
 		}
 		/* Do not write to RAM if unavailable or disabled. */
@@ -1061,7 +1799,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 				val &= 0x0F;
 				/* Upper nibble is set to high. */
 				val |= 0xF0;
-				gb->gb_cart_ram_write(gb, addr, val);
+				PGB_CART_RAM_WRITE(gb, addr, val);
 			}
 			/* If cart has RAM, use this. If MBC1, only the first
 			 * RAM bank can be written to if the advanced banking
@@ -1069,11 +1807,11 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			else if(((gb->mbc == 1 && gb->cart_mode_select) || gb->mbc != 1) &&
 					gb->cart_ram_bank < gb->num_ram_banks)
 			{
-				gb->gb_cart_ram_write(gb,
+				PGB_CART_RAM_WRITE(gb,
 					addr - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE), val);
 			}
 			else if(gb->num_ram_banks)
-				gb->gb_cart_ram_write(gb, addr - CART_RAM_ADDR, val);
+				PGB_CART_RAM_WRITE(gb, addr - CART_RAM_ADDR, val);
 		}
 
 		return;
@@ -1099,7 +1837,13 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 
 		if(addr < UNUSED_ADDR)
 		{
-			gb->oam[addr - OAM_ADDR] = val;
+			if(gb->oam[addr - OAM_ADDR] != val)
+			{
+				PGB_FLUSH_LINES(gb);
+				gb->oam[addr - OAM_ADDR] = val;
+				gb->display.oam_gen++;
+				gb->display.sprite_index.dirty = true;
+			}
 			return;
 		}
 
@@ -1149,15 +1893,30 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 
 		case 0x02:
 			gb->hram_io[IO_SC] = val;
+
+			if(!(val & SERIAL_SC_TX_START))
+			{
+				gb->counter.serial_event = UINT64_MAX;
+				__gb_schedule(gb);
+			}
+			else if(gb->counter.serial_event == UINT64_MAX)
+				__gb_start_serial(gb);
+
 			return;
 
 		/* Timer Registers */
 		case 0x04:
-			gb->hram_io[IO_DIV] = 0x00;
+			/* Only DIV is cleared, so the next increment still
+			 * happens DIV_CYCLES after the previous one. */
+			gb->counter.div_base = gb->counter.cycles -
+				(gb->counter.cycles - gb->counter.div_base) %
+				DIV_CYCLES;
 			return;
 
 		case 0x05:
+			__gb_update_timer(gb);
 			gb->hram_io[IO_TIMA] = val;
+			__gb_update_timer(gb);
 			return;
 
 		case 0x06:
@@ -1165,7 +1924,9 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			return;
 
 		case 0x07:
+			__gb_update_timer(gb);
 			gb->hram_io[IO_TAC] = val;
+			__gb_update_timer(gb);
 			return;
 
 		/* Interrupt Flag Register */
@@ -1195,6 +1956,9 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 				 * of VBLANK even though this damages real
 				 * hardware. */
 
+				/* Finish drawing the lines that were shown. */
+				PGB_FLUSH_LINES(gb);
+
 				/* Set LCD to Mode 0. */
 				gb->hram_io[IO_STAT] =
 					(gb->hram_io[IO_STAT] & ~STAT_MODE) |
@@ -1233,13 +1997,25 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		{
 			uint16_t dma_addr;
 			uint16_t i;
+			bool changed = false;
 
 			dma_addr = (uint_fast16_t)val << 8;
 			gb->hram_io[IO_DMA] = val;
 
+			PGB_FLUSH_LINES(gb);
+
 			for(i = 0; i < OAM_SIZE; i++)
 			{
-				gb->oam[i] = __gb_read(gb, dma_addr + i);
+				const uint8_t oam_val = __gb_read(gb, dma_addr + i);
+
+				changed |= gb->oam[i] != oam_val;
+				gb->oam[i] = oam_val;
+			}
+
+			if(changed)
+			{
+				gb->display.oam_gen++;
+				gb->display.sprite_index.dirty = true;
 			}
 
 			return;
@@ -1248,44 +2024,14 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		/* DMG Palette Registers */
 		case 0x47:
 			gb->hram_io[IO_BGP] = val;
-			gb->display.bg_palette[0] = ((gb->hram_io[IO_BGP] & 0x03)) | LCD_PALETTE_BG;
-			gb->display.bg_palette[1] = ((gb->hram_io[IO_BGP] >> 2) & 0x03) | LCD_PALETTE_BG;
-			gb->display.bg_palette[2] = ((gb->hram_io[IO_BGP] >> 4) & 0x03) | LCD_PALETTE_BG;
-			gb->display.bg_palette[3] = ((gb->hram_io[IO_BGP] >> 6) & 0x03) | LCD_PALETTE_BG;
-#if PEANUT_GB_USE_DOUBLE_WIDTH_PALETTE
-			gb->display.bg_palette[0] |= gb->display.bg_palette[0] << 4;
-			gb->display.bg_palette[1] |= gb->display.bg_palette[1] << 4;
-			gb->display.bg_palette[2] |= gb->display.bg_palette[2] << 4;
-			gb->display.bg_palette[3] |= gb->display.bg_palette[3] << 4;
-#endif
 			return;
 
 		case 0x48:
 			gb->hram_io[IO_OBP0] = val;
-			gb->display.sp_palette[0] = ((gb->hram_io[IO_OBP0] & 0x03));
-			gb->display.sp_palette[1] = ((gb->hram_io[IO_OBP0] >> 2) & 0x03);
-			gb->display.sp_palette[2] = ((gb->hram_io[IO_OBP0] >> 4) & 0x03);
-			gb->display.sp_palette[3] = ((gb->hram_io[IO_OBP0] >> 6) & 0x03);
-#if PEANUT_GB_USE_DOUBLE_WIDTH_PALETTE
-			gb->display.sp_palette[0] |= gb->display.sp_palette[0] << 4;
-			gb->display.sp_palette[1] |= gb->display.sp_palette[1] << 4;
-			gb->display.sp_palette[2] |= gb->display.sp_palette[2] << 4;
-			gb->display.sp_palette[3] |= gb->display.sp_palette[3] << 4;
-#endif
 			return;
 
 		case 0x49:
 			gb->hram_io[IO_OBP1] = val;
-			gb->display.sp_palette[4] = ((gb->hram_io[IO_OBP1] & 0x03)) | LCD_PALETTE_OBJ;
-			gb->display.sp_palette[5] = ((gb->hram_io[IO_OBP1] >> 2) & 0x03) | LCD_PALETTE_OBJ;
-			gb->display.sp_palette[6] = ((gb->hram_io[IO_OBP1] >> 4) & 0x03) | LCD_PALETTE_OBJ;
-			gb->display.sp_palette[7] = ((gb->hram_io[IO_OBP1] >> 6) & 0x03) | LCD_PALETTE_OBJ;
-#if PEANUT_GB_USE_DOUBLE_WIDTH_PALETTE
-			gb->display.sp_palette[4] |= gb->display.sp_palette[4] << 4;
-			gb->display.sp_palette[5] |= gb->display.sp_palette[5] << 4;
-			gb->display.sp_palette[6] |= gb->display.sp_palette[6] << 4;
-			gb->display.sp_palette[7] |= gb->display.sp_palette[7] << 4;
-#endif
 			return;
 
 		/* Window Position Registers */
@@ -1501,56 +2247,242 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 }
 
 #if ENABLE_LCD
-struct sprite_data {
-	uint8_t sprite_number;
-	uint8_t x;
-};
-
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-static int compare_sprites(const struct sprite_data *const sd1, const struct sprite_data *const sd2)
+/**
+ * Sorts the sprites in OAM into per-line buckets, so that drawing a line does
+ * not require all sprites to be searched. Each bucket is stored with the
+ * highest priority sprite first.
+ */
+static void __gb_index_sprites(struct lcd_sprite_index_s *index,
+			       const uint8_t *oam, const uint8_t obj_size)
 {
-	int x_res;
+	const uint8_t obj_height = obj_size ? 16 : 8;
+	uint8_t sprite_number;
 
-	x_res = (int)sd1->x - (int)sd2->x;
-	if(x_res != 0)
-		return x_res;
+	memset(index->count, 0, sizeof(index->count));
 
-	return (int)sd1->sprite_number - (int)sd2->sprite_number;
-}
+	for(sprite_number = 0; sprite_number < NUM_SPRITES; sprite_number++)
+	{
+		/* Sprite Y position. The sprite is displayed on lines OY - 16
+		 * to OY - 16 + obj_height - 1. */
+		const int top = (int)oam[4 * sprite_number + 0] - 16;
+		int ly = top < 0 ? 0 : top;
+		const int end = MIN(top + obj_height, LCD_HEIGHT);
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+		/* Sprite X position. */
+		const uint8_t OX = oam[4 * sprite_number + 1];
 #endif
 
-void __gb_draw_line(struct gb_s *gb)
-{
-	uint8_t pixels[160] = {0};
+		for(; ly < end; ly++)
+		{
+			uint8_t *const line = index->sprites[ly];
+			uint8_t count = index->count[ly];
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+			uint8_t place;
 
-	/* If LCD not initialised by front-end, don't render anything. */
-	if(gb->display.lcd_draw_line == NULL)
-		return;
+			/* Keep the bucket sorted by X position, then by OAM
+			 * index, limited to the maximum number of sprites that
+			 * the Game Boy is able to render on each line (10
+			 * sprites). */
+			for(place = count; place != 0; place--)
+			{
+				if(oam[4 * line[place - 1] + 1] <= OX)
+					break;
+			}
 
-	if(gb->direct.frame_skip && !gb->display.frame_skip_count)
-		return;
+			if(place >= MAX_SPRITES_LINE)
+				continue;
 
-	/* If interlaced mode is activated, check if we need to draw the current
-	 * line. */
-	if(gb->direct.interlace)
-	{
-		if((!gb->display.interlace_count
-				&& (gb->hram_io[IO_LY] & 1) == 0)
-				|| (gb->display.interlace_count
-				    && (gb->hram_io[IO_LY] & 1) == 1))
-		{
-			/* Compensate for missing window draw if required. */
-			if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-					&& gb->hram_io[IO_LY] >= gb->display.WY
-					&& gb->hram_io[IO_WX] <= 166)
-				gb->display.window_clear++;
+			/* Discard the sprite with the lowest priority if the
+			 * bucket is full. */
+			if(count < MAX_SPRITES_LINE)
+				count++;
 
-			return;
+			memmove(&line[place + 1], &line[place], count - 1 - place);
+			line[place] = sprite_number;
+#else
+			line[count++] = sprite_number;
+#endif
+			index->count[ly] = count;
 		}
 	}
 
+	index->dirty = false;
+	index->obj_size = obj_size;
+}
+
+/**
+ * Converts a DMG palette register into the colours sent to the front-end.
+ */
+static void __gb_decode_palette(uint8_t *palette, const uint8_t reg,
+				const uint8_t layer)
+{
+	uint8_t i;
+
+	for(i = 0; i < 4; i++)
+	{
+		palette[i] = ((reg >> (i * 2)) & LCD_COLOUR) | layer;
+#if PEANUT_GB_USE_DOUBLE_WIDTH_PALETTE
+		palette[i] |= palette[i] << 4;
+#endif
+	}
+}
+
+#if PEANUT_GB_PIXEL_FORMAT != PEANUT_GB_PIXEL_INDEX8
+/* Index into display.palette of a pixel. */
+# if PEANUT_GB_USE_NIBBLE_FOR_PALETTE || !PEANUT_GB_12_COLOUR
+#  define PGB_PALETTE_INDEX(p)	((p) & 0x0F)
+# else
+#  define PGB_PALETTE_INDEX(p)	\
+	(((p) & LCD_COLOUR) | (((p) & LCD_PALETTE_ALL) >> 2))
+# endif
+#endif
+
+/**
+ * Makes sure that a map entry is drawn in the cache with the current contents
+ * of its tile.
+ */
+static void __gb_cache_map_entry(struct gb_bg_cache_s *cache,
+				 const uint8_t *vram, const uint32_t *tile_gens,
+				 const uint8_t map, const bool tile_select,
+				 const uint16_t entry)
+{
+	const uint8_t idx = vram[(map ? VRAM_BMAP_2 : VRAM_BMAP_1) + entry];
+	const uint16_t tile = tile_select ? idx : 0x80 + ((idx + 0x80) & 0xFF);
+	uint8_t *dst;
+	uint8_t py;
+
+	if(cache->tile[map][entry] == tile &&
+			cache->gen[map][entry] == tile_gens[tile])
+		return;
+
+	dst = &cache->pixels[map][(entry >> 5) * 8][(entry & 0x1F) * 8];
+
+	for(py = 0; py < 8; py++, dst += 256)
+	{
+		const uint8_t t1 = vram[VRAM_TILES_1 + tile * 0x10 + 2 * py];
+		const uint8_t t2 = vram[VRAM_TILES_1 + tile * 0x10 + 2 * py + 1];
+		uint8_t px;
+
+		for(px = 0; px < 8; px++)
+			dst[px] = ((t1 >> (7 - px)) & 1) |
+				  (((t2 >> (7 - px)) << 1) & 2);
+	}
+
+	cache->tile[map][entry] = tile;
+	cache->gen[map][entry] = tile_gens[tile];
+}
+
+/**
+ * Draws n pixels of row y of a tile map from the cache, starting at column x
+ * and wrapping around at the edge of the map.
+ */
+static void __gb_draw_cached_map(struct gb_bg_cache_s *cache,
+				 const uint8_t *vram, const uint32_t *tile_gens,
+				 const uint8_t map, const bool tile_select,
+				 const uint8_t y, uint8_t x, uint8_t n,
+				 const uint8_t *bg_palette, uint8_t *pixels)
+{
+	const uint8_t *row = cache->pixels[map][y];
+	const uint8_t last = (uint8_t)(x + n - 1) >> 3;
+	uint8_t col;
+
+	for(col = x >> 3; ; col = (col + 1) & 0x1F)
+	{
+		__gb_cache_map_entry(cache, vram, tile_gens, map, tile_select,
+				     (y >> 3) * 0x20 + col);
+
+		if(col == last)
+			break;
+	}
+
+	for(; n != 0; n--, x++)
+		*pixels++ = bg_palette[row[x]];
+}
+
+/**
+ * Returns b with the order of its bits reversed.
+ */
+static uint8_t __gb_reverse_bits(uint8_t b)
+{
+	b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+	b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+	b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+	return b;
+}
+
+/**
+ * Returns the pixels in mask that are over background colour bg0 in the line.
+ * Bit 7 of mask is the pixel at x, bit 6 the pixel at x + 1, and so on.
+ */
+static uint8_t __gb_sprite_behind_bg(const uint8_t *pixels, int_fast16_t x,
+				     uint8_t mask, const uint8_t bg0)
+{
+	uint8_t bit;
+
+	for(bit = 0x80; bit != 0; bit >>= 1, x++)
+	{
+		if((mask & bit) && (pixels[x] & LCD_COLOUR) != bg0)
+			mask &= ~bit;
+	}
+
+	return mask;
+}
+
+/**
+ * Draws the pixels in mask of one sprite row into the line. Bit 7 of mask, t1
+ * and t2 is the pixel at x, bit 6 the pixel at x + 1, and so on. Pixels outside
+ * of the line must not be set in mask.
+ */
+static void __gb_blit_sprite(uint8_t *pixels, int_fast16_t x,
+			     uint8_t t1, uint8_t t2, uint8_t mask,
+			     const uint8_t *palette)
+{
+	for(; mask != 0; x++, mask <<= 1, t1 <<= 1, t2 <<= 1)
+	{
+		if(mask & 0x80)
+			pixels[x] = palette[(t1 >> 7) | ((t2 >> 6) & 0x02)];
+	}
+}
+
+/**
+ * Draws a line using the given line state into out, converting it to
+ * PEANUT_GB_PIXEL_FORMAT using palette.
+ */
+static void __gb_render_line(const uint8_t *vram, const uint8_t *oam,
+			     struct lcd_sprite_index_s *sprite_index,
+			     struct gb_bg_cache_s *bg_cache,
+			     const uint32_t *tile_gens,
+			     const struct lcd_line_s *line, const uint8_t ly,
+			     const uint32_t *palette, gb_pixel_t *out)
+{
+	uint8_t bg_palette[4];
+	uint8_t sp_palette[8];
+#if PEANUT_GB_PIXEL_FORMAT == PEANUT_GB_PIXEL_INDEX8
+	/* Draw straight into the output. */
+	uint8_t *const pixels = out;
+
+	(void)palette;
+#else
+	uint8_t pixels[LCD_WIDTH];
+	uint8_t x;
+#endif
+
+	__gb_decode_palette(&bg_palette[0], line->BGP, LCD_PALETTE_BG);
+	__gb_decode_palette(&sp_palette[0], line->OBP0, 0);
+	__gb_decode_palette(&sp_palette[4], line->OBP1, LCD_PALETTE_OBJ);
+
+	memset(pixels, 0, LCD_WIDTH);
+
 	/* If background is enabled, draw it. */
-	if(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
+	if((line->LCDC & LCDC_BG_ENABLE) && bg_cache != NULL)
+	{
+		__gb_draw_cached_map(bg_cache, vram, tile_gens,
+				     (line->LCDC & LCDC_BG_MAP) ? 1 : 0,
+				     (line->LCDC & LCDC_TILE_SELECT) != 0,
+				     ly + line->SCY, line->SCX, LCD_WIDTH,
+				     bg_palette, pixels);
+	}
+	else if(line->LCDC & LCDC_BG_ENABLE)
 	{
 		uint8_t bg_y, disp_x, bg_x, idx, py, px, t1, t2;
 		uint16_t bg_map, tile;
@@ -1558,14 +2490,14 @@ void __gb_draw_line(struct gb_s *gb)
 		/* Calculate current background line to draw. Constant because
 		 * this function draws only this one line each time it is
 		 * called. */
-		bg_y = gb->hram_io[IO_LY] + gb->hram_io[IO_SCY];
+		bg_y = ly + line->SCY;
 
 		/* Get selected background map address for first tile
 		 * corresponding to current line.
 		 * 0x20 (32) is the width of a background tile, and the bit
 		 * shift is to calculate the address. */
 		bg_map =
-			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
+			((line->LCDC & LCDC_BG_MAP) ?
 			 VRAM_BMAP_2 : VRAM_BMAP_1)
 			+ (bg_y >> 3) * 0x20;
 
@@ -1574,17 +2506,17 @@ void __gb_draw_line(struct gb_s *gb)
 		disp_x = LCD_WIDTH - 1;
 
 		/* The X coordinate to begin drawing the background at. */
-		bg_x = disp_x + gb->hram_io[IO_SCX];
+		bg_x = disp_x + line->SCX;
 
 		/* Get tile index for current background tile. */
-		idx = gb->vram[bg_map + (bg_x >> 3)];
+		idx = vram[bg_map + (bg_x >> 3)];
 		/* Y coordinate of tile pixel to draw. */
 		py = (bg_y & 0x07);
 		/* X coordinate of tile pixel to draw. */
 		px = 7 - (bg_x & 0x07);
 
 		/* Select addressing mode. */
-		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+		if(line->LCDC & LCDC_TILE_SELECT)
 			tile = VRAM_TILES_1 + idx * 0x10;
 		else
 			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
@@ -1592,8 +2524,8 @@ void __gb_draw_line(struct gb_s *gb)
 		tile += 2 * py;
 
 		/* fetch first tile */
-		t1 = gb->vram[tile] >> px;
-		t2 = gb->vram[tile + 1] >> px;
+		t1 = vram[tile] >> px;
+		t2 = vram[tile + 1] >> px;
 
 		for(; disp_x != 0xFF; disp_x--)
 		{
@@ -1603,22 +2535,22 @@ void __gb_draw_line(struct gb_s *gb)
 			{
 				/* fetch next tile */
 				px = 0;
-				bg_x = disp_x + gb->hram_io[IO_SCX];
-				idx = gb->vram[bg_map + (bg_x >> 3)];
+				bg_x = disp_x + line->SCX;
+				idx = vram[bg_map + (bg_x >> 3)];
 
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+				if(line->LCDC & LCDC_TILE_SELECT)
 					tile = VRAM_TILES_1 + idx * 0x10;
 				else
 					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
 
 				tile += 2 * py;
-				t1 = gb->vram[tile];
-				t2 = gb->vram[tile + 1];
+				t1 = vram[tile];
+				t2 = vram[tile + 1];
 			}
 
 			/* copy background */
 			c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-			pixels[disp_x] = gb->display.bg_palette[c];
+			pixels[disp_x] = bg_palette[c];
 			t1 = t1 >> 1;
 			t2 = t2 >> 1;
 			px++;
@@ -1626,27 +2558,37 @@ void __gb_draw_line(struct gb_s *gb)
 	}
 
 	/* draw window */
-	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-			&& gb->hram_io[IO_LY] >= gb->display.WY
-			&& gb->hram_io[IO_WX] <= 166)
+	if(line->win_line != 0xFF && bg_cache != NULL)
+	{
+		const uint8_t start = line->WX < 7 ? 0 : line->WX - 7;
+
+		if(start < LCD_WIDTH)
+			__gb_draw_cached_map(bg_cache, vram, tile_gens,
+					     (line->LCDC & LCDC_WINDOW_MAP) ? 1 : 0,
+					     (line->LCDC & LCDC_TILE_SELECT) != 0,
+					     line->win_line, start - line->WX + 7,
+					     LCD_WIDTH - start, bg_palette,
+					     &pixels[start]);
+	}
+	else if(line->win_line != 0xFF)
 	{
 		uint16_t win_line, tile;
 		uint8_t disp_x, win_x, py, px, idx, t1, t2, end;
 
 		/* Calculate Window Map Address. */
-		win_line = (gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
+		win_line = (line->LCDC & LCDC_WINDOW_MAP) ?
 				    VRAM_BMAP_2 : VRAM_BMAP_1;
-		win_line += (gb->display.window_clear >> 3) * 0x20;
+		win_line += (line->win_line >> 3) * 0x20;
 
 		disp_x = LCD_WIDTH - 1;
-		win_x = disp_x - gb->hram_io[IO_WX] + 7;
+		win_x = disp_x - line->WX + 7;
 
 		// look up tile
-		py = gb->display.window_clear & 0x07;
+		py = line->win_line & 0x07;
 		px = 7 - (win_x & 0x07);
-		idx = gb->vram[win_line + (win_x >> 3)];
+		idx = vram[win_line + (win_x >> 3)];
 
-		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+		if(line->LCDC & LCDC_TILE_SELECT)
 			tile = VRAM_TILES_1 + idx * 0x10;
 		else
 			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
@@ -1654,11 +2596,11 @@ void __gb_draw_line(struct gb_s *gb)
 		tile += 2 * py;
 
 		// fetch first tile
-		t1 = gb->vram[tile] >> px;
-		t2 = gb->vram[tile + 1] >> px;
+		t1 = vram[tile] >> px;
+		t2 = vram[tile + 1] >> px;
 
 		// loop & copy window
-		end = (gb->hram_io[IO_WX] < 7 ? 0 : gb->hram_io[IO_WX] - 7) - 1;
+		end = (line->WX < 7 ? 0 : line->WX - 7) - 1;
 
 		for(; disp_x != end; disp_x--)
 		{
@@ -1668,173 +2610,582 @@ void __gb_draw_line(struct gb_s *gb)
 			{
 				// fetch next tile
 				px = 0;
-				win_x = disp_x - gb->hram_io[IO_WX] + 7;
-				idx = gb->vram[win_line + (win_x >> 3)];
+				win_x = disp_x - line->WX + 7;
+				idx = vram[win_line + (win_x >> 3)];
 
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+				if(line->LCDC & LCDC_TILE_SELECT)
 					tile = VRAM_TILES_1 + idx * 0x10;
 				else
 					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
 
 				tile += 2 * py;
-				t1 = gb->vram[tile];
-				t2 = gb->vram[tile + 1];
+				t1 = vram[tile];
+				t2 = vram[tile + 1];
 			}
 
 			// copy window
 			c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-			pixels[disp_x] = gb->display.bg_palette[c];
+			pixels[disp_x] = bg_palette[c];
 			t1 = t1 >> 1;
 			t2 = t2 >> 1;
 			px++;
 		}
-
-		gb->display.window_clear++; // advance window line
 	}
 
 	// draw sprites
-	if(gb->hram_io[IO_LCDC] & LCDC_OBJ_ENABLE)
+	if(line->LCDC & LCDC_OBJ_ENABLE)
 	{
+		const uint8_t *line_sprites;
 		uint8_t sprite_number;
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-		uint8_t number_of_sprites = 0;
 
-		struct sprite_data sprites_to_render[MAX_SPRITES_LINE];
+		if(sprite_index->dirty ||
+				sprite_index->obj_size != (line->LCDC & LCDC_OBJ_SIZE))
+			__gb_index_sprites(sprite_index, oam,
+					   line->LCDC & LCDC_OBJ_SIZE);
 
-		/* Record number of sprites on the line being rendered, limited
-		 * to the maximum number sprites that the Game Boy is able to
-		 * render on each line (10 sprites). */
-		for(sprite_number = 0;
-				sprite_number < NUM_SPRITES;
-				sprite_number++)
-		{
-			/* Sprite Y position. */
-			uint8_t OY = gb->oam[4 * sprite_number + 0];
-			/* Sprite X position. */
-			uint8_t OX = gb->oam[4 * sprite_number + 1];
+		line_sprites = sprite_index->sprites[ly];
 
-			/* If sprite isn't on this line, continue. */
-			if (gb->hram_io[IO_LY] +
-				(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY
-					|| gb->hram_io[IO_LY] + 16 < OY)
-				continue;
-
-			struct sprite_data current;
-
-			current.sprite_number = sprite_number;
-			current.x = OX;
-
-			uint8_t place;
-			for (place = number_of_sprites; place != 0; place--)
-			{
-				if(compare_sprites(&sprites_to_render[place - 1], &current) < 0)
-					break;
-			}
-			if(place >= MAX_SPRITES_LINE)
-				continue;
-			for (uint8_t i = number_of_sprites; i > place; --i) {
-				sprites_to_render[i] = sprites_to_render[i - 1];
-			}
-			if(number_of_sprites < MAX_SPRITES_LINE)
-				number_of_sprites++;
-			sprites_to_render[place] = current;
-		}
-#endif
-
-		/* Render each sprite, from low priority to high priority. */
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-		/* Render the top ten prioritised sprites on this scanline. */
-		for(sprite_number = number_of_sprites - 1;
+		/* Render each sprite on this line, from low priority to high
+		 * priority. */
+		for(sprite_number = sprite_index->count[ly] - 1;
 				sprite_number != 0xFF;
 				sprite_number--)
 		{
-			uint8_t s = sprites_to_render[sprite_number].sprite_number;
-#else
-		for (sprite_number = NUM_SPRITES - 1;
-			sprite_number != 0xFF;
-			sprite_number--)
-		{
-			uint8_t s = sprite_number;
-#endif
-			uint8_t py, t1, t2, dir, start, end, shift, disp_x;
+			uint8_t s = line_sprites[sprite_number];
+			uint8_t py, t1, t2, mask;
 			/* Sprite Y position. */
-			uint8_t OY = gb->oam[4 * s + 0];
+			uint8_t OY = oam[4 * s + 0];
 			/* Sprite X position. */
-			uint8_t OX = gb->oam[4 * s + 1];
+			uint8_t OX = oam[4 * s + 1];
 			/* Sprite Tile/Pattern Number. */
-			uint8_t OT = gb->oam[4 * s + 2]
-				     & (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0xFE : 0xFF);
+			uint8_t OT = oam[4 * s + 2]
+				     & (line->LCDC & LCDC_OBJ_SIZE ? 0xFE : 0xFF);
 			/* Additional attributes. */
-			uint8_t OF = gb->oam[4 * s + 3];
-
-#if !PEANUT_GB_HIGH_LCD_ACCURACY
-			/* If sprite isn't on this line, continue. */
-			if(gb->hram_io[IO_LY] +
-					(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY ||
-					gb->hram_io[IO_LY] + 16 < OY)
-				continue;
-#endif
+			uint8_t OF = oam[4 * s + 3];
 
 			/* Continue if sprite not visible. */
 			if(OX == 0 || OX >= 168)
 				continue;
 
 			// y flip
-			py = gb->hram_io[IO_LY] - OY + 16;
+			py = ly - OY + 16;
 
 			if(OF & OBJ_FLIP_Y)
-				py = (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 15 : 7) - py;
+				py = (line->LCDC & LCDC_OBJ_SIZE ? 15 : 7) - py;
 
 			// fetch the tile
-			t1 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py];
-			t2 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py + 1];
+			t1 = vram[VRAM_TILES_1 + OT * 0x10 + 2 * py];
+			t2 = vram[VRAM_TILES_1 + OT * 0x10 + 2 * py + 1];
 
-			// handle x flip
+			/* Put the leftmost pixel of the row in bit 7. */
 			if(OF & OBJ_FLIP_X)
 			{
-				dir = 1;
-				start = (OX < 8 ? 0 : OX - 8);
-				end = MIN(OX, LCD_WIDTH);
-				shift = 8 - OX + start;
+				t1 = __gb_reverse_bits(t1);
+				t2 = __gb_reverse_bits(t2);
 			}
-			else
+
+			/* Opaque pixels that are within the line. */
+			mask = t1 | t2;
+
+			if(OX < 8)
+				mask &= 0xFF >> (8 - OX);
+			else if(OX > LCD_WIDTH)
+				mask &= 0xFF << (OX - LCD_WIDTH);
+
+			/* A sprite behind the background is only drawn over
+			 * background colour 0. */
+			if(OF & OBJ_PRIORITY)
+				mask = __gb_sprite_behind_bg(pixels, OX - 8, mask,
+						bg_palette[0] & LCD_COLOUR);
+
+			__gb_blit_sprite(pixels, OX - 8, t1, t2, mask,
+					(OF & OBJ_PALETTE) ?
+					&sp_palette[4] : &sp_palette[0]);
+		}
+	}
+
+#if PEANUT_GB_PIXEL_FORMAT == PEANUT_GB_PIXEL_INDEX4
+	for(x = 0; x < LCD_WIDTH; x += 2)
+	{
+		out[x / 2] = (palette[PGB_PALETTE_INDEX(pixels[x])] & 0x0F) |
+			((palette[PGB_PALETTE_INDEX(pixels[x + 1])] & 0x0F) << 4);
+	}
+#elif PEANUT_GB_PIXEL_FORMAT != PEANUT_GB_PIXEL_INDEX8
+	for(x = 0; x < LCD_WIDTH; x++)
+		out[x] = (gb_pixel_t)palette[PGB_PALETTE_INDEX(pixels[x])];
+#endif
+}
+
+/**
+ * Returns true if the captured line does not need to be drawn because it is
+ * identical to the last time it was drawn. Otherwise, records that it is
+ * being drawn.
+ */
+static bool __gb_line_unchanged(struct gb_s *gb, const uint8_t ly)
+{
+	/* Skip the line if it would be drawn exactly as it was last time. */
+	if(gb->direct.skip_unchanged &&
+			memcmp(&gb->display.captured[ly], &gb->display.lines[ly],
+			       sizeof(struct lcd_line_s)) == 0)
+		return true;
+
+	gb->display.lines[ly] = gb->display.captured[ly];
+	gb->display.lines_drawn++;
+	return false;
+}
+
+/**
+ * Sends a captured line to the front-end, drawing it unless it is unchanged
+ * since it was last drawn.
+ */
+static void __gb_output_line(struct gb_s *gb, const uint8_t ly)
+{
+	gb_pixel_t line_pixels[LCD_LINE_SIZE];
+	gb_pixel_t *pixels = line_pixels;
+
+	/* Draw straight into the front-end's framebuffer if there is one.
+	 * Unchanged lines are then left as they are. */
+	if(gb->display.fb != NULL)
+		pixels = (gb_pixel_t *)(gb->display.fb +
+					gb->display.fb_pitch * ly);
+
+	if(__gb_line_unchanged(gb, ly))
+	{
+		if(gb->display.fb == NULL)
+			PGB_LCD_DRAW_LINE(gb, NULL, ly);
+
+		return;
+	}
+
+	__gb_render_line(gb->vram, gb->oam, &gb->display.sprite_index,
+			 gb->display.bg_cache, gb->display.tile_gens,
+			 &gb->display.lines[ly], ly, gb->display.palette,
+			 pixels);
+
+	if(gb->display.fb == NULL)
+		PGB_LCD_DRAW_LINE(gb, pixels, ly);
+}
+
+#if PEANUT_GB_RENDER_THREAD
+/* Number of jobs that may be queued for the render thread. Power of two. */
+#define PGB_RENDER_JOBS		8
+#define PGB_VRAM_PAGE_SIZE	0x100
+
+/**
+ * Lines sent to the render thread, along with the memory that they need.
+ */
+struct gb_render_job_s
+{
+	/* VRAM pages and OAM that changed since the previous job. Only these
+	 * parts of vram and oam are valid. */
+	uint32_t vram_pages;
+	bool oam_changed;
+	uint8_t vram[VRAM_SIZE];
+	uint8_t oam[OAM_SIZE];
+	/* Tile generations, only valid if any tile data page changed. */
+	uint32_t tile_gens[NUM_TILES];
+	struct gb_bg_cache_s *bg_cache;
+
+	/* Framebuffer to draw into, or NULL to call lcd_draw_line. */
+	uint8_t *fb;
+	size_t fb_pitch;
+	uint32_t palette[16];
+
+	uint8_t count;
+	uint8_t ly[LCD_HEIGHT];
+	bool unchanged[LCD_HEIGHT];
+	struct lcd_line_s lines[LCD_HEIGHT];
+
+	/* Set if this job ends a frame, along with the number of lines drawn
+	 * during that frame. */
+	bool frame_done;
+	uint8_t lines_drawn;
+};
+
+struct gb_render_worker_s
+{
+	struct gb_s *gb;
+	pthread_t thread;
+	/* Posted for every job queued, and on exit. */
+	sem_t wake;
+	atomic_bool quit;
+
+	/* Single producer, single consumer queue of jobs. head is only
+	 * written by the CPU thread, and tail by the render thread. */
+	atomic_uint head;
+	atomic_uint tail;
+	struct gb_render_job_s jobs[PGB_RENDER_JOBS];
+
+	/* OAM generation last sent to the render thread. */
+	uint32_t oam_gen;
+
+	/* Copy of VRAM and OAM owned by the render thread. */
+	uint8_t vram[VRAM_SIZE];
+	uint8_t oam[OAM_SIZE];
+	uint32_t tile_gens[NUM_TILES];
+	struct lcd_sprite_index_s sprite_index;
+};
+
+/* VRAM pages holding tile data. */
+#define PGB_VRAM_TILE_PAGES	0x00FFFFFF
+
+static void *__gb_render_thread(void *arg)
+{
+	struct gb_render_worker_s *const w = arg;
+	struct gb_s *const gb = w->gb;
+
+	for(;;)
+	{
+		const unsigned tail = atomic_load_explicit(&w->tail,
+				      memory_order_relaxed);
+		const struct gb_render_job_s *job;
+		gb_pixel_t pixels[LCD_LINE_SIZE];
+		uint8_t i;
+
+		if(tail == atomic_load_explicit(&w->head, memory_order_acquire))
+		{
+			/* Only exit once all jobs are drawn. */
+			if(atomic_load(&w->quit))
+				break;
+
+			sem_wait(&w->wake);
+			continue;
+		}
+
+		job = &w->jobs[tail % PGB_RENDER_JOBS];
+
+		for(i = 0; i < VRAM_SIZE / PGB_VRAM_PAGE_SIZE; i++)
+		{
+			if(job->vram_pages & ((uint32_t)1 << i))
+				memcpy(&w->vram[i * PGB_VRAM_PAGE_SIZE],
+				       &job->vram[i * PGB_VRAM_PAGE_SIZE],
+				       PGB_VRAM_PAGE_SIZE);
+		}
+
+		if(job->vram_pages & PGB_VRAM_TILE_PAGES)
+			memcpy(w->tile_gens, job->tile_gens,
+			       sizeof(w->tile_gens));
+
+		if(job->oam_changed)
+		{
+			memcpy(w->oam, job->oam, OAM_SIZE);
+			w->sprite_index.dirty = true;
+		}
+
+		for(i = 0; i < job->count; i++)
+		{
+			gb_pixel_t *out = pixels;
+
+			if(job->fb != NULL)
+				out = (gb_pixel_t *)(job->fb +
+						     job->fb_pitch * job->ly[i]);
+
+			if(job->unchanged[i])
 			{
-				dir = (uint8_t)-1;
-				start = MIN(OX, LCD_WIDTH) - 1;
-				end = (OX < 8 ? 0 : OX - 8) - 1;
-				shift = OX - (start + 1);
+				if(job->fb == NULL)
+					PGB_LCD_DRAW_LINE(gb, NULL, job->ly[i]);
+				continue;
 			}
 
-			// copy tile
-			t1 >>= shift;
-			t2 >>= shift;
+			__gb_render_line(w->vram, w->oam, &w->sprite_index,
+					 job->bg_cache, w->tile_gens,
+					 &job->lines[i], job->ly[i],
+					 job->palette, out);
 
-			/* TODO: Put for loop within the to if statements
-			 * because the BG priority bit will be the same for
-			 * all the pixels in the tile. */
-			for(disp_x = start; disp_x != end; disp_x += dir)
-			{
-				uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-				// check transparency / sprite overlap / background overlap
+			if(job->fb == NULL)
+				PGB_LCD_DRAW_LINE(gb, out, job->ly[i]);
+		}
 
-				if(c && !(OF & OBJ_PRIORITY && !((pixels[disp_x] & LCD_COLOUR) == (gb->display.bg_palette[0] & LCD_COLOUR))))
-				{
-					/* Set pixel colour. */
-					pixels[disp_x] = (OF & OBJ_PALETTE)
-						? gb->display.sp_palette[c + 4]
-						: gb->display.sp_palette[c];
-				}
+		if(job->frame_done && gb->display.lcd_frame_done != NULL)
+			gb->display.lcd_frame_done(gb, job->lines_drawn);
 
-				t1 = t1 >> 1;
-				t2 = t2 >> 1;
-			}
+		atomic_store_explicit(&w->tail, tail + 1, memory_order_release);
+	}
+
+	return NULL;
+}
+
+/**
+ * Sends the pending lines to the render thread, along with any VRAM and OAM
+ * modified since the previous job. Waits if the queue is full.
+ */
+static void __gb_submit_lines(struct gb_s *gb, const bool frame_done)
+{
+	struct gb_render_worker_s *const w = gb->display.worker;
+	const unsigned head = atomic_load_explicit(&w->head, memory_order_relaxed);
+	struct gb_render_job_s *job;
+	uint8_t i;
+
+	while(head - atomic_load_explicit(&w->tail, memory_order_acquire)
+			== PGB_RENDER_JOBS)
+		sched_yield();
+
+	job = &w->jobs[head % PGB_RENDER_JOBS];
+
+	job->vram_pages = gb->display.vram_dirty;
+	gb->display.vram_dirty = 0;
+
+	for(i = 0; i < VRAM_SIZE / PGB_VRAM_PAGE_SIZE; i++)
+	{
+		if(job->vram_pages & ((uint32_t)1 << i))
+			memcpy(&job->vram[i * PGB_VRAM_PAGE_SIZE],
+			       &gb->vram[i * PGB_VRAM_PAGE_SIZE],
+			       PGB_VRAM_PAGE_SIZE);
+	}
+
+	if(job->vram_pages & PGB_VRAM_TILE_PAGES)
+		memcpy(job->tile_gens, gb->display.tile_gens,
+		       sizeof(job->tile_gens));
+
+	job->oam_changed = w->oam_gen != gb->display.oam_gen;
+	if(job->oam_changed)
+	{
+		memcpy(job->oam, gb->oam, OAM_SIZE);
+		w->oam_gen = gb->display.oam_gen;
+	}
+
+	job->count = gb->display.pending_count;
+	for(i = 0; i < job->count; i++)
+	{
+		const uint8_t ly = gb->display.pending[i];
+
+		job->ly[i] = ly;
+		job->unchanged[i] = __gb_line_unchanged(gb, ly);
+		job->lines[i] = gb->display.lines[ly];
+	}
+
+	job->fb = gb->display.fb;
+	job->fb_pitch = gb->display.fb_pitch;
+	job->bg_cache = gb->display.bg_cache;
+	memcpy(job->palette, gb->display.palette, sizeof(job->palette));
+	job->frame_done = frame_done;
+	job->lines_drawn = gb->display.lines_drawn;
+
+	if(frame_done)
+		gb->display.lines_drawn = 0;
+
+	atomic_store_explicit(&w->head, head + 1, memory_order_release);
+	sem_post(&w->wake);
+}
+#endif
+
+/**
+ * Draws all lines that were captured while deferred rendering is enabled.
+ * Must be called before VRAM or OAM is modified.
+ */
+static void __gb_flush_lines(struct gb_s *gb)
+{
+	uint8_t i;
+
+#if PEANUT_GB_RENDER_THREAD
+	if(gb->display.worker != NULL)
+	{
+		__gb_submit_lines(gb, false);
+		gb->display.pending_count = 0;
+		return;
+	}
+#endif
+
+	for(i = 0; i < gb->display.pending_count; i++)
+		__gb_output_line(gb, gb->display.pending[i]);
+
+	gb->display.pending_count = 0;
+}
+
+/**
+ * Draws any deferred lines at the start of VBLANK, and tells the front-end
+ * that the frame is complete if it is drawing into a framebuffer.
+ */
+static void __gb_end_frame(struct gb_s *gb)
+{
+	uint8_t lines_drawn;
+
+#if PEANUT_GB_RENDER_THREAD
+	if(gb->display.worker != NULL)
+	{
+		/* The render thread calls lcd_frame_done once it has drawn
+		 * the frame. */
+		__gb_submit_lines(gb, true);
+		gb->display.pending_count = 0;
+		return;
+	}
+#endif
+
+	PGB_FLUSH_LINES(gb);
+
+	lines_drawn = gb->display.lines_drawn;
+	gb->display.lines_drawn = 0;
+
+	if(gb->display.lcd_frame_done != NULL)
+		gb->display.lcd_frame_done(gb, lines_drawn);
+}
+
+/**
+ * Decides whether the next frame is drawn or skipped, at the start of VBLANK.
+ */
+static void __gb_select_frame(struct gb_s *gb)
+{
+	bool skip = false;
+
+	/* Count the frame that has just ended. */
+	if((gb->direct.frame_skip && !gb->display.frame_skip_count) ||
+			gb->display.skip_frame)
+		gb->display.frames_skipped++;
+	else
+		gb->display.frames_rendered++;
+
+	/* If frame skip is activated, check if we need to draw
+	 * the frame or skip it. */
+	if(gb->direct.frame_skip)
+	{
+		gb->display.frame_skip_count =
+			!gb->display.frame_skip_count;
+	}
+
+	/* Draw the first skip_render frames of every skip_period. */
+	if(gb->display.skip_period != 0)
+	{
+		if(++gb->display.skip_phase >= gb->display.skip_period)
+			gb->display.skip_phase = 0;
+
+		skip = gb->display.skip_phase >= gb->display.skip_render;
+	}
+
+	/* Skip frames while the host is behind real time, but still draw
+	 * some frames if it never catches up. */
+	if(gb->display.skip_auto_max != 0 && gb->display.skip_debt > 0 &&
+			gb->display.skip_run < gb->display.skip_auto_max)
+		skip = true;
+
+	gb->display.skip_run = skip ? gb->display.skip_run + 1 : 0;
+	gb->display.skip_frame = skip;
+
+	/* If interlaced is activated, change which lines get
+	 * updated. Also, only update lines on frames that are
+	 * actually drawn when frame skip is enabled. */
+	if(gb->direct.interlace &&
+			(!gb->direct.frame_skip ||
+			 gb->display.frame_skip_count) && !skip)
+	{
+		gb->display.interlace_count =
+			!gb->display.interlace_count;
+	}
+}
+
+/**
+ * Captures the state of the current line at the start of Mode 3, and either
+ * draws it or defers drawing it until the end of the frame.
+ */
+void __gb_draw_line(struct gb_s *gb)
+{
+	struct lcd_line_s *line;
+
+	/* If LCD not initialised by front-end, don't render anything. */
+	if(gb->display.lcd_draw_line == NULL && gb->display.fb == NULL)
+		return;
+
+	if((gb->direct.frame_skip && !gb->display.frame_skip_count) ||
+			gb->display.skip_frame)
+		return;
+
+	/* If interlaced mode is activated, check if we need to draw the current
+	 * line. */
+	if(gb->direct.interlace)
+	{
+		if((!gb->display.interlace_count
+				&& (gb->hram_io[IO_LY] & 1) == 0)
+				|| (gb->display.interlace_count
+				    && (gb->hram_io[IO_LY] & 1) == 1))
+		{
+			/* Compensate for missing window draw if required. */
+			if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+					&& gb->hram_io[IO_LY] >= gb->display.WY
+					&& gb->hram_io[IO_WX] <= 166)
+				gb->display.window_clear++;
+
+			return;
 		}
 	}
 
-	gb->display.lcd_draw_line(gb, pixels, gb->hram_io[IO_LY]);
+	/* Keep counting window lines while not drawing, in case drawing is
+	 * enabled again during this frame. */
+	if(gb->direct.render_mask == 0)
+	{
+		if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+				&& gb->hram_io[IO_LY] >= gb->display.WY
+				&& gb->hram_io[IO_WX] <= 166)
+			gb->display.window_clear++;
+
+		return;
+	}
+
+	line = &gb->display.captured[gb->hram_io[IO_LY]];
+	line->tile_gen = gb->display.tile_gen;
+	line->map_gen[0] = gb->display.map_gen[0];
+	line->map_gen[1] = gb->display.map_gen[1];
+	line->oam_gen = gb->display.oam_gen;
+	line->LCDC = gb->hram_io[IO_LCDC];
+	line->SCY = gb->hram_io[IO_SCY];
+	line->SCX = gb->hram_io[IO_SCX];
+	line->WX = gb->hram_io[IO_WX];
+	line->BGP = gb->hram_io[IO_BGP];
+	line->OBP0 = gb->hram_io[IO_OBP0];
+	line->OBP1 = gb->hram_io[IO_OBP1];
+	line->win_line = 0xFF;
+
+	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+			&& gb->hram_io[IO_LY] >= gb->display.WY
+			&& gb->hram_io[IO_WX] <= 166)
+		line->win_line = gb->display.window_clear++;
+
+	/* Hide layers that are not wanted. */
+	if(PGB_UNLIKELY(gb->direct.render_mask != GB_RENDER_ALL))
+	{
+		if(!(gb->direct.render_mask & GB_RENDER_BG))
+			line->LCDC &= ~LCDC_BG_ENABLE;
+
+		if(!(gb->direct.render_mask & GB_RENDER_WINDOW))
+			line->win_line = 0xFF;
+
+		if(!(gb->direct.render_mask & GB_RENDER_OBJ))
+			line->LCDC &= ~LCDC_OBJ_ENABLE;
+	}
+
+	/* Lines must be deferred if drawn on the render thread. */
+	if(!gb->direct.deferred_render
+#if PEANUT_GB_RENDER_THREAD
+			&& gb->display.worker == NULL
+#endif
+	  )
+	{
+		__gb_output_line(gb, gb->hram_io[IO_LY]);
+		return;
+	}
+
+	/* Should not happen, as lines are drawn at the end of each frame. */
+	if(PGB_UNLIKELY(gb->display.pending_count == LCD_HEIGHT))
+		__gb_flush_lines(gb);
+
+	gb->display.pending[gb->display.pending_count++] = gb->hram_io[IO_LY];
 }
 #endif
 
+/**
+ * Returns whether the deadline of gb_run_cycles() or gb_run_until() has been
+ * reached during HALT, which includes an event stopping gb_run_until(). If so,
+ * saves the cycles of the next step of the HALT, so that the next call to
+ * __gb_step_cpu() carries on from there.
+ */
+static bool __gb_stop_halt(struct gb_s *gb, const uint_fast16_t inst_cycles)
+{
+	if(gb->counter.cycles < gb->counter.deadline)
+		return false;
+
+	gb->halt_stopped = true;
+	gb->counter.halt_cycles = inst_cycles;
+	return true;
+}
+
 /**
  * Internal function used to step the CPU.
  */
@@ -1864,7 +3215,6 @@ void __gb_step_cpu(struct gb_s *gb)
 		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
 		/* *INDENT-ON* */
 	};
-	static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
 
 	/* Handle interrupts */
 	/* If gb_halt is positive, then an interrupt must have occurred by the
@@ -1873,6 +3223,21 @@ void __gb_step_cpu(struct gb_s *gb)
 	while(gb->gb_halt || (gb->gb_ime &&
 			gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR))
 	{
+		/* Continue a HALT that was stopped at a deadline by running
+		 * the HALT instruction again, unless an interrupt is now
+		 * pending. */
+		if(gb->halt_stopped)
+		{
+			if((gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0)
+			{
+				gb->gb_halt = false;
+				gb->cpu_reg.pc.reg--;
+				break;
+			}
+
+			gb->halt_stopped = false;
+		}
+
 		gb->gb_halt = false;
 
 		if(!gb->gb_ime)
@@ -1912,6 +3277,12 @@ void __gb_step_cpu(struct gb_s *gb)
 			gb->hram_io[IO_IF] ^= CONTROL_INTR;
 		}
 
+		/* Let gb_run_until() stop at a breakpoint on the interrupt
+		 * handler before its first instruction is run. */
+		if((gb->stop_events & GB_STOP_ON_BREAKPOINT) &&
+				gb->cpu_reg.pc.reg == gb->breakpoint)
+			return;
+
 		break;
 	}
 
@@ -2522,26 +3893,24 @@ void __gb_step_cpu(struct gb_s *gb)
 	{
 		int_fast16_t halt_cycles = INT_FAST16_MAX;
 
-		/* TODO: Emulate HALT bug? */
-		gb->gb_halt = true;
-
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
+		/* Carry on from where gb_run_cycles() stopped. */
+		if(gb->halt_stopped)
 		{
-			int serial_cycles = SERIAL_CYCLES -
-				gb->counter.serial_count;
-
-			if(serial_cycles < halt_cycles)
-				halt_cycles = serial_cycles;
+			gb->halt_stopped = false;
+			gb->gb_halt = true;
+			inst_cycles = gb->counter.halt_cycles;
+			break;
 		}
 
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
-		{
-			int tac_cycles = TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK] -
-				gb->counter.tima_count;
+		/* TODO: Emulate HALT bug? */
+		gb->gb_halt = true;
 
-			if(tac_cycles < halt_cycles)
-				halt_cycles = tac_cycles;
-		}
+		/* Wake on the next TIMA overflow or the end of a serial
+		 * transfer. */
+		if(gb->counter.next_event - gb->counter.cycles <
+				(uint64_t)halt_cycles)
+			halt_cycles = (int_fast16_t)(gb->counter.next_event -
+						     gb->counter.cycles);
 
 		if((gb->hram_io[IO_LCDC] & LCDC_ENABLE))
 		{
@@ -3311,145 +4680,45 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0xFF: /* RST 0x0038 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0038;
-		break;
-
-	default:
-		/* Return address where invalid opcode that was read. */
-		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
-		PGB_UNREACHABLE();
-	}
-
-	do
-	{
-		/* DIV register timing */
-		gb->counter.div_count += inst_cycles;
-		while(gb->counter.div_count >= DIV_CYCLES)
-		{
-			gb->hram_io[IO_DIV]++;
-			gb->counter.div_count -= DIV_CYCLES;
-		}
-
-		/* Check for RTC tick. */
-		if(gb->mbc == 3 && (gb->rtc_real.reg.high & 0x40) == 0)
-		{
-			gb->counter.rtc_count += inst_cycles;
-			while(PGB_UNLIKELY(gb->counter.rtc_count >= RTC_CYCLES))
-			{
-				gb->counter.rtc_count -= RTC_CYCLES;
-
-				/* Detect invalid rollover. */
-				if(PGB_UNLIKELY(gb->rtc_real.reg.sec == 63))
-				{
-					gb->rtc_real.reg.sec = 0;
-					continue;
-				}
-
-				if(++gb->rtc_real.reg.sec != 60)
-					continue;
-
-				gb->rtc_real.reg.sec = 0;
-				if(gb->rtc_real.reg.min == 63)
-				{
-					gb->rtc_real.reg.min = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.min != 60)
-					continue;
-
-				gb->rtc_real.reg.min = 0;
-				if(gb->rtc_real.reg.hour == 31)
-				{
-					gb->rtc_real.reg.hour = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.hour != 24)
-					continue;
-
-				gb->rtc_real.reg.hour = 0;
-				if(++gb->rtc_real.reg.yday != 0)
-					continue;
-
-				if(gb->rtc_real.reg.high & 1)  /* Bit 8 of days*/
-					gb->rtc_real.reg.high |= 0x80; /* Overflow bit */
-
-				gb->rtc_real.reg.high ^= 1;
-			}
-		}
-
-		/* Check serial transmission. */
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
-		{
-			/* If new transfer, call TX function. */
-			if(gb->counter.serial_count == 0 &&
-				gb->gb_serial_tx != NULL)
-				(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
-
-			gb->counter.serial_count += inst_cycles;
+	case 0xFF: /* RST 0x0038 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0038;
+		break;
 
-			/* If it's time to receive byte, call RX function. */
-			if(gb->counter.serial_count >= SERIAL_CYCLES)
-			{
-				/* If RX can be done, do it. */
-				/* If RX failed, do not change SB if using external
-				 * clock, or set to 0xFF if using internal clock. */
-				uint8_t rx;
-
-				if(gb->gb_serial_rx != NULL &&
-					(gb->gb_serial_rx(gb, &rx) ==
-						GB_SERIAL_RX_SUCCESS))
-				{
-					gb->hram_io[IO_SB] = rx;
+	default:
+		/* Let gb_run_until() return instead of reporting the error. */
+		if(gb->stop_events & GB_STOP_ON_INVALID_OPCODE)
+		{
+			gb->cpu_reg.pc.reg--;
+			__gb_stop_event(gb, GB_STOP_INVALID_OPCODE);
+			return;
+		}
 
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
-				{
-					/* If using internal clock, and console is not
-					 * attached to any external peripheral, shifted
-					 * bits are replaced with logic 1. */
-					gb->hram_io[IO_SB] = 0xFF;
-
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else
-				{
-					/* If using external clock, and console is not
-					 * attached to any external peripheral, bits are
-					 * not shifted, so SB is not modified. */
-				}
+		/* Return address where invalid opcode that was read. */
+		PGB_ERROR(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
+		PGB_UNREACHABLE();
+	}
 
-				gb->counter.serial_count = 0;
-			}
-		}
+	do
+	{
+		/* While halted, the LCD sets the length of each step, so stop
+		 * it short at the next TIMA overflow or the end of a serial
+		 * transfer to wake without delay. */
+		if(gb->gb_halt &&
+				gb->counter.next_event > gb->counter.cycles &&
+				gb->counter.next_event - gb->counter.cycles < inst_cycles)
+			inst_cycles = (uint_fast16_t)(gb->counter.next_event -
+						      gb->counter.cycles);
 
-		/* TIMA register timing */
-		/* TODO: Change tac_enable to struct of TAC timer control bits. */
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
-		{
-			gb->counter.tima_count += inst_cycles;
+		/* DIV and TIMA are calculated from the cycle count. */
+		gb->counter.cycles += inst_cycles;
 
-			while(gb->counter.tima_count >=
-				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
-			{
-				gb->counter.tima_count -=
-					TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+		/* The RTC is calculated from the cycle count when latched. */
 
-				if(++gb->hram_io[IO_TIMA] == 0)
-				{
-					gb->hram_io[IO_IF] |= TIMER_INTR;
-					/* On overflow, set TMA to TIMA. */
-					gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
-				}
-			}
-		}
+		/* TIMA overflow and the end of serial transfers. */
+		if(gb->counter.cycles >= gb->counter.next_event)
+			__gb_run_events(gb);
 
 		/* If LCD is off, don't update LCD state or increase the LCD
 		 * ticks. Instead, keep track of the amount of time that is
@@ -3489,6 +4758,9 @@ void __gb_step_cpu(struct gb_s *gb)
 			else
 				gb->hram_io[IO_STAT] &= 0xFB;
 
+			if(gb->hram_io[IO_LY] == gb->stop_ly)
+				__gb_stop_event(gb, GB_STOP_LY);
+
 			/* Check if LCD should be in Mode 1 (VBLANK) state */
 			if(gb->hram_io[IO_LY] == LCD_HEIGHT)
 			{
@@ -3501,25 +4773,16 @@ void __gb_step_cpu(struct gb_s *gb)
 				if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
 					gb->hram_io[IO_IF] |= LCDC_INTR;
 
+				__gb_stop_event(gb, GB_STOP_VBLANK);
+
 #if ENABLE_LCD
-				/* If frame skip is activated, check if we need to draw
-				 * the frame or skip it. */
-				if(gb->direct.frame_skip)
-				{
-					gb->display.frame_skip_count =
-						!gb->display.frame_skip_count;
-				}
+				/* Draw the whole frame if rendering was
+				 * deferred. */
+				__gb_end_frame(gb);
 
-				/* If interlaced is activated, change which lines get
-				 * updated. Also, only update lines on frames that are
-				 * actually drawn when frame skip is enabled. */
-				if(gb->direct.interlace &&
-						(!gb->direct.frame_skip ||
-						 gb->display.frame_skip_count))
-				{
-					gb->display.interlace_count =
-						!gb->display.interlace_count;
-				}
+				/* Check if we need to draw the next frame or
+				 * skip it. */
+				__gb_select_frame(gb);
 #endif
                                 /* If halted forever, then return on VBLANK. */
                                 if(gb->gb_halt && !gb->hram_io[IO_IE])
@@ -3575,8 +4838,9 @@ void __gb_step_cpu(struct gb_s *gb)
 			if (gb->counter.lcd_count < LCD_MODE3_LCD_DRAW_MIN_DURATION)
 				inst_cycles = LCD_MODE3_LCD_DRAW_MIN_DURATION - gb->counter.lcd_count;
 		}
-	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0);
-	/* If halted, loop until an interrupt occurs. */
+	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0 &&
+			!__gb_stop_halt(gb, inst_cycles));
+	/* If halted, loop until an interrupt occurs or the deadline. */
 }
 
 void gb_run_frame(struct gb_s *gb)
@@ -3587,6 +4851,56 @@ void gb_run_frame(struct gb_s *gb)
 		__gb_step_cpu(gb);
 }
 
+uint_fast32_t gb_run_cycles(struct gb_s *gb, uint_fast32_t cycles)
+{
+	const uint64_t start = gb->counter.cycles;
+
+	gb->counter.deadline = start + cycles;
+	while(gb->counter.cycles < gb->counter.deadline)
+		__gb_step_cpu(gb);
+
+	gb->counter.deadline = UINT64_MAX;
+	return (uint_fast32_t)(gb->counter.cycles - start);
+}
+
+enum gb_stop_reason_e gb_run_until(struct gb_s *gb, const uint_fast8_t events,
+		const uint_fast32_t cycles)
+{
+	gb->counter.deadline = gb->counter.cycles + cycles;
+	gb->stop_events = events;
+	gb->stop_reason = GB_STOP_CYCLES;
+
+	/* Events other than breakpoints lower the deadline to stop. At least
+	 * one step is run, so that a breakpoint at the current address is
+	 * passed. */
+	do
+	{
+		__gb_step_cpu(gb);
+
+		if((events & GB_STOP_ON_BREAKPOINT) && !gb->halt_stopped &&
+				gb->cpu_reg.pc.reg == gb->breakpoint &&
+				gb->stop_reason == GB_STOP_CYCLES)
+		{
+			gb->stop_reason = GB_STOP_BREAKPOINT;
+			break;
+		}
+	} while(gb->counter.cycles < gb->counter.deadline);
+
+	gb->counter.deadline = UINT64_MAX;
+	gb->stop_events = 0;
+	return (enum gb_stop_reason_e)gb->stop_reason;
+}
+
+void gb_set_stop_ly(struct gb_s *gb, const uint8_t ly)
+{
+	gb->stop_ly = ly;
+}
+
+void gb_set_breakpoint(struct gb_s *gb, const uint_fast16_t addr)
+{
+	gb->breakpoint = addr;
+}
+
 int gb_get_save_size_s(struct gb_s *gb, size_t *ram_size)
 {
 	const uint_fast16_t ram_size_location = 0x0149;
@@ -3595,7 +4909,7 @@ int gb_get_save_size_s(struct gb_s *gb, size_t *ram_size)
 		/* 0,  2KiB,   8KiB,  32KiB,  128KiB,   64KiB */
 		0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000
 	};
-	uint8_t ram_size_code = gb->gb_rom_read(gb, ram_size_location);
+	uint8_t ram_size_code = PGB_ROM_READ(gb, ram_size_location);
 
 	/* MBC2 always has 512 half-bytes of cart RAM.
 	 * This assumes that only the lower nibble of each byte is used; the
@@ -3623,7 +4937,7 @@ uint_fast32_t gb_get_save_size(struct gb_s *gb)
 		/* 0,  2KiB,   8KiB,  32KiB,  128KiB,   64KiB */
 		0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000
 	};
-	uint8_t ram_size_code = gb->gb_rom_read(gb, ram_size_location);
+	uint8_t ram_size_code = PGB_ROM_READ(gb, ram_size_location);
 
 	/* MBC2 always has 512 half-bytes of cart RAM.
 	 * This assumes that only the lower nibble of each byte is used; the
@@ -3656,11 +4970,16 @@ uint8_t gb_colour_hash(struct gb_s *gb)
 	uint16_t i;
 
 	for(i = ROM_TITLE_START_ADDR; i <= ROM_TITLE_END_ADDR; i++)
-		x += gb->gb_rom_read(gb, i);
+		x += PGB_ROM_READ(gb, i);
 
 	return x;
 }
 
+uint64_t gb_get_cycles(const struct gb_s *gb)
+{
+	return gb->counter.cycles;
+}
+
 /**
  * Resets the context, and initialises startup values for a DMG console.
  */
@@ -3668,6 +4987,7 @@ void gb_reset(struct gb_s *gb)
 {
 	gb->gb_halt = false;
 	gb->gb_ime = true;
+	gb->halt_stopped = false;
 
 	/* Initialise MBC values. */
 	gb->selected_rom_bank = 1;
@@ -3679,7 +4999,8 @@ void gb_reset(struct gb_s *gb)
 	if(gb->gb_bootrom_read == NULL)
 	{
 		uint8_t hdr_chk;
-		hdr_chk = gb->gb_rom_read(gb, ROM_HEADER_CHECKSUM_LOC) != 0;
+		uint_fast16_t i;
+		hdr_chk = PGB_ROM_READ(gb, ROM_HEADER_CHECKSUM_LOC) != 0;
 
 		gb->cpu_reg.a = 0x01;
 		gb->cpu_reg.f.f_bits.z = 1;
@@ -3692,7 +5013,7 @@ void gb_reset(struct gb_s *gb)
 		gb->cpu_reg.sp.reg = 0xFFFE;
 		gb->cpu_reg.pc.reg = 0x0100;
 
-		gb->hram_io[IO_DIV ] = 0xAB;
+		gb->counter.div_base = gb->counter.cycles - 0xAB * DIV_CYCLES;
 		gb->hram_io[IO_LCDC] = 0x91;
 		gb->hram_io[IO_STAT] = 0x85;
 		gb->hram_io[IO_BOOT] = 0x01;
@@ -3700,23 +5021,32 @@ void gb_reset(struct gb_s *gb)
 		__gb_write(gb, 0xFF26, 0xF1);
 
 		memset(gb->vram, 0x00, VRAM_SIZE);
+		/* Lines drawn before the reset are no longer valid. */
+		gb->display.tile_gen++;
+		for(i = 0; i < NUM_TILES; i++)
+			gb->display.tile_gens[i]++;
+		gb->display.vram_dirty = 0xFFFFFFFF;
 	}
 	else
 	{
 		/* Set value as though the console was just switched on.
 		 * CPU registers are uninitialised. */
 		gb->cpu_reg.pc.reg = 0x0000;
-		gb->hram_io[IO_DIV ] = 0x00;
+		gb->counter.div_base = gb->counter.cycles;
 		gb->hram_io[IO_LCDC] = 0x00;
 		gb->hram_io[IO_STAT] = 0x84;
 		gb->hram_io[IO_BOOT] = 0x00;
 	}
 
+	/* Discard any lines that have not been drawn yet. */
+	gb->display.pending_count = 0;
+
 	gb->counter.lcd_count = 0;
-	gb->counter.div_count = 0;
 	gb->counter.tima_count = 0;
-	gb->counter.serial_count = 0;
+	gb->counter.serial_event = UINT64_MAX;
 	gb->counter.rtc_count = 0;
+	gb->counter.rtc_base = gb->counter.cycles;
+	gb->counter.deadline = UINT64_MAX;
 	gb->counter.lcd_off_count = 0;
 
 	gb->direct.joypad = 0xFF;
@@ -3727,6 +5057,7 @@ void gb_reset(struct gb_s *gb)
 	gb->hram_io[IO_TIMA] = 0x00;
 	gb->hram_io[IO_TMA ] = 0x00;
 	gb->hram_io[IO_TAC ] = 0xF8;
+	__gb_update_timer(gb);
 	gb->hram_io[IO_IF  ] = 0xE1;
 
 	/* LCDC */
@@ -3796,126 +5127,706 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 	gb->gb_serial_tx = NULL;
 	gb->gb_serial_rx = NULL;
 
-	gb->gb_bootrom_read = NULL;
+	gb->gb_bootrom_read = NULL;
+	gb->core = &gb_core;
+	gb->stop_events = 0;
+	gb->stop_reason = GB_STOP_CYCLES;
+	gb->stop_ly = 0;
+	gb->breakpoint = 0;
+
+	/* Check valid ROM using checksum value. */
+	{
+		uint8_t x = 0;
+		uint16_t i;
+
+		for(i = 0x0134; i <= 0x014C; i++)
+			x = x - PGB_ROM_READ(gb, i) - 1;
+
+		if(x != PGB_ROM_READ(gb, ROM_HEADER_CHECKSUM_LOC))
+			return GB_INIT_INVALID_CHECKSUM;
+	}
+
+	/* Check if cartridge type is supported, and set MBC type. */
+	{
+		const uint8_t mbc_value = PGB_ROM_READ(gb, mbc_location);
+
+		if(mbc_value > sizeof(cart_mbc) - 1 ||
+				(gb->mbc = cart_mbc[mbc_value]) == -1)
+			return GB_INIT_CARTRIDGE_UNSUPPORTED;
+	}
+
+	gb->num_rom_banks_mask = num_rom_banks_mask[PGB_ROM_READ(gb, bank_count_location)] - 1;
+	gb->cart_ram = cart_ram[PGB_ROM_READ(gb, mbc_location)];
+	gb->num_ram_banks = num_ram_banks[PGB_ROM_READ(gb, ram_size_location)];
+
+	/* If the ROM says that it support RAM, but has 0 RAM banks, then
+	 * disable RAM reads from the cartridge. */
+	if(gb->cart_ram == 0 || gb->num_ram_banks == 0)
+	{
+		gb->cart_ram = 0;
+		gb->num_ram_banks = 0;
+	}
+
+	/* If MBC3 and number of ROM or RAM banks are larger than 128 or 8,
+	 * respectively, then select MBC3O mode. */
+	if(gb->mbc == 3)
+		gb->cart_is_mbc3O = gb->num_rom_banks_mask > 128 || gb->num_ram_banks > 4;
+
+	/* Note that MBC2 will appear to have no RAM banks, but it actually
+	 * always has 512 half-bytes of RAM. Hence, gb->num_ram_banks must be
+	 * ignored for MBC2. */
+
+	gb->lcd_blank = false;
+	gb->rtc_host_sync = false;
+	gb->display.lcd_draw_line = NULL;
+	gb->display.fb = NULL;
+	gb->display.lcd_frame_done = NULL;
+	gb->display.worker = NULL;
+	gb->display.bg_cache = NULL;
+	memset(gb->display.tile_gens, 0, sizeof(gb->display.tile_gens));
+	gb->counter.cycles = 0;
+
+	gb_reset(gb);
+
+	return GB_INIT_NO_ERROR;
+}
+
+const char* gb_get_rom_name(struct gb_s* gb, char *title_str)
+{
+	uint_fast16_t title_loc = 0x134;
+	/* End of title may be 0x13E for newer games. */
+	const uint_fast16_t title_end = 0x143;
+	const char* title_start = title_str;
+
+	for(; title_loc <= title_end; title_loc++)
+	{
+		const char title_char = PGB_ROM_READ(gb, title_loc);
+
+		if(title_char >= ' ' && title_char <= '_')
+		{
+			*title_str = title_char;
+			title_str++;
+		}
+		else
+			break;
+	}
+
+	*title_str = '\0';
+	return title_start;
+}
+
+#if ENABLE_LCD
+void gb_invalidate_lcd(struct gb_s *gb)
+{
+	/* No line was drawn with this generation, so all lines will be
+	 * considered changed. */
+	gb->display.tile_gen++;
+}
+
+void gb_init_lcd(struct gb_s *gb,
+		void (*lcd_draw_line)(struct gb_s *gb,
+			const gb_pixel_t *pixels,
+			const uint_fast8_t line))
+{
+	/* Shades from white to black for each layer. */
+	static const uint32_t default_palette[4] =
+	{
+#if PEANUT_GB_PIXEL_FORMAT == PEANUT_GB_PIXEL_RGB555
+		0x7FFF, 0x5294, 0x294A, 0x0000
+#elif PEANUT_GB_PIXEL_FORMAT == PEANUT_GB_PIXEL_RGB565
+		0xFFFF, 0xAD55, 0x52AA, 0x0000
+#elif PEANUT_GB_PIXEL_FORMAT == PEANUT_GB_PIXEL_XRGB8888
+		0xFFFFFF, 0xAAAAAA, 0x555555, 0x000000
+#else
+		0, 1, 2, 3
+#endif
+	};
+	uint8_t i;
+
+	gb->display.lcd_draw_line = lcd_draw_line;
+	gb->display.fb = NULL;
+	gb->display.fb_pitch = 0;
+	gb->display.lcd_frame_done = NULL;
+	gb->display.lines_drawn = 0;
+	gb->display.bg_cache = NULL;
+
+	for(i = 0; i < 16; i++)
+		gb->display.palette[i] = default_palette[i & LCD_COLOUR];
+
+	gb->direct.interlace = false;
+	gb->display.interlace_count = false;
+	gb->direct.frame_skip = false;
+	gb->display.frame_skip_count = false;
+	gb->display.skip_period = 0;
+	gb->display.skip_auto_max = 0;
+	gb->display.skip_run = 0;
+	gb->display.skip_debt = 0;
+	gb->display.skip_frame = false;
+	gb->display.frames_rendered = 0;
+	gb->display.frames_skipped = 0;
+	gb->direct.skip_unchanged = false;
+
+	gb->direct.deferred_render = false;
+	gb->direct.render_mask = GB_RENDER_ALL;
+
+	gb->display.window_clear = 0;
+	gb->display.WY = 0;
+	gb->display.sprite_index.dirty = true;
+	gb->display.pending_count = 0;
+
+	memset(gb->display.lines, 0, sizeof(gb->display.lines));
+	gb_invalidate_lcd(gb);
+
+	return;
+}
+
+void gb_init_lcd_fb(struct gb_s *gb, void *fb, size_t pitch,
+		void (*lcd_frame_done)(struct gb_s *gb,
+			const uint_fast8_t lines_drawn))
+{
+	gb_init_lcd(gb, NULL);
+	gb->display.fb = fb;
+	gb->display.fb_pitch = pitch;
+	gb->display.lcd_frame_done = lcd_frame_done;
+}
+
+void gb_set_lcd_fb(struct gb_s *gb, void *fb, size_t pitch)
+{
+	if(fb == gb->display.fb && pitch == gb->display.fb_pitch)
+		return;
+
+	/* Lines captured so far belong to the previous framebuffer. */
+	PGB_FLUSH_LINES(gb);
+
+	gb->display.fb = fb;
+	gb->display.fb_pitch = pitch;
+
+	/* The new framebuffer does not hold the last frame drawn. */
+	gb_invalidate_lcd(gb);
+}
+
+void gb_set_lcd_palette(struct gb_s *gb, const uint32_t palette[16])
+{
+	/* Lines captured so far are drawn with the previous palette. */
+	PGB_FLUSH_LINES(gb);
+
+	memcpy(gb->display.palette, palette, sizeof(gb->display.palette));
+	gb_invalidate_lcd(gb);
+}
+
+void gb_set_frame_skip(struct gb_s *gb, uint8_t render, uint8_t period)
+{
+	gb->display.skip_render = render;
+	gb->display.skip_period = render < period ? period : 0;
+	gb->display.skip_phase = 0;
+}
+
+void gb_set_auto_frame_skip(struct gb_s *gb, uint8_t max_skip)
+{
+	gb->display.skip_auto_max = max_skip;
+	gb->display.skip_debt = 0;
+}
+
+void gb_report_frame_time(struct gb_s *gb, uint_fast32_t host_us)
+{
+	int_fast32_t debt = gb->display.skip_debt;
+
+	/* Only keep up to one frame of time saved by fast frames, so that
+	 * frames are skipped as soon as the host falls behind. Limit how far
+	 * behind the host may be, so that pauses are not made up for. */
+	if(host_us > 8 * FRAME_US)
+		host_us = 8 * FRAME_US;
+
+	debt += (int_fast32_t)host_us - FRAME_US;
+
+	if(debt < -FRAME_US)
+		debt = -FRAME_US;
+	else if(debt > 8 * FRAME_US)
+		debt = 8 * FRAME_US;
+
+	gb->display.skip_debt = debt;
+}
+
+void gb_get_frame_stats(struct gb_s *gb, uint_fast32_t *rendered,
+		uint_fast32_t *skipped)
+{
+	*rendered = gb->display.frames_rendered;
+	*skipped = gb->display.frames_skipped;
+}
+
+#if PEANUT_GB_RENDER_THREAD
+int gb_set_render_thread(struct gb_s *gb, bool enable)
+{
+	struct gb_render_worker_s *w = gb->display.worker;
+
+	if(enable == (w != NULL))
+		return 0;
+
+	/* Lines captured so far are drawn (or queued) the current way. */
+	PGB_FLUSH_LINES(gb);
+
+	if(!enable)
+	{
+		/* The render thread draws all queued lines before exiting. */
+		atomic_store(&w->quit, true);
+		sem_post(&w->wake);
+		pthread_join(w->thread, NULL);
+		sem_destroy(&w->wake);
+
+		gb->display.worker = NULL;
+		free(w);
+		return 0;
+	}
+
+	w = malloc(sizeof(*w));
+	if(w == NULL)
+		return -1;
+
+	w->gb = gb;
+	atomic_init(&w->quit, false);
+	atomic_init(&w->head, 0);
+	atomic_init(&w->tail, 0);
+
+	/* The render thread starts with a copy of the current memory. */
+	memcpy(w->vram, gb->vram, VRAM_SIZE);
+	memcpy(w->oam, gb->oam, OAM_SIZE);
+	memcpy(w->tile_gens, gb->display.tile_gens, sizeof(w->tile_gens));
+	w->sprite_index.dirty = true;
+	w->oam_gen = gb->display.oam_gen;
+	gb->display.vram_dirty = 0;
+
+	if(sem_init(&w->wake, 0, 0) != 0)
+	{
+		free(w);
+		return -1;
+	}
+
+	if(pthread_create(&w->thread, NULL, __gb_render_thread, w) != 0)
+	{
+		sem_destroy(&w->wake);
+		free(w);
+		return -1;
+	}
+
+	gb->display.worker = w;
+	return 0;
+}
+
+void gb_sync_render_thread(struct gb_s *gb)
+{
+	struct gb_render_worker_s *const w = gb->display.worker;
+
+	if(w == NULL)
+		return;
+
+	while(atomic_load_explicit(&w->tail, memory_order_acquire) !=
+			atomic_load_explicit(&w->head, memory_order_relaxed))
+		sched_yield();
+}
+#endif
+
+void gb_set_bg_cache(struct gb_s *gb, struct gb_bg_cache_s *cache)
+{
+	/* Lines captured so far are drawn with the previous cache, which
+	 * the render thread must be finished with. */
+	PGB_FLUSH_LINES(gb);
+#if PEANUT_GB_RENDER_THREAD
+	gb_sync_render_thread(gb);
+#endif
+
+	if(cache != NULL)
+		memset(cache->tile, 0xFF, sizeof(cache->tile));
+
+	gb->display.bg_cache = cache;
+}
+#endif
+
+void gb_set_bootrom(struct gb_s *gb,
+		 uint8_t (*gb_bootrom_read)(struct gb_s*, const uint_fast16_t))
+{
+	gb->gb_bootrom_read = gb_bootrom_read;
+}
+
+/**
+ * Deprecated. Will be removed in the next major version.
+ */
+PGB_DEPRECATED("RTC is now ticked internally; this function has no effect")
+void gb_tick_rtc(struct gb_s *gb)
+{
+	(void) gb;
+	return;
+}
+
+void gb_set_rtc(struct gb_s *gb, const struct tm * const time)
+{
+	/* Start counting from the new time. */
+	__gb_update_rtc(gb);
+	gb->rtc_real.bytes[0] = time->tm_sec;
+	gb->rtc_real.bytes[1] = time->tm_min;
+	gb->rtc_real.bytes[2] = time->tm_hour;
+	gb->rtc_real.bytes[3] = time->tm_yday & 0xFF; /* Low 8 bits of day counter. */
+	gb->rtc_real.bytes[4] = time->tm_yday >> 8; /* High 1 bit of day counter. */
+}
+
+void gb_sync_rtc(struct gb_s *gb, const time_t now)
+{
+	if(gb->rtc_host_sync && now > gb->rtc_host_time)
+		__gb_advance_rtc(&gb->rtc_real,
+				 (uint_fast32_t)(now - gb->rtc_host_time));
+
+	__gb_update_rtc(gb);
+	gb->rtc_host_sync = true;
+	gb->rtc_host_time = now;
+}
 
-	/* Check valid ROM using checksum value. */
-	{
-		uint8_t x = 0;
-		uint16_t i;
+void gb_save_rtc(struct gb_s *gb, uint8_t save[GB_RTC_SAVE_SIZE],
+		 const time_t now)
+{
+	const int64_t timestamp = now;
+	uint_fast8_t i;
 
-		for(i = 0x0134; i <= 0x014C; i++)
-			x = x - gb->gb_rom_read(gb, i) - 1;
+	if(gb->rtc_host_sync)
+		gb_sync_rtc(gb, now);
+	else
+		__gb_update_rtc(gb);
 
-		if(x != gb->gb_rom_read(gb, ROM_HEADER_CHECKSUM_LOC))
-			return GB_INIT_INVALID_CHECKSUM;
+	/* Each register is stored as a 32-bit little endian value, followed
+	 * by the latched registers and a 64-bit little endian UNIX time. */
+	memset(save, 0, GB_RTC_SAVE_SIZE);
+	for(i = 0; i < 5; i++)
+	{
+		save[i * 4] = gb->rtc_real.bytes[i];
+		save[(i + 5) * 4] = gb->rtc_latched.bytes[i];
 	}
 
-	/* Check if cartridge type is supported, and set MBC type. */
-	{
-		const uint8_t mbc_value = gb->gb_rom_read(gb, mbc_location);
+	for(i = 0; i < 8; i++)
+		save[40 + i] = (uint8_t)((uint64_t)timestamp >> (i * 8));
+}
 
-		if(mbc_value > sizeof(cart_mbc) - 1 ||
-				(gb->mbc = cart_mbc[mbc_value]) == -1)
-			return GB_INIT_CARTRIDGE_UNSUPPORTED;
-	}
+int gb_load_rtc(struct gb_s *gb, const uint8_t *save, const size_t size,
+		const time_t now)
+{
+	const uint8_t rtc_reg_mask[5] = {
+		0x3F, 0x3F, 0x1F, 0xFF, 0xC1
+	};
+	uint64_t timestamp = 0;
+	uint_fast8_t i;
 
-	gb->num_rom_banks_mask = num_rom_banks_mask[gb->gb_rom_read(gb, bank_count_location)] - 1;
-	gb->cart_ram = cart_ram[gb->gb_rom_read(gb, mbc_location)];
-	gb->num_ram_banks = num_ram_banks[gb->gb_rom_read(gb, ram_size_location)];
+	/* Older saves only have a 32-bit time. */
+	if(size != GB_RTC_SAVE_SIZE && size != GB_RTC_SAVE_SIZE - 4)
+		return -1;
 
-	/* If the ROM says that it support RAM, but has 0 RAM banks, then
-	 * disable RAM reads from the cartridge. */
-	if(gb->cart_ram == 0 || gb->num_ram_banks == 0)
+	__gb_update_rtc(gb);
+	for(i = 0; i < 5; i++)
 	{
-		gb->cart_ram = 0;
-		gb->num_ram_banks = 0;
+		gb->rtc_real.bytes[i] = save[i * 4] & rtc_reg_mask[i];
+		gb->rtc_latched.bytes[i] = save[(i + 5) * 4] & rtc_reg_mask[i];
 	}
 
-	/* If MBC3 and number of ROM or RAM banks are larger than 128 or 8,
-	 * respectively, then select MBC3O mode. */
-	if(gb->mbc == 3)
-		gb->cart_is_mbc3O = gb->num_rom_banks_mask > 128 || gb->num_ram_banks > 4;
-
-	/* Note that MBC2 will appear to have no RAM banks, but it actually
-	 * always has 512 half-bytes of RAM. Hence, gb->num_ram_banks must be
-	 * ignored for MBC2. */
+	for(i = 0; i < size - 40; i++)
+		timestamp |= (uint64_t)save[40 + i] << (i * 8);
 
-	gb->lcd_blank = false;
-	gb->display.lcd_draw_line = NULL;
+	if(size == GB_RTC_SAVE_SIZE - 4)
+		timestamp = (uint64_t)(int64_t)(int32_t)(uint32_t)timestamp;
 
-	gb_reset(gb);
+	/* Count the time that passed while the emulator was not running. */
+	if((int64_t)now > (int64_t)timestamp)
+		__gb_advance_rtc(&gb->rtc_real,
+				 (uint_fast32_t)((int64_t)now - (int64_t)timestamp));
 
-	return GB_INIT_NO_ERROR;
+	gb->rtc_host_time = now;
+	return 0;
 }
 
-const char* gb_get_rom_name(struct gb_s* gb, char *title_str)
+/* Size of the magic number, version and ROM checksums at the start of a
+ * save state. */
+#define PGB_STATE_HEADER_SIZE	8
+
+/* What __gb_state_walk() does with each field. */
+#define PGB_STATE_MEASURE	0
+#define PGB_STATE_SAVE		1
+#define PGB_STATE_LOAD		2
+
+/**
+ * Position within a save state being written or read by __gb_state_walk(),
+ * or only measured if buf is NULL.
+ */
+struct gb_state_cursor_s
 {
-	uint_fast16_t title_loc = 0x134;
-	/* End of title may be 0x13E for newer games. */
-	const uint_fast16_t title_end = 0x143;
-	const char* title_start = title_str;
+	uint8_t *buf;
+	size_t pos;
+	uint_fast8_t mode;
+};
 
-	for(; title_loc <= title_end; title_loc++)
-	{
-		const char title_char = gb->gb_rom_read(gb, title_loc);
+/**
+ * Writes val as n bytes in little endian order, or reads n bytes and returns
+ * them. Returns val when measuring or writing.
+ */
+static uint64_t __gb_state_int(struct gb_state_cursor_s *c, uint64_t val,
+		const uint_fast8_t n)
+{
+	uint_fast8_t i;
 
-		if(title_char >= ' ' && title_char <= '_')
-		{
-			*title_str = title_char;
-			title_str++;
-		}
-		else
-			break;
+	if(c->mode == PGB_STATE_SAVE)
+	{
+		for(i = 0; i < n; i++)
+			c->buf[c->pos + i] = (uint8_t)(val >> (i * 8));
+	}
+	else if(c->mode == PGB_STATE_LOAD)
+	{
+		val = 0;
+		for(i = 0; i < n; i++)
+			val |= (uint64_t)c->buf[c->pos + i] << (i * 8);
 	}
 
-	*title_str = '\0';
-	return title_start;
+	c->pos += n;
+	return val;
 }
 
-#if ENABLE_LCD
-void gb_init_lcd(struct gb_s *gb,
-		void (*lcd_draw_line)(struct gb_s *gb,
-			const uint8_t *pixels,
-			const uint_fast8_t line))
+/**
+ * Writes or reads an array of bytes.
+ */
+static void __gb_state_bytes(struct gb_state_cursor_s *c, uint8_t *bytes,
+		const size_t n)
 {
-	gb->display.lcd_draw_line = lcd_draw_line;
+	if(c->mode == PGB_STATE_SAVE)
+		memcpy(c->buf + c->pos, bytes, n);
+	else if(c->mode == PGB_STATE_LOAD)
+		memcpy(bytes, c->buf + c->pos, n);
 
-	gb->direct.interlace = false;
-	gb->display.interlace_count = false;
-	gb->direct.frame_skip = false;
-	gb->display.frame_skip_count = false;
+	c->pos += n;
+}
 
-	gb->display.window_clear = 0;
-	gb->display.WY = 0;
+/**
+ * Writes or reads a cycle in the past, as the number of cycles before the
+ * current one, so that the cycle count of the context is kept on load.
+ */
+static void __gb_state_since(struct gb_state_cursor_s *c,
+		const struct gb_s *gb, uint64_t *base)
+{
+	const uint64_t since = __gb_state_int(c, gb->counter.cycles - *base, 8);
 
-	return;
+	if(c->mode == PGB_STATE_LOAD)
+		*base = gb->counter.cycles - since;
 }
-#endif
 
-void gb_set_bootrom(struct gb_s *gb,
-		 uint8_t (*gb_bootrom_read)(struct gb_s*, const uint_fast16_t))
+/**
+ * Writes or reads the cycle of an event, as the number of cycles after the
+ * current one, or UINT64_MAX if the event is not scheduled.
+ */
+static void __gb_state_until(struct gb_state_cursor_s *c,
+		const struct gb_s *gb, uint64_t *event)
 {
-	gb->gb_bootrom_read = gb_bootrom_read;
+	const uint64_t until = __gb_state_int(c, *event == UINT64_MAX ?
+			UINT64_MAX : *event - gb->counter.cycles, 8);
+
+	if(c->mode == PGB_STATE_LOAD)
+		*event = until == UINT64_MAX ?
+			UINT64_MAX : gb->counter.cycles + until;
 }
 
+/* Writes, reads or measures a field of n bytes. The field is only assigned
+ * when loading, so that gb is left untouched otherwise. */
+#define PGB_STATE_FIELD(c, field, n)					\
+	do {								\
+		const uint64_t val_ = __gb_state_int(c, field, n);	\
+		if((c)->mode == PGB_STATE_LOAD)				\
+			field = val_;					\
+	} while(0)
+
 /**
- * Deprecated. Will be removed in the next major version.
+ * Writes, reads or measures every field of a save state after the header.
+ * Only loading modifies gb. Returns the size of the state.
  */
-PGB_DEPRECATED("RTC is now ticked internally; this function has no effect")
-void gb_tick_rtc(struct gb_s *gb)
+static size_t __gb_state_walk(struct gb_s *gb, uint8_t *buf,
+		const uint_fast8_t mode)
 {
-	(void) gb;
-	return;
+	struct gb_state_cursor_s c;
+	size_t ram_size;
+	size_t i;
+	uint8_t flags;
+	uint_fast16_t halt_cycles;
+
+	c.buf = buf;
+	c.pos = PGB_STATE_HEADER_SIZE;
+	c.mode = mode;
+
+	/* CPU */
+	PGB_STATE_FIELD(&c, gb->cpu_reg.a, 1);
+	PGB_STATE_FIELD(&c, gb->cpu_reg.f.reg, 1);
+	PGB_STATE_FIELD(&c, gb->cpu_reg.bc.reg, 2);
+	PGB_STATE_FIELD(&c, gb->cpu_reg.de.reg, 2);
+	PGB_STATE_FIELD(&c, gb->cpu_reg.hl.reg, 2);
+	PGB_STATE_FIELD(&c, gb->cpu_reg.sp.reg, 2);
+	PGB_STATE_FIELD(&c, gb->cpu_reg.pc.reg, 2);
+
+	flags = (uint8_t)__gb_state_int(&c,
+			gb->gb_halt << 0 | gb->gb_ime << 1 |
+			gb->halt_stopped << 2 | gb->gb_frame << 3 |
+			gb->lcd_blank << 4 | gb->rtc_host_sync << 5, 1);
+	if(mode == PGB_STATE_LOAD)
+	{
+		gb->gb_halt = (flags >> 0) & 1;
+		gb->gb_ime = (flags >> 1) & 1;
+		gb->halt_stopped = (flags >> 2) & 1;
+		gb->gb_frame = (flags >> 3) & 1;
+		gb->lcd_blank = (flags >> 4) & 1;
+		gb->rtc_host_sync = (flags >> 5) & 1;
+	}
+
+	/* Memory */
+	__gb_state_bytes(&c, gb->wram, WRAM_SIZE);
+	__gb_state_bytes(&c, gb->vram, VRAM_SIZE);
+	__gb_state_bytes(&c, gb->oam, OAM_SIZE);
+	__gb_state_bytes(&c, gb->hram_io, HRAM_IO_SIZE);
+
+	/* Cartridge RAM is kept by the front-end. It is only read through the
+	 * callbacks when saving or loading, as it may be large. */
+	if(gb_get_save_size_s(gb, &ram_size) != 0)
+		ram_size = 0;
+
+	if(mode == PGB_STATE_MEASURE)
+		c.pos += ram_size;
+	else
+	{
+		for(i = 0; i < ram_size; i++)
+		{
+			uint8_t val = 0;
+
+			if(mode == PGB_STATE_SAVE)
+				val = PGB_CART_RAM_READ(gb, i);
+
+			val = (uint8_t)__gb_state_int(&c, val, 1);
+
+			if(mode == PGB_STATE_LOAD)
+				PGB_CART_RAM_WRITE(gb, i, val);
+		}
+	}
+
+	/* MBC */
+	PGB_STATE_FIELD(&c, gb->selected_rom_bank, 2);
+	PGB_STATE_FIELD(&c, gb->cart_ram_bank, 1);
+	PGB_STATE_FIELD(&c, gb->enable_cart_ram, 1);
+	PGB_STATE_FIELD(&c, gb->cart_mode_select, 1);
+
+	/* RTC */
+	__gb_state_bytes(&c, gb->rtc_latched.bytes, sizeof(gb->rtc_latched.bytes));
+	__gb_state_bytes(&c, gb->rtc_real.bytes, sizeof(gb->rtc_real.bytes));
+	PGB_STATE_FIELD(&c, gb->rtc_host_time, 8);
+	PGB_STATE_FIELD(&c, gb->counter.rtc_count, 4);
+	__gb_state_since(&c, gb, &gb->counter.rtc_base);
+
+	/* Counters */
+	PGB_STATE_FIELD(&c, gb->counter.lcd_count, 2);
+	PGB_STATE_FIELD(&c, gb->counter.lcd_off_count, 4);
+	PGB_STATE_FIELD(&c, gb->counter.tima_count, 2);
+	/* The cycles of a HALT are only kept while it is stopped, so that
+	 * contexts in the same state save the same bytes. */
+	halt_cycles = (uint_fast16_t)__gb_state_int(&c,
+			gb->halt_stopped ? gb->counter.halt_cycles : 0, 2);
+	if(mode == PGB_STATE_LOAD)
+		gb->counter.halt_cycles = halt_cycles;
+	__gb_state_since(&c, gb, &gb->counter.div_base);
+	__gb_state_since(&c, gb, &gb->counter.tima_base);
+	__gb_state_until(&c, gb, &gb->counter.timer_event);
+	__gb_state_until(&c, gb, &gb->counter.serial_event);
+
+	/* Display */
+	PGB_STATE_FIELD(&c, gb->display.WY, 1);
+	PGB_STATE_FIELD(&c, gb->display.window_clear, 1);
+
+	return c.pos;
 }
 
-void gb_set_rtc(struct gb_s *gb, const struct tm * const time)
+size_t gb_state_size(const struct gb_s *gb)
 {
-	gb->rtc_real.bytes[0] = time->tm_sec;
-	gb->rtc_real.bytes[1] = time->tm_min;
-	gb->rtc_real.bytes[2] = time->tm_hour;
-	gb->rtc_real.bytes[3] = time->tm_yday & 0xFF; /* Low 8 bits of day counter. */
-	gb->rtc_real.bytes[4] = time->tm_yday >> 8; /* High 1 bit of day counter. */
+	/* Measuring only reads the context. */
+	return __gb_state_walk((struct gb_s *)gb, NULL, PGB_STATE_MEASURE);
+}
+
+int gb_state_save(struct gb_s *gb, uint8_t *state, const size_t size)
+{
+	if(size < gb_state_size(gb))
+		return -1;
+
+	/* Header: magic number, version, then the header checksum and global
+	 * checksum of the ROM. */
+	state[0] = 'P';
+	state[1] = 'G';
+	state[2] = 'B';
+	state[3] = 'S';
+	state[4] = GB_STATE_VERSION;
+	state[5] = PGB_ROM_READ(gb, ROM_HEADER_CHECKSUM_LOC);
+	state[6] = PGB_ROM_READ(gb, ROM_HEADER_CHECKSUM_LOC + 1);
+	state[7] = PGB_ROM_READ(gb, ROM_HEADER_CHECKSUM_LOC + 2);
+
+	__gb_state_walk(gb, state, PGB_STATE_SAVE);
+	return 0;
+}
+
+int gb_state_load(struct gb_s *gb, const uint8_t *state, const size_t size)
+{
+	uint_fast16_t i;
+
+	if(size != gb_state_size(gb) ||
+			state[0] != 'P' || state[1] != 'G' ||
+			state[2] != 'B' || state[3] != 'S' ||
+			state[4] != GB_STATE_VERSION)
+		return -1;
+
+	/* Only load states of the same game. */
+	for(i = 0; i < 3; i++)
+		if(state[5 + i] != PGB_ROM_READ(gb, ROM_HEADER_CHECKSUM_LOC + i))
+			return -1;
+
+	/* Lines waiting to be drawn belong to the previous state. */
+	PGB_FLUSH_LINES(gb);
+
+	/* The state is only read from when loading. */
+	__gb_state_walk(gb, (uint8_t *)state, PGB_STATE_LOAD);
+
+	/* Only select banks that the cartridge has, as the state may not have
+	 * been saved by this game. Banks 0x08 to 0x0C of MBC3 are the RTC
+	 * registers. Banks past the RAM of the cartridge already read and write
+	 * the first bank, so masking them changes nothing for valid states. */
+	gb->selected_rom_bank &= gb->num_rom_banks_mask;
+	if(!(gb->mbc == 3 && gb->cart_ram_bank >= 0x08 &&
+			gb->cart_ram_bank <= 0x0C))
+	{
+		if(gb->num_ram_banks == 0)
+			gb->cart_ram_bank = 0;
+		else
+			gb->cart_ram_bank &= gb->num_ram_banks - 1;
+	}
+	gb->enable_cart_ram = gb->enable_cart_ram != 0;
+	gb->cart_mode_select &= 1;
+
+	/* The boot ROM can only be mapped if this context has one. */
+	if(gb->gb_bootrom_read == NULL)
+		gb->hram_io[IO_BOOT] = 0x01;
+
+	__gb_schedule(gb);
+
+	/* Everything drawn or cached so far may now be out of date. */
+	gb->display.tile_gen++;
+	gb->display.map_gen[0]++;
+	gb->display.map_gen[1]++;
+	gb->display.oam_gen++;
+	for(i = 0; i < NUM_TILES; i++)
+		gb->display.tile_gens[i]++;
+	gb->display.sprite_index.dirty = true;
+#if PEANUT_GB_RENDER_THREAD
+	gb->display.vram_dirty = 0xFFFFFFFF;
+#endif
+
+	return 0;
 }
+
+const struct gb_core_s gb_core =
+{
+	PGB_VARIANT_NAME, gb_init, gb_reset, gb_run_frame, gb_run_cycles,
+	gb_run_until, gb_state_size, gb_state_save, gb_state_load
+};
 #endif // PEANUT_GB_HEADER_ONLY
 
 /** Function prototypes: Required functions **/
@@ -3923,6 +5834,11 @@ void gb_set_rtc(struct gb_s *gb, const struct tm * const time)
  * Initialises the emulator context to a known state. Call this before calling
  * any other peanut-gb function.
  * To reset the emulator, you can call gb_reset() instead.
+ * To use a copy of the core compiled with PEANUT_GB_VARIANT, call the init
+ * function of its struct gb_core_s instead, then run it and save its state
+ * through gb->core, such as with gb->core->run_frame().
+ * Callbacks bound at compile time, such as with PEANUT_GB_ROM_READ, are used
+ * instead of the matching pointers, which may then be NULL.
  *
  * \param gb	Allocated emulator context. Must not be NULL.
  * \param gb_rom_read Pointer to function that reads ROM data. ROM banking is
@@ -3952,6 +5868,56 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
  */
 void gb_run_frame(struct gb_s *gb);
 
+/**
+ * Executes the emulator for the given number of clock cycles, at 4194304
+ * cycles per second. Stops at the first instruction boundary at or after that
+ * many cycles. While the CPU is halted, stops at the first LCD or timer step at
+ * or after it, and the HALT carries on in the next call. Running in slices
+ * gives the same result as running in frames, so this may be used to run for
+ * less than a frame at a time.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param cycles Number of cycles to run for.
+ * \returns	Number of cycles run.
+ */
+uint_fast32_t gb_run_cycles(struct gb_s *gb, uint_fast32_t cycles);
+
+/**
+ * Executes the emulator until one of the given events happens, or for at most
+ * the given number of clock cycles, as gb_run_cycles(). Each event stops
+ * emulation at the end of the instruction, or the LCD or timer step during
+ * HALT, in which it happened, so calling this again carries on from there.
+ *
+ * With GB_STOP_ON_INVALID_OPCODE, an invalid opcode stops emulation instead
+ * of being passed to the error callback, and PC is left at the opcode.
+ * Breakpoints are checked between instructions, after at least one has run,
+ * and after jumping to an interrupt handler.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param events GB_STOP_ON_* events to stop on, ORed together.
+ * \param cycles Maximum number of cycles to run for.
+ * \returns	Why emulation stopped, or GB_STOP_CYCLES if no event happened.
+ */
+enum gb_stop_reason_e gb_run_until(struct gb_s *gb, const uint_fast8_t events,
+		const uint_fast32_t cycles);
+
+/**
+ * Sets the line at which GB_STOP_ON_LY stops gb_run_until(). Line 0 is
+ * reached at the end of the last VBlank line.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param ly	Value of LY to stop at, from 0 to 153.
+ */
+void gb_set_stop_ly(struct gb_s *gb, const uint8_t ly);
+
+/**
+ * Sets the address at which GB_STOP_ON_BREAKPOINT stops gb_run_until().
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param addr	Address of the instruction to stop before.
+ */
+void gb_set_breakpoint(struct gb_s *gb, const uint_fast16_t addr);
+
 /**
  * Internal function used to step the CPU. Used mainly for testing.
  * Use gb_run_frame() instead.
@@ -3986,8 +5952,146 @@ void gb_reset(struct gb_s *gb);
 #if ENABLE_LCD
 void gb_init_lcd(struct gb_s *gb,
 		void (*lcd_draw_line)(struct gb_s *gb,
-			const uint8_t *pixels,
+			const gb_pixel_t *pixels,
 			const uint_fast8_t line));
+
+/**
+ * Initialises the display context of the emulator to draw each line straight
+ * into a framebuffer, instead of calling a function for each line. Only
+ * available when ENABLE_LCD is defined to a non-zero value.
+ * Pixels have the same format as those sent to lcd_draw_line. Line n is drawn
+ * to the LCD_LINE_SIZE gb_pixel_t starting at fb + (pitch * n) bytes. Lines
+ * skipped by direct.skip_unchanged, direct.interlace or direct.frame_skip are
+ * not written to.
+ * This function can be called at any time.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param fb	Framebuffer of at least 144 lines. If NULL, nothing is drawn
+ *		until a framebuffer is set with gb_set_lcd_fb().
+ * \param pitch	Number of bytes between the start of each line.
+ * \param lcd_frame_done Pointer to function called at the start of VBLANK,
+ *		once the frame has been drawn into fb. lines_drawn is the
+ *		number of lines written since the previous call. May be NULL.
+ */
+void gb_init_lcd_fb(struct gb_s *gb, void *fb, size_t pitch,
+		void (*lcd_frame_done)(struct gb_s *gb,
+			const uint_fast8_t lines_drawn));
+
+/**
+ * Changes the framebuffer set with gb_init_lcd_fb(), such as when switching
+ * between multiple screen buffers. Lines already captured are drawn into the
+ * previous framebuffer. If fb or pitch changes, every line is drawn again on
+ * the next frame.
+ *
+ * \param gb	An initialised emulator context, with gb_init_lcd_fb() called.
+ * \param fb	Framebuffer of at least 144 lines. Must not be NULL.
+ * \param pitch	Number of bytes between the start of each line.
+ */
+void gb_set_lcd_fb(struct gb_s *gb, void *fb, size_t pitch);
+
+/**
+ * Sets the look-up table used to convert pixels to PEANUT_GB_PIXEL_FORMAT.
+ * Unused for PEANUT_GB_PIXEL_INDEX8. The table is indexed by the shade of the
+ * pixel in bits 1-0, and its layer in bits 3-2 (OBJ0 = 0b00, OBJ1 = 0b01,
+ * BG = 0b10). gb_init_lcd() and gb_init_lcd_fb() set shades of grey.
+ * Every line is drawn again on the next frame.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param palette Colour of each pixel index in PEANUT_GB_PIXEL_FORMAT.
+ */
+void gb_set_lcd_palette(struct gb_s *gb, const uint32_t palette[16]);
+
+/**
+ * Draws only the first render frames of every period frames, such as 2 of
+ * every 3 for 40fps. This is in addition to direct.frame_skip. Skipping is
+ * disabled if render is not less than period.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param render Number of frames to draw in each period.
+ * \param period Number of frames in each period.
+ */
+void gb_set_frame_skip(struct gb_s *gb, uint8_t render, uint8_t period);
+
+/**
+ * Enables automatic frame skip, which skips drawing frames while the host is
+ * slower than real time, so that emulation can continue at full speed. The
+ * front-end must measure the time taken by each call to gb_run_frame() and
+ * pass it to gb_report_frame_time().
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param max_skip Most frames that may be skipped in a row, or 0 to disable
+ *		automatic frame skip.
+ */
+void gb_set_auto_frame_skip(struct gb_s *gb, uint8_t max_skip);
+
+/**
+ * Reports the host time taken by the last call to gb_run_frame(), for
+ * automatic frame skip.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param host_us Time taken in microseconds.
+ */
+void gb_report_frame_time(struct gb_s *gb, uint_fast32_t host_us);
+
+/**
+ * Obtains the number of frames drawn and skipped since gb_init_lcd() or
+ * gb_init_lcd_fb() was called.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param rendered Set to the number of frames drawn. Must not be NULL.
+ * \param skipped Set to the number of frames skipped. Must not be NULL.
+ */
+void gb_get_frame_stats(struct gb_s *gb, uint_fast32_t *rendered,
+		uint_fast32_t *skipped);
+
+/**
+ * Forces every line to be drawn on the next frame, even if
+ * direct.skip_unchanged is set. Call this if the front-end no longer has the
+ * last frame that was drawn, such as when switching between multiple screen
+ * buffers.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ */
+void gb_invalidate_lcd(struct gb_s *gb);
+
+#if PEANUT_GB_RENDER_THREAD
+/**
+ * Starts or stops drawing the screen on a separate thread. Only available when
+ * PEANUT_GB_RENDER_THREAD is defined to a non-zero value.
+ * While enabled, lines are captured as with direct.deferred_render, and
+ * lcd_draw_line, or drawing into the framebuffer and lcd_frame_done, happens on
+ * the render thread, up to a few frames after gb_run_frame() has returned. The pixels drawn are identical to drawing on
+ * the calling thread. The render thread must be stopped before the context is
+ * freed.
+ *
+ * \param gb	An initialised emulator context, with gb_init_lcd() or
+ *		gb_init_lcd_fb() called.
+ * \param enable true to start the render thread, false to stop it.
+ * \returns	0 on success, or -1 if the thread could not be started.
+ */
+int gb_set_render_thread(struct gb_s *gb, bool enable);
+
+/**
+ * Waits for the render thread to draw every line sent to it. Call this before
+ * displaying a frame drawn by the render thread.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ */
+void gb_sync_render_thread(struct gb_s *gb);
+#endif
+
+/**
+ * Sets a cache that the background and window are copied from, which makes
+ * frames that only scroll cheaper to draw. Each map entry is drawn into the
+ * cache when it is first used, and again after its tile changes. The pixels
+ * drawn are identical to drawing without the cache.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param cache	Cache allocated by the front-end, which must remain valid
+ *		until it is replaced, or NULL to stop using a cache.
+ *		gb_init_lcd() also stops using the cache.
+ */
+void gb_set_bg_cache(struct gb_s *gb, struct gb_bg_cache_s *cache);
 #endif
 
 /**
@@ -3997,10 +6101,15 @@ void gb_init_lcd(struct gb_s *gb,
  *
  * \param gb	An initialised emulator context. Must not be NULL.
  * \param gb_serial_tx Pointer to function that transmits a byte of data over
- *		the serial connection. Must not be NULL.
+ *		the serial connection. Called when the game starts a
+ *		transfer. Must not be NULL.
  * \param gb_serial_rx Pointer to function that receives a byte of data over the
- *		serial connection. If no byte is received,
- *		return GB_SERIAL_RX_NO_CONNECTION. Must not be NULL.
+ *		serial connection. Called when the transfer is due to
+ *		complete. If no byte is received,
+ *		return GB_SERIAL_RX_NO_CONNECTION. If the byte may still
+ *		arrive, return GB_SERIAL_RX_PENDING to be called again
+ *		SERIAL_POLL_CYCLES later instead of waiting for it.
+ *		Must not be NULL.
  */
 void gb_init_serial(struct gb_s *gb,
 		    void (*gb_serial_tx)(struct gb_s*, const uint8_t),
@@ -4043,6 +6152,16 @@ uint_fast32_t gb_get_save_size(struct gb_s *gb);
  */
 uint8_t gb_colour_hash(struct gb_s *gb);
 
+/**
+ * Returns the number of clock cycles emulated since gb_init(), at 4194304
+ * cycles per second. This does not wrap, so may be used to timestamp events or
+ * to pace audio and video.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	Number of cycles emulated.
+ */
+uint64_t gb_get_cycles(const struct gb_s *gb);
+
 /**
  * Returns the title of ROM.
  *
@@ -4067,6 +6186,80 @@ void gb_tick_rtc(struct gb_s *gb);
  */
 void gb_set_rtc(struct gb_s *gb, const struct tm * const time);
 
+/**
+ * Makes the RTC follow the host clock instead of the emulated clock, so that
+ * it keeps the correct time when the emulator is paused, fast forwarded or
+ * throttled. The RTC is advanced by the host time passed since the previous
+ * call, so this should be called at least once per emulated second. The RTC
+ * follows the emulated clock again after gb_init().
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param now	Current host time, such as from time(NULL).
+ */
+void gb_sync_rtc(struct gb_s *gb, const time_t now);
+
+/**
+ * Writes the RTC to save, in the 48 byte format that BGB and VBA-M append to
+ * the cartridge RAM in save files.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param save	Buffer of GB_RTC_SAVE_SIZE bytes.
+ * \param now	Current host time, such as from time(NULL).
+ */
+void gb_save_rtc(struct gb_s *gb, uint8_t save[GB_RTC_SAVE_SIZE],
+		 const time_t now);
+
+/**
+ * Restores the RTC from data written by gb_save_rtc(), and advances it by
+ * the host time passed since it was saved.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param save	Saved RTC.
+ * \param size	Size of save, which may be GB_RTC_SAVE_SIZE or the 44 bytes
+ * 		of older VBA-M saves.
+ * \param now	Current host time, such as from time(NULL).
+ * \returns	0 on success, or -1 if size is not a known RTC format.
+ */
+int gb_load_rtc(struct gb_s *gb, const uint8_t *save, const size_t size,
+		const time_t now);
+
+/**
+ * Returns the size of a save state of the context, which depends on the size
+ * of the cartridge RAM.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	Size of the state written by gb_state_save().
+ */
+size_t gb_state_size(const struct gb_s *gb);
+
+/**
+ * Saves the state of the emulated console: the CPU, memory including the
+ * cartridge RAM, timers, MBC, RTC and LCD. Callbacks, front-end settings and
+ * what has been drawn are not saved. The state is little endian, so it may be
+ * loaded on any host.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param state Buffer of at least gb_state_size() bytes.
+ * \param size	Size of state.
+ * \returns	0 on success, or -1 if state is too small.
+ */
+int gb_state_save(struct gb_s *gb, uint8_t *state, const size_t size);
+
+/**
+ * Loads a state saved by gb_state_save() from the same game. The cycle count
+ * of the context carries on from where it was, and every line is drawn again
+ * on the next frame. ROM and RAM banks that the cartridge does not have are
+ * masked off, so that a damaged state cannot read or write past them. If the
+ * context has no boot ROM, the boot ROM is left unmapped.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param state State saved by gb_state_save().
+ * \param size	Size of state.
+ * \returns	0 on success, or -1 if the state is not of this version and
+ *		this game, and the context is unchanged.
+ */
+int gb_state_load(struct gb_s *gb, const uint8_t *state, const size_t size);
+
 /**
  * Use boot ROM on reset. gb_reset() must be called for this to take affect.
  * \param gb 	An initialised emulator context. Must not be NULL.
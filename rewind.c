@@ -0,0 +1,342 @@
+#include "rewind.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Only the prototypes are needed to save and load states. */
+#define PEANUT_GB_HEADER_ONLY
+#include "peanut_gb.h"
+
+/* Longest run of words that is encoded with one count. */
+#define REWIND_RUN_MAX  0x7FFF
+
+/* Position of no record. */
+#define REWIND_NONE     UINT32_MAX
+
+/* Header of each record in the ring, followed by its encoded state. */
+struct rewind_record_s
+{
+    /* Size of the encoded state. */
+    uint32_t size;
+    /* Position of the previous record. */
+    uint32_t prev;
+    /* For a keyframe, the position of the previous keyframe. */
+    uint32_t prev_key;
+    /* Number of states since the keyframe, which is 0 for a keyframe. */
+    uint32_t frame;
+};
+
+struct rewind_s
+{
+    size_t state_size;
+    /* Size of a state in words, rounded up. */
+    size_t words;
+    unsigned key_interval;
+
+    /* States are encoded as runs of words that are the same as, and differ
+     * from, their keyframe, or zero for a keyframe. */
+    uint32_t *key;
+    uint32_t *zero;
+    uint32_t *state;
+    uint8_t *enc;
+
+    uint8_t *ring;
+    uint32_t cap;
+    uint32_t used;
+    /* Position of the next record, and of the oldest, newest and newest
+     * keyframe records. */
+    uint32_t head;
+    uint32_t tail;
+    uint32_t newest;
+    uint32_t newest_key;
+    size_t count;
+    /* Number of states pushed since the newest keyframe. */
+    uint32_t since_key;
+};
+
+static void rewind_ring_write(rewind_t *rw, uint32_t pos, const void *src,
+                              uint32_t size)
+{
+    const uint32_t first = size < rw->cap - pos ? size : rw->cap - pos;
+
+    memcpy(rw->ring + pos, src, first);
+    memcpy(rw->ring, (const uint8_t *)src + first, size - first);
+}
+
+static void rewind_ring_read(const rewind_t *rw, uint32_t pos, void *dst,
+                             uint32_t size)
+{
+    const uint32_t first = size < rw->cap - pos ? size : rw->cap - pos;
+
+    memcpy(dst, rw->ring + pos, first);
+    memcpy((uint8_t *)dst + first, rw->ring, size - first);
+}
+
+static uint32_t rewind_ring_next(const rewind_t *rw, uint32_t pos,
+                                 uint32_t size)
+{
+    return (uint32_t)(((uint64_t)pos + size) % rw->cap);
+}
+
+static uint8_t *rewind_put_count(uint8_t *out, size_t n)
+{
+    if (n < 0x80)
+    {
+        *out++ = (uint8_t)n;
+    }
+    else
+    {
+        *out++ = (uint8_t)(0x80 | (n >> 8));
+        *out++ = (uint8_t)n;
+    }
+
+    return out;
+}
+
+static const uint8_t *rewind_get_count(const uint8_t *in, size_t *n)
+{
+    if (*in < 0x80)
+    {
+        *n = *in++;
+    }
+    else
+    {
+        *n = (size_t)(*in++ & 0x7F) << 8;
+        *n |= *in++;
+    }
+
+    return in;
+}
+
+/**
+ * Encodes words as pairs of runs: the number of words that are the same as
+ * in base, then the number that differ, followed by them XORed with base.
+ * Returns the size of the encoding, which is at most 8 bytes per word.
+ */
+static uint32_t rewind_encode(uint8_t *out, const uint32_t *words,
+                              const uint32_t *base, size_t count)
+{
+    uint8_t *const start = out;
+    size_t i = 0;
+
+    while (i < count)
+    {
+        size_t same = i;
+        size_t diff;
+
+        while (i < count && i - same < REWIND_RUN_MAX && words[i] == base[i])
+            i++;
+        out = rewind_put_count(out, i - same);
+
+        diff = i;
+        while (i < count && i - diff < REWIND_RUN_MAX && words[i] != base[i])
+            i++;
+        out = rewind_put_count(out, i - diff);
+
+        for (; diff < i; diff++)
+        {
+            const uint32_t x = words[diff] ^ base[diff];
+            memcpy(out, &x, sizeof(x));
+            out += sizeof(x);
+        }
+    }
+
+    return (uint32_t)(out - start);
+}
+
+/**
+ * Decodes words encoded by rewind_encode() against the same base.
+ */
+static void rewind_decode(const uint8_t *in, uint32_t *words,
+                          const uint32_t *base, size_t count)
+{
+    size_t i = 0;
+
+    memcpy(words, base, count * sizeof(*words));
+    while (i < count)
+    {
+        size_t same;
+        size_t diff;
+
+        in = rewind_get_count(in, &same);
+        in = rewind_get_count(in, &diff);
+        for (i += same; diff > 0; diff--, i++)
+        {
+            uint32_t x;
+            memcpy(&x, in, sizeof(x));
+            in += sizeof(x);
+            words[i] ^= x;
+        }
+    }
+}
+
+/**
+ * Decodes the keyframe record at pos into rw->key.
+ */
+static void rewind_load_key(rewind_t *rw, uint32_t pos)
+{
+    struct rewind_record_s rec;
+
+    rewind_ring_read(rw, pos, &rec, sizeof(rec));
+    rewind_ring_read(rw, rewind_ring_next(rw, pos, sizeof(rec)), rw->enc,
+                     rec.size);
+    rewind_decode(rw->enc, rw->key, rw->zero, rw->words);
+}
+
+/**
+ * Drops the oldest keyframe and every state that depends on it.
+ */
+static void rewind_drop_oldest(rewind_t *rw)
+{
+    for (;;)
+    {
+        struct rewind_record_s rec;
+        uint32_t size;
+
+        rewind_ring_read(rw, rw->tail, &rec, sizeof(rec));
+        size = sizeof(rec) + rec.size;
+        rw->tail = rewind_ring_next(rw, rw->tail, size);
+        rw->used -= size;
+        rw->count--;
+
+        if (rw->count > 0)
+            rewind_ring_read(rw, rw->tail, &rec, sizeof(rec));
+        if (rw->count == 0 || rec.frame == 0)
+            break;
+    }
+}
+
+rewind_t *rewind_create(struct gb_s *gb, unsigned key_interval, size_t budget)
+{
+    rewind_t *rw = calloc(1, sizeof(*rw));
+
+    if (!rw)
+        return NULL;
+
+    rw->state_size = gb_state_size(gb);
+    rw->words = (rw->state_size + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+    rw->key_interval = key_interval ? key_interval : 1;
+    rw->cap = budget < UINT32_MAX ? (uint32_t)budget : UINT32_MAX - 1;
+    rw->key = calloc(rw->words, sizeof(uint32_t));
+    rw->zero = calloc(rw->words, sizeof(uint32_t));
+    rw->state = calloc(rw->words, sizeof(uint32_t));
+    rw->enc = malloc(rw->words * 8);
+    rw->ring = malloc(rw->cap ? rw->cap : 1);
+    rw->newest = REWIND_NONE;
+    rw->newest_key = REWIND_NONE;
+
+    if (!rw->key || !rw->zero || !rw->state || !rw->enc || !rw->ring)
+    {
+        rewind_free(rw);
+        return NULL;
+    }
+
+    return rw;
+}
+
+void rewind_free(rewind_t *rw)
+{
+    if (!rw)
+        return;
+
+    free(rw->ring);
+    free(rw->enc);
+    free(rw->state);
+    free(rw->zero);
+    free(rw->key);
+    free(rw);
+}
+
+int rewind_push(rewind_t *rw, struct gb_s *gb)
+{
+    struct rewind_record_s rec;
+    bool is_key = rw->count == 0 || rw->since_key >= rw->key_interval;
+    uint32_t need;
+
+    gb_state_save(gb, (uint8_t *)rw->state, rw->state_size);
+
+    rec.size = rewind_encode(rw->enc, rw->state, is_key ? rw->zero : rw->key,
+                             rw->words);
+    need = sizeof(rec) + rec.size;
+
+    while (rw->cap - rw->used < need)
+    {
+        /* The states of the newest keyframe can only be dropped along with
+         * it, so start a new keyframe instead. */
+        if (!is_key && rw->tail == rw->newest_key)
+        {
+            is_key = true;
+            rec.size = rewind_encode(rw->enc, rw->state, rw->zero, rw->words);
+            need = sizeof(rec) + rec.size;
+            continue;
+        }
+
+        if (rw->count == 0)
+            return -1;
+
+        rewind_drop_oldest(rw);
+    }
+
+    rec.prev = rw->count > 0 ? rw->newest : REWIND_NONE;
+    rec.prev_key = rw->count > 0 ? rw->newest_key : REWIND_NONE;
+    rec.frame = is_key ? 0 : rw->since_key;
+    rewind_ring_write(rw, rw->head, &rec, sizeof(rec));
+    rewind_ring_write(rw, rewind_ring_next(rw, rw->head, sizeof(rec)), rw->enc,
+                      rec.size);
+
+    if (is_key)
+    {
+        memcpy(rw->key, rw->state, rw->words * sizeof(uint32_t));
+        rw->newest_key = rw->head;
+    }
+
+    if (rw->count == 0)
+        rw->tail = rw->head;
+
+    rw->newest = rw->head;
+    rw->head = rewind_ring_next(rw, rw->head, need);
+    rw->used += need;
+    rw->count++;
+    rw->since_key = rec.frame + 1;
+    return 0;
+}
+
+int rewind_pop(rewind_t *rw, struct gb_s *gb)
+{
+    struct rewind_record_s rec;
+
+    if (rw->count == 0)
+        return -1;
+
+    rewind_ring_read(rw, rw->newest, &rec, sizeof(rec));
+    rewind_ring_read(rw, rewind_ring_next(rw, rw->newest, sizeof(rec)),
+                     rw->enc, rec.size);
+    rewind_decode(rw->enc, rw->state, rec.frame == 0 ? rw->zero : rw->key,
+                  rw->words);
+    gb_state_load(gb, (const uint8_t *)rw->state, rw->state_size);
+
+    rw->head = rw->newest;
+    rw->used -= sizeof(rec) + rec.size;
+    rw->count--;
+    if (rw->count == 0)
+        return 0;
+
+    /* Carry on from the state before, with its keyframe. */
+    rw->newest = rec.prev;
+    if (rec.frame == 0)
+    {
+        rw->newest_key = rec.prev_key;
+        rewind_load_key(rw, rw->newest_key);
+    }
+
+    rewind_ring_read(rw, rw->newest, &rec, sizeof(rec));
+    rw->since_key = rec.frame + 1;
+    return 0;
+}
+
+size_t rewind_count(const rewind_t *rw)
+{
+    return rw->count;
+}
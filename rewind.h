@@ -0,0 +1,51 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+
+struct gb_s;
+
+/**
+ * Recent save states of a console, so that it can be rewound a frame at a
+ * time. Every key_interval states, a whole state is kept as a keyframe. The
+ * states in between only keep the bytes that differ from their keyframe,
+ * which are few as most frames change little of WRAM and VRAM. States are
+ * kept in a ring of fixed size, and the oldest are dropped, a keyframe and
+ * the states that follow it at a time, to make room for new ones.
+ */
+typedef struct rewind_s rewind_t;
+
+/**
+ * Creates a rewind buffer for the console, keeping a keyframe every
+ * key_interval states in a ring of budget bytes. The buffer also needs a few
+ * copies of the save state of the console on top of this.
+ *
+ * Returns NULL if there was not enough memory.
+ */
+rewind_t *rewind_create(struct gb_s *gb, unsigned key_interval, size_t budget);
+
+/**
+ * Frees the rewind buffer.
+ */
+void rewind_free(rewind_t *rw);
+
+/**
+ * Saves the state of the console, such as once per frame.
+ *
+ * Returns 0 on success, or -1 if a keyframe does not fit in the budget.
+ */
+int rewind_push(rewind_t *rw, struct gb_s *gb);
+
+/**
+ * Loads the state saved last into the console, and removes it.
+ *
+ * Returns 0 on success, or -1 if there are no states left.
+ */
+int rewind_pop(rewind_t *rw, struct gb_s *gb);
+
+/**
+ * Returns the number of states that can be popped.
+ */
+size_t rewind_count(const rewind_t *rw);
+
+#endif
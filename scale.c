@@ -0,0 +1,559 @@
+#include "scale.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Use SSE2 or NEON when the compiler supports them. */
+#ifndef SCALE_USE_SIMD
+# define SCALE_USE_SIMD 1
+#endif
+
+#if SCALE_USE_SIMD && (defined(__SSE2__) || defined(_M_X64))
+# include <emmintrin.h>
+# define SCALE_SSE2 1
+#elif SCALE_USE_SIMD && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+# include <arm_neon.h>
+# define SCALE_NEON 1
+#endif
+
+/**
+ * Scales one row of the source image into the rows at dst. above and below
+ * are the neighbouring source rows, repeating the edges of the image.
+ */
+typedef void (*scale_row_t)(const void *above, const void *row,
+                            const void *below, void *const *dst,
+                            unsigned width);
+
+/**
+ * Portable C implementation for pixels of type T, which are "bits" wide.
+ * Each function scales pixels x to end - 1 of a row, so that the SIMD
+ * implementations can use them for the edges of the image.
+ */
+#define SCALE_DEFINE_C(T, bits)                                               \
+static void nearest_c_##bits(const T *s, T *d, unsigned x, unsigned end,      \
+                             const unsigned n)                                \
+{                                                                             \
+    for (; x < end; x++) {                                                    \
+        unsigned k;                                                           \
+                                                                              \
+        for (k = 0; k < n; k++)                                               \
+            d[x * n + k] = s[x];                                              \
+    }                                                                         \
+}                                                                             \
+                                                                              \
+static void scale2x_c_##bits(const T *b, const T *e, const T *h,              \
+                             T *d0, T *d1,                                    \
+                             unsigned x, unsigned end, unsigned w)            \
+{                                                                             \
+    for (; x < end; x++) {                                                    \
+        const T B = b[x], E = e[x], H = h[x];                                 \
+        const T D = e[x > 0 ? x - 1 : x];                                     \
+        const T F = e[x + 1 < w ? x + 1 : x];                                 \
+        T e0 = E, e1 = E, e2 = E, e3 = E;                                     \
+                                                                              \
+        if (B != H && D != F) {                                               \
+            if (D == B) e0 = D;                                               \
+            if (B == F) e1 = F;                                               \
+            if (D == H) e2 = D;                                               \
+            if (H == F) e3 = F;                                               \
+        }                                                                     \
+                                                                              \
+        d0[2 * x] = e0;                                                       \
+        d0[2 * x + 1] = e1;                                                   \
+        d1[2 * x] = e2;                                                       \
+        d1[2 * x + 1] = e3;                                                   \
+    }                                                                         \
+}                                                                             \
+                                                                              \
+static void scale3x_c_##bits(const T *b, const T *e, const T *h,              \
+                             T *d0, T *d1, T *d2,                             \
+                             unsigned x, unsigned end, unsigned w)            \
+{                                                                             \
+    for (; x < end; x++) {                                                    \
+        const unsigned l = x > 0 ? x - 1 : x;                                 \
+        const unsigned r = x + 1 < w ? x + 1 : x;                             \
+        const T A = b[l], B = b[x], C = b[r];                                 \
+        const T D = e[l], E = e[x], F = e[r];                                 \
+        const T G = h[l], H = h[x], I = h[r];                                 \
+        T o[9];                                                               \
+        unsigned k;                                                           \
+                                                                              \
+        for (k = 0; k < 9; k++)                                               \
+            o[k] = E;                                                         \
+                                                                              \
+        if (B != H && D != F) {                                               \
+            if (D == B) o[0] = D;                                             \
+            if ((D == B && E != C) || (B == F && E != A)) o[1] = B;           \
+            if (B == F) o[2] = F;                                             \
+            if ((D == B && E != G) || (D == H && E != A)) o[3] = D;           \
+            if ((B == F && E != I) || (H == F && E != C)) o[5] = F;           \
+            if (D == H) o[6] = D;                                             \
+            if ((D == H && E != I) || (H == F && E != G)) o[7] = H;           \
+            if (H == F) o[8] = F;                                             \
+        }                                                                     \
+                                                                              \
+        memcpy(&d0[3 * x], &o[0], 3 * sizeof(T));                             \
+        memcpy(&d1[3 * x], &o[3], 3 * sizeof(T));                             \
+        memcpy(&d2[3 * x], &o[6], 3 * sizeof(T));                             \
+    }                                                                         \
+}                                                                             \
+                                                                              \
+static void nearest2_row_c_##bits(const void *above, const void *row,         \
+                                  const void *below, void *const *dst,        \
+                                  unsigned width)                             \
+{                                                                             \
+    (void)above;                                                              \
+    (void)below;                                                              \
+    nearest_c_##bits(row, dst[0], 0, width, 2);                               \
+}                                                                             \
+                                                                              \
+static void nearest3_row_c_##bits(const void *above, const void *row,         \
+                                  const void *below, void *const *dst,        \
+                                  unsigned width)                             \
+{                                                                             \
+    (void)above;                                                              \
+    (void)below;                                                              \
+    nearest_c_##bits(row, dst[0], 0, width, 3);                               \
+}                                                                             \
+                                                                              \
+static void nearest4_row_c_##bits(const void *above, const void *row,         \
+                                  const void *below, void *const *dst,        \
+                                  unsigned width)                             \
+{                                                                             \
+    (void)above;                                                              \
+    (void)below;                                                              \
+    nearest_c_##bits(row, dst[0], 0, width, 4);                               \
+}                                                                             \
+                                                                              \
+static void scale2x_row_c_##bits(const void *above, const void *row,          \
+                                 const void *below, void *const *dst,         \
+                                 unsigned width)                              \
+{                                                                             \
+    scale2x_c_##bits(above, row, below, dst[0], dst[1], 0, width, width);     \
+}                                                                             \
+                                                                              \
+static void scale3x_row_c_##bits(const void *above, const void *row,          \
+                                 const void *below, void *const *dst,         \
+                                 unsigned width)                              \
+{                                                                             \
+    scale3x_c_##bits(above, row, below, dst[0], dst[1], dst[2],               \
+                     0, width, width);                                        \
+}
+
+SCALE_DEFINE_C(uint8_t, 8)
+SCALE_DEFINE_C(uint16_t, 16)
+SCALE_DEFINE_C(uint32_t, 32)
+
+#if SCALE_SSE2
+/**
+ * SSE2 implementation. Pixels are duplicated by interleaving a vector with
+ * itself. Scale2x selects each output pixel with comparison masks. There is
+ * no three way interleave in SSE2, so 3x filters use the C implementation.
+ */
+#define SCALE_DEFINE_SSE2(T, bits)                                            \
+static void nearest2_row_sse2_##bits(const void *above, const void *row,      \
+                                     const void *below, void *const *dst,     \
+                                     unsigned width)                          \
+{                                                                             \
+    const unsigned n = 16 / sizeof(T);                                        \
+    const T *s = row;                                                         \
+    T *d = dst[0];                                                            \
+    unsigned x;                                                               \
+                                                                              \
+    (void)above;                                                              \
+    (void)below;                                                              \
+                                                                              \
+    for (x = 0; x + n <= width; x += n) {                                     \
+        const __m128i v = _mm_loadu_si128((const __m128i *)&s[x]);            \
+                                                                              \
+        _mm_storeu_si128((__m128i *)&d[2 * x],                                \
+                         _mm_unpacklo_epi##bits(v, v));                       \
+        _mm_storeu_si128((__m128i *)&d[2 * x + n],                            \
+                         _mm_unpackhi_epi##bits(v, v));                       \
+    }                                                                         \
+                                                                              \
+    nearest_c_##bits(s, d, x, width, 2);                                      \
+}                                                                             \
+                                                                              \
+static void nearest4_row_sse2_##bits(const void *above, const void *row,      \
+                                     const void *below, void *const *dst,     \
+                                     unsigned width)                          \
+{                                                                             \
+    const unsigned n = 16 / sizeof(T);                                        \
+    const T *s = row;                                                         \
+    T *d = dst[0];                                                            \
+    unsigned x;                                                               \
+                                                                              \
+    (void)above;                                                              \
+    (void)below;                                                              \
+                                                                              \
+    for (x = 0; x + n <= width; x += n) {                                     \
+        const __m128i v = _mm_loadu_si128((const __m128i *)&s[x]);            \
+        const __m128i lo = _mm_unpacklo_epi##bits(v, v);                      \
+        const __m128i hi = _mm_unpackhi_epi##bits(v, v);                      \
+                                                                              \
+        _mm_storeu_si128((__m128i *)&d[4 * x],                                \
+                         _mm_unpacklo_epi##bits(lo, lo));                     \
+        _mm_storeu_si128((__m128i *)&d[4 * x + n],                            \
+                         _mm_unpackhi_epi##bits(lo, lo));                     \
+        _mm_storeu_si128((__m128i *)&d[4 * x + 2 * n],                        \
+                         _mm_unpacklo_epi##bits(hi, hi));                     \
+        _mm_storeu_si128((__m128i *)&d[4 * x + 3 * n],                        \
+                         _mm_unpackhi_epi##bits(hi, hi));                     \
+    }                                                                         \
+                                                                              \
+    nearest_c_##bits(s, d, x, width, 4);                                      \
+}                                                                             \
+                                                                              \
+static void scale2x_row_sse2_##bits(const void *above, const void *row,       \
+                                    const void *below, void *const *dst,      \
+                                    unsigned width)                           \
+{                                                                             \
+    const unsigned n = 16 / sizeof(T);                                        \
+    const T *b = above, *e = row, *h = below;                                 \
+    T *d0 = dst[0], *d1 = dst[1];                                             \
+    unsigned x = 0;                                                           \
+                                                                              \
+    /* The first and last pixels repeat the edge of the image. */             \
+    if (width > n + 1) {                                                      \
+        scale2x_c_##bits(b, e, h, d0, d1, 0, 1, width);                       \
+                                                                              \
+        for (x = 1; x + n < width; x += n) {                                  \
+            const __m128i B = _mm_loadu_si128((const __m128i *)&b[x]);        \
+            const __m128i H = _mm_loadu_si128((const __m128i *)&h[x]);        \
+            const __m128i E = _mm_loadu_si128((const __m128i *)&e[x]);        \
+            const __m128i D = _mm_loadu_si128((const __m128i *)&e[x - 1]);    \
+            const __m128i F = _mm_loadu_si128((const __m128i *)&e[x + 1]);    \
+            const __m128i m = _mm_andnot_si128(                               \
+                _mm_or_si128(_mm_cmpeq_epi##bits(B, H),                       \
+                             _mm_cmpeq_epi##bits(D, F)),                      \
+                _mm_cmpeq_epi##bits(E, E));                                   \
+            const __m128i m0 = _mm_and_si128(m, _mm_cmpeq_epi##bits(D, B));   \
+            const __m128i m1 = _mm_and_si128(m, _mm_cmpeq_epi##bits(B, F));   \
+            const __m128i m2 = _mm_and_si128(m, _mm_cmpeq_epi##bits(D, H));   \
+            const __m128i m3 = _mm_and_si128(m, _mm_cmpeq_epi##bits(H, F));   \
+            const __m128i e0 = _mm_or_si128(_mm_and_si128(m0, D),             \
+                                            _mm_andnot_si128(m0, E));         \
+            const __m128i e1 = _mm_or_si128(_mm_and_si128(m1, F),             \
+                                            _mm_andnot_si128(m1, E));         \
+            const __m128i e2 = _mm_or_si128(_mm_and_si128(m2, D),             \
+                                            _mm_andnot_si128(m2, E));         \
+            const __m128i e3 = _mm_or_si128(_mm_and_si128(m3, F),             \
+                                            _mm_andnot_si128(m3, E));         \
+                                                                              \
+            _mm_storeu_si128((__m128i *)&d0[2 * x],                           \
+                             _mm_unpacklo_epi##bits(e0, e1));                 \
+            _mm_storeu_si128((__m128i *)&d0[2 * x + n],                       \
+                             _mm_unpackhi_epi##bits(e0, e1));                 \
+            _mm_storeu_si128((__m128i *)&d1[2 * x],                           \
+                             _mm_unpacklo_epi##bits(e2, e3));                 \
+            _mm_storeu_si128((__m128i *)&d1[2 * x + n],                       \
+                             _mm_unpackhi_epi##bits(e2, e3));                 \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    scale2x_c_##bits(b, e, h, d0, d1, x, width, width);                       \
+}
+
+SCALE_DEFINE_SSE2(uint8_t, 8)
+SCALE_DEFINE_SSE2(uint16_t, 16)
+SCALE_DEFINE_SSE2(uint32_t, 32)
+#endif
+
+#if SCALE_NEON
+/**
+ * NEON implementation. Interleaving stores duplicate pixels for any factor,
+ * and the Scale2x and Scale3x rules select pixels with comparison masks.
+ * lanes is the number of pixels in a 128-bit vector.
+ */
+#define SCALE_DEFINE_NEON(T, bits, lanes)                                     \
+static void nearest2_row_neon_##bits(const void *above, const void *row,      \
+                                     const void *below, void *const *dst,     \
+                                     unsigned width)                          \
+{                                                                             \
+    const T *s = row;                                                         \
+    T *d = dst[0];                                                            \
+    unsigned x;                                                               \
+                                                                              \
+    (void)above;                                                              \
+    (void)below;                                                              \
+                                                                              \
+    for (x = 0; x + lanes <= width; x += lanes) {                             \
+        uint##bits##x##lanes##x2_t v;                                         \
+                                                                              \
+        v.val[0] = v.val[1] = vld1q_u##bits(&s[x]);                           \
+        vst2q_u##bits(&d[2 * x], v);                                          \
+    }                                                                         \
+                                                                              \
+    nearest_c_##bits(s, d, x, width, 2);                                      \
+}                                                                             \
+                                                                              \
+static void nearest3_row_neon_##bits(const void *above, const void *row,      \
+                                     const void *below, void *const *dst,     \
+                                     unsigned width)                          \
+{                                                                             \
+    const T *s = row;                                                         \
+    T *d = dst[0];                                                            \
+    unsigned x;                                                               \
+                                                                              \
+    (void)above;                                                              \
+    (void)below;                                                              \
+                                                                              \
+    for (x = 0; x + lanes <= width; x += lanes) {                             \
+        uint##bits##x##lanes##x3_t v;                                         \
+                                                                              \
+        v.val[0] = v.val[1] = v.val[2] = vld1q_u##bits(&s[x]);                \
+        vst3q_u##bits(&d[3 * x], v);                                          \
+    }                                                                         \
+                                                                              \
+    nearest_c_##bits(s, d, x, width, 3);                                      \
+}                                                                             \
+                                                                              \
+static void nearest4_row_neon_##bits(const void *above, const void *row,      \
+                                     const void *below, void *const *dst,     \
+                                     unsigned width)                          \
+{                                                                             \
+    const T *s = row;                                                         \
+    T *d = dst[0];                                                            \
+    unsigned x;                                                               \
+                                                                              \
+    (void)above;                                                              \
+    (void)below;                                                              \
+                                                                              \
+    for (x = 0; x + lanes <= width; x += lanes) {                             \
+        uint##bits##x##lanes##x4_t v;                                         \
+                                                                              \
+        v.val[0] = v.val[1] = v.val[2] = v.val[3] = vld1q_u##bits(&s[x]);     \
+        vst4q_u##bits(&d[4 * x], v);                                          \
+    }                                                                         \
+                                                                              \
+    nearest_c_##bits(s, d, x, width, 4);                                      \
+}                                                                             \
+                                                                              \
+static void scale2x_row_neon_##bits(const void *above, const void *row,       \
+                                    const void *below, void *const *dst,      \
+                                    unsigned width)                           \
+{                                                                             \
+    const T *b = above, *e = row, *h = below;                                 \
+    T *d0 = dst[0], *d1 = dst[1];                                             \
+    unsigned x = 0;                                                           \
+                                                                              \
+    /* The first and last pixels repeat the edge of the image. */             \
+    if (width > lanes + 1) {                                                  \
+        scale2x_c_##bits(b, e, h, d0, d1, 0, 1, width);                       \
+                                                                              \
+        for (x = 1; x + lanes < width; x += lanes) {                          \
+            const uint##bits##x##lanes##_t B = vld1q_u##bits(&b[x]);          \
+            const uint##bits##x##lanes##_t H = vld1q_u##bits(&h[x]);          \
+            const uint##bits##x##lanes##_t E = vld1q_u##bits(&e[x]);          \
+            const uint##bits##x##lanes##_t D = vld1q_u##bits(&e[x - 1]);      \
+            const uint##bits##x##lanes##_t F = vld1q_u##bits(&e[x + 1]);      \
+            const uint##bits##x##lanes##_t m = vmvnq_u##bits(                 \
+                vorrq_u##bits(vceqq_u##bits(B, H), vceqq_u##bits(D, F)));     \
+            uint##bits##x##lanes##x2_t r0, r1;                                \
+                                                                              \
+            r0.val[0] = vbslq_u##bits(                                        \
+                vandq_u##bits(m, vceqq_u##bits(D, B)), D, E);                 \
+            r0.val[1] = vbslq_u##bits(                                        \
+                vandq_u##bits(m, vceqq_u##bits(B, F)), F, E);                 \
+            r1.val[0] = vbslq_u##bits(                                        \
+                vandq_u##bits(m, vceqq_u##bits(D, H)), D, E);                 \
+            r1.val[1] = vbslq_u##bits(                                        \
+                vandq_u##bits(m, vceqq_u##bits(H, F)), F, E);                 \
+                                                                              \
+            vst2q_u##bits(&d0[2 * x], r0);                                    \
+            vst2q_u##bits(&d1[2 * x], r1);                                    \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    scale2x_c_##bits(b, e, h, d0, d1, x, width, width);                       \
+}                                                                             \
+                                                                              \
+static void scale3x_row_neon_##bits(const void *above, const void *row,       \
+                                    const void *below, void *const *dst,      \
+                                    unsigned width)                           \
+{                                                                             \
+    const T *b = above, *e = row, *h = below;                                 \
+    T *d0 = dst[0], *d1 = dst[1], *d2 = dst[2];                               \
+    unsigned x = 0;                                                           \
+                                                                              \
+    /* The first and last pixels repeat the edge of the image. */             \
+    if (width > lanes + 1) {                                                  \
+        scale3x_c_##bits(b, e, h, d0, d1, d2, 0, 1, width);                   \
+                                                                              \
+        for (x = 1; x + lanes < width; x += lanes) {                          \
+            const uint##bits##x##lanes##_t A = vld1q_u##bits(&b[x - 1]);      \
+            const uint##bits##x##lanes##_t B = vld1q_u##bits(&b[x]);          \
+            const uint##bits##x##lanes##_t C = vld1q_u##bits(&b[x + 1]);      \
+            const uint##bits##x##lanes##_t D = vld1q_u##bits(&e[x - 1]);      \
+            const uint##bits##x##lanes##_t E = vld1q_u##bits(&e[x]);          \
+            const uint##bits##x##lanes##_t F = vld1q_u##bits(&e[x + 1]);      \
+            const uint##bits##x##lanes##_t G = vld1q_u##bits(&h[x - 1]);      \
+            const uint##bits##x##lanes##_t H = vld1q_u##bits(&h[x]);          \
+            const uint##bits##x##lanes##_t I = vld1q_u##bits(&h[x + 1]);      \
+            const uint##bits##x##lanes##_t m = vmvnq_u##bits(                 \
+                vorrq_u##bits(vceqq_u##bits(B, H), vceqq_u##bits(D, F)));     \
+            const uint##bits##x##lanes##_t db =                               \
+                vandq_u##bits(m, vceqq_u##bits(D, B));                        \
+            const uint##bits##x##lanes##_t bf =                               \
+                vandq_u##bits(m, vceqq_u##bits(B, F));                        \
+            const uint##bits##x##lanes##_t dh =                               \
+                vandq_u##bits(m, vceqq_u##bits(D, H));                        \
+            const uint##bits##x##lanes##_t hf =                               \
+                vandq_u##bits(m, vceqq_u##bits(H, F));                        \
+            const uint##bits##x##lanes##_t ea = vceqq_u##bits(E, A);          \
+            const uint##bits##x##lanes##_t ec = vceqq_u##bits(E, C);          \
+            const uint##bits##x##lanes##_t eg = vceqq_u##bits(E, G);          \
+            const uint##bits##x##lanes##_t ei = vceqq_u##bits(E, I);          \
+            uint##bits##x##lanes##x3_t r0, r1, r2;                            \
+                                                                              \
+            r0.val[0] = vbslq_u##bits(db, D, E);                              \
+            r0.val[1] = vbslq_u##bits(                                        \
+                vorrq_u##bits(vbicq_u##bits(db, ec),                          \
+                              vbicq_u##bits(bf, ea)), B, E);                  \
+            r0.val[2] = vbslq_u##bits(bf, F, E);                              \
+            r1.val[0] = vbslq_u##bits(                                        \
+                vorrq_u##bits(vbicq_u##bits(db, eg),                          \
+                              vbicq_u##bits(dh, ea)), D, E);                  \
+            r1.val[1] = E;                                                    \
+            r1.val[2] = vbslq_u##bits(                                        \
+                vorrq_u##bits(vbicq_u##bits(bf, ei),                          \
+                              vbicq_u##bits(hf, ec)), F, E);                  \
+            r2.val[0] = vbslq_u##bits(dh, D, E);                              \
+            r2.val[1] = vbslq_u##bits(                                        \
+                vorrq_u##bits(vbicq_u##bits(dh, ei),                          \
+                              vbicq_u##bits(hf, eg)), H, E);                  \
+            r2.val[2] = vbslq_u##bits(hf, F, E);                              \
+                                                                              \
+            vst3q_u##bits(&d0[3 * x], r0);                                    \
+            vst3q_u##bits(&d1[3 * x], r1);                                    \
+            vst3q_u##bits(&d2[3 * x], r2);                                    \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    scale3x_c_##bits(b, e, h, d0, d1, d2, x, width, width);                   \
+}
+
+SCALE_DEFINE_NEON(uint8_t, 8, 16)
+SCALE_DEFINE_NEON(uint16_t, 16, 8)
+SCALE_DEFINE_NEON(uint32_t, 32, 4)
+#endif
+
+/* Row functions for each filter, for pixels of 1, 2 and 4 bytes. */
+static const scale_row_t scale_rows_c[SCALE_FILTER_MAX][3] = {
+    { nearest2_row_c_8, nearest2_row_c_16, nearest2_row_c_32 },
+    { nearest3_row_c_8, nearest3_row_c_16, nearest3_row_c_32 },
+    { nearest4_row_c_8, nearest4_row_c_16, nearest4_row_c_32 },
+    { scale2x_row_c_8, scale2x_row_c_16, scale2x_row_c_32 },
+    { scale3x_row_c_8, scale3x_row_c_16, scale3x_row_c_32 }
+};
+
+#if SCALE_SSE2
+static const scale_row_t scale_rows_simd[SCALE_FILTER_MAX][3] = {
+    { nearest2_row_sse2_8, nearest2_row_sse2_16, nearest2_row_sse2_32 },
+    { nearest3_row_c_8, nearest3_row_c_16, nearest3_row_c_32 },
+    { nearest4_row_sse2_8, nearest4_row_sse2_16, nearest4_row_sse2_32 },
+    { scale2x_row_sse2_8, scale2x_row_sse2_16, scale2x_row_sse2_32 },
+    { scale3x_row_c_8, scale3x_row_c_16, scale3x_row_c_32 }
+};
+#elif SCALE_NEON
+static const scale_row_t scale_rows_simd[SCALE_FILTER_MAX][3] = {
+    { nearest2_row_neon_8, nearest2_row_neon_16, nearest2_row_neon_32 },
+    { nearest3_row_neon_8, nearest3_row_neon_16, nearest3_row_neon_32 },
+    { nearest4_row_neon_8, nearest4_row_neon_16, nearest4_row_neon_32 },
+    { scale2x_row_neon_8, scale2x_row_neon_16, scale2x_row_neon_32 },
+    { scale3x_row_neon_8, scale3x_row_neon_16, scale3x_row_neon_32 }
+};
+#else
+# define scale_rows_simd scale_rows_c
+#endif
+
+unsigned scale_factor(scale_filter_t filter)
+{
+    switch (filter) {
+    case SCALE_NEAREST_2X:
+    case SCALE_SCALE2X:
+        return 2;
+    case SCALE_NEAREST_3X:
+    case SCALE_SCALE3X:
+        return 3;
+    case SCALE_NEAREST_4X:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Scales each row of the image with the given row function.
+ */
+static int scale_with(const scale_row_t rows[SCALE_FILTER_MAX][3],
+                      scale_filter_t filter, size_t bytes_per_pixel,
+                      const void *src, size_t src_pitch,
+                      void *dst, size_t dst_pitch,
+                      unsigned width, unsigned height)
+{
+    const uint8_t *s = src;
+    uint8_t *d = dst;
+    const unsigned n = scale_factor(filter);
+    /* Nearest neighbour filters only draw the first output row. */
+    const int copy_rows = filter < SCALE_SCALE2X;
+    scale_row_t row;
+    unsigned y, k;
+
+    if (n == 0)
+        return -1;
+
+    switch (bytes_per_pixel) {
+    case 1:
+        row = rows[filter][0];
+        break;
+    case 2:
+        row = rows[filter][1];
+        break;
+    case 4:
+        row = rows[filter][2];
+        break;
+    default:
+        return -1;
+    }
+
+    for (y = 0; y < height; y++) {
+        const uint8_t *above = y > 0 ? s - src_pitch : s;
+        const uint8_t *below = y + 1 < height ? s + src_pitch : s;
+        void *out[4];
+
+        for (k = 0; k < n; k++)
+            out[k] = d + dst_pitch * k;
+
+        row(above, s, below, out, width);
+
+        if (copy_rows) {
+            for (k = 1; k < n; k++)
+                memcpy(out[k], out[0], width * n * bytes_per_pixel);
+        }
+
+        s += src_pitch;
+        d += dst_pitch * n;
+    }
+
+    return 0;
+}
+
+int scale_image(scale_filter_t filter, size_t bytes_per_pixel,
+                const void *src, size_t src_pitch,
+                void *dst, size_t dst_pitch,
+                unsigned width, unsigned height)
+{
+    return scale_with(scale_rows_simd, filter, bytes_per_pixel,
+                      src, src_pitch, dst, dst_pitch, width, height);
+}
+
+int scale_image_c(scale_filter_t filter, size_t bytes_per_pixel,
+                  const void *src, size_t src_pitch,
+                  void *dst, size_t dst_pitch,
+                  unsigned width, unsigned height)
+{
+    return scale_with(scale_rows_c, filter, bytes_per_pixel,
+                      src, src_pitch, dst, dst_pitch, width, height);
+}
@@ -0,0 +1,47 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <stddef.h>
+
+/* Filters that may be used to enlarge the emulator output. */
+typedef enum
+{
+    SCALE_NEAREST_2X,
+    SCALE_NEAREST_3X,
+    SCALE_NEAREST_4X,
+    SCALE_SCALE2X,
+    SCALE_SCALE3X,
+    SCALE_FILTER_MAX
+} scale_filter_t;
+
+/**
+ * Returns how many times larger the output of the given filter is in each
+ * direction, or 0 if the filter is unknown.
+ */
+unsigned scale_factor(scale_filter_t filter);
+
+/**
+ * Enlarges an image of width x height pixels at src into dst, which must hold
+ * at least (width x height) multiplied by scale_factor(filter) squared pixels.
+ * Pixels are bytes_per_pixel bytes each, which may be 1, 2 or 4, such as
+ * sizeof(gb_pixel_t) for the emulator output. Pitches are in bytes, and must be
+ * multiples of bytes_per_pixel. The source and destination must not overlap.
+ * Uses SSE2 or NEON where available.
+ *
+ * Returns 0 on success, or -1 if the filter or pixel size is not supported.
+ */
+int scale_image(scale_filter_t filter, size_t bytes_per_pixel,
+                const void *src, size_t src_pitch,
+                void *dst, size_t dst_pitch,
+                unsigned width, unsigned height);
+
+/**
+ * As scale_image(), but always uses the portable C implementation. The output
+ * is identical.
+ */
+int scale_image_c(scale_filter_t filter, size_t bytes_per_pixel,
+                  const void *src, size_t src_pitch,
+                  void *dst, size_t dst_pitch,
+                  unsigned width, unsigned height);
+
+#endif
@@ -0,0 +1,675 @@
+/**
+ * MIT License
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Tests that batch.c runs each lane the same as gb_run_until() runs a context
+ * of its own. Random MBC1 ROMs are assembled in memory, and every frame each
+ * lane is compared with its reference context by its saved state, its frame
+ * and whether it has crashed. The input of the lanes splits them into more
+ * groups as the test goes on. Prints each failure, and exits with
+ * EXIT_FAILURE if any fail.
+ */
+#define ENABLE_LCD 1
+#define ENABLE_SOUND 0
+
+#include "peanut_gb.h"
+#include "batch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Cycles in each frame. */
+#define FRAME_CYCLES 70224
+
+#define LANES 8
+#define FRAMES 120
+/* Frames before the input of the lanes splits them further. */
+#define PHASE_FRAMES 10
+
+/* Four banks of MBC1 ROM. */
+static uint8_t rom[0x10000];
+static uint32_t rng = 1;
+
+/* Reference context of a lane. */
+struct ref_s
+{
+	struct gb_s gb;
+	bool crashed;
+	gb_pixel_t fb[LCD_HEIGHT][LCD_LINE_SIZE];
+};
+
+/* Assembles code at pc, which is in bank when it is 0x4000 or above. */
+struct asm_s
+{
+	unsigned bank;
+	uint16_t pc;
+};
+
+/* Entry points of the subroutines. */
+static uint16_t subs[6];
+static unsigned sub_count;
+
+static unsigned rnd(unsigned n)
+{
+	/* xorshift32 */
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng % n;
+}
+
+static uint8_t *rom_at(const struct asm_s *a, uint16_t pc)
+{
+	return &rom[pc < 0x4000 ? pc : a->bank * 0x4000 + pc - 0x4000];
+}
+
+static void emit(struct asm_s *a, uint8_t b)
+{
+	*rom_at(a, a->pc++) = b;
+}
+
+static void emit16(struct asm_s *a, uint16_t w)
+{
+	emit(a, (uint8_t)w);
+	emit(a, (uint8_t)(w >> 8));
+}
+
+/* Register from an opcode, other than (HL). */
+static uint8_t reg(void)
+{
+	static const uint8_t regs[] = { 0, 1, 2, 3, 4, 5, 7 };
+	return regs[rnd(sizeof(regs))];
+}
+
+static uint16_t wram(void)
+{
+	return (uint16_t)(0xC000 + rnd(0x1E00));
+}
+
+static uint8_t hram(void)
+{
+	return (uint8_t)(0x82 + rnd(0x7D));
+}
+
+static void ld_hl(struct asm_s *a, uint16_t val)
+{
+	emit(a, 0x21);
+	emit16(a, val);
+}
+
+/**
+ * Assembles an instruction, or a short run of them, that leaves SP as it
+ * was. Blocks are only nested to a depth of 2.
+ */
+static void simple(struct asm_s *a, unsigned depth)
+{
+	static const uint8_t hl_ops[] = {
+		0x46, 0x4E, 0x56, 0x5E, 0x66, 0x6E, 0x7E, 0x70, 0x71, 0x72,
+		0x73, 0x74, 0x75, 0x77, 0x34, 0x35, 0x22, 0x32, 0x2A, 0x3A
+	};
+	static const uint8_t wide_ops[] = {
+		0x03, 0x13, 0x23, 0x0B, 0x1B, 0x2B, 0x09, 0x19, 0x29, 0x39
+	};
+	static const uint8_t misc_ops[] = {
+		0x07, 0x0F, 0x17, 0x1F, 0x27, 0x2F, 0x37, 0x3F, 0x00
+	};
+	const unsigned k = rnd(40);
+
+	if(k < 6)
+		emit(a, (uint8_t)(0x80 | rnd(8) << 3 | reg()));	/* ALU r */
+	else if(k < 8)
+	{
+		ld_hl(a, wram());
+		emit(a, (uint8_t)(0x86 | rnd(8) << 3));		/* ALU (HL) */
+	}
+	else if(k < 10)
+	{
+		emit(a, (uint8_t)(0xC6 | rnd(8) << 3));		/* ALU imm */
+		emit(a, (uint8_t)rnd(256));
+	}
+	else if(k < 12)
+		emit(a, (uint8_t)(0x40 | reg() << 3 | reg()));	/* LD r, r */
+	else if(k < 14)
+	{
+		emit(a, (uint8_t)(0x06 | reg() << 3));		/* LD r, imm */
+		emit(a, (uint8_t)rnd(256));
+	}
+	else if(k < 16)
+	{
+		ld_hl(a, wram());
+		emit(a, hl_ops[rnd(sizeof(hl_ops))]);
+	}
+	else if(k < 17)
+	{
+		ld_hl(a, wram());
+		emit(a, 0x36);					/* LD (HL), imm */
+		emit(a, (uint8_t)rnd(256));
+	}
+	else if(k < 18)
+	{
+		const uint8_t rr = rnd(2) ? 0x10 : 0x00;
+
+		emit(a, 0x01 | rr);				/* LD BC/DE, imm */
+		emit16(a, wram());
+		emit(a, (rnd(2) ? 0x02 : 0x0A) | rr);		/* LD (rr), A */
+	}
+	else if(k < 20)
+		emit(a, wide_ops[rnd(sizeof(wide_ops))]);
+	else if(k < 22)
+		emit(a, (uint8_t)(0x04 | reg() << 3 | rnd(2)));	/* INC/DEC r */
+	else if(k < 24)
+		emit(a, misc_ops[rnd(sizeof(misc_ops))]);
+	else if(k < 27)
+	{
+		const uint8_t cb = (uint8_t)rnd(256);
+
+		if((cb & 7) == 6)
+			ld_hl(a, wram());
+
+		emit(a, 0xCB);
+		emit(a, cb);
+	}
+	else if(k < 28)
+	{
+		emit(a, (uint8_t)(0xC5 | rnd(4) << 4));		/* PUSH */
+		emit(a, (uint8_t)(0x80 | rnd(8) << 3 | reg()));
+		emit(a, (uint8_t)(0xC1 | rnd(4) << 4));		/* POP */
+	}
+	else if(k < 29 && sub_count > 0 && depth < 2)
+	{
+		emit(a, 0xCD);					/* CALL */
+		emit16(a, subs[rnd(sub_count)]);
+	}
+	else if(k < 30 && sub_count > 0 && depth < 2)
+	{
+		emit(a, (uint8_t)(0xC4 | rnd(4) << 3));		/* CALL cc */
+		emit16(a, subs[rnd(sub_count)]);
+	}
+	else if(k < 31 && depth < 2)
+		emit(a, rnd(2) ? 0xEF : 0xF7);			/* RST 28/30 */
+	else if(k < 32)
+	{
+		emit(a, rnd(2) ? 0xE0 : 0xF0);			/* LDH */
+		emit(a, hram());
+	}
+	else if(k < 33)
+	{
+		emit(a, 0x0E);					/* LD C, imm */
+		emit(a, hram());
+		emit(a, rnd(2) ? 0xE2 : 0xF2);			/* LD (C), A */
+	}
+	else if(k < 34)
+	{
+		emit(a, rnd(2) ? 0xEA : 0xFA);			/* LD (imm), A */
+		emit16(a, rnd(2) ? wram() : 0xFF00 | hram());
+	}
+	else if(k < 35)
+	{
+		const uint8_t e = (uint8_t)(2 + 2 * rnd(7));
+
+		emit(a, 0xE8);					/* ADD SP, e */
+		emit(a, e);
+		emit(a, 0xE8);
+		emit(a, (uint8_t)-e);
+	}
+	else if(k < 36)
+	{
+		emit(a, 0xF8);					/* LD HL, SP+e */
+		emit(a, (uint8_t)rnd(256));
+	}
+	else if(k < 37)
+	{
+		emit(a, 0xF8);
+		emit(a, 0x00);
+		emit(a, 0xF9);					/* LD SP, HL */
+	}
+	else if(k < 38 && depth < 2)
+	{
+		static const uint8_t jr[] = { 0x18, 0x20, 0x28, 0x30, 0x38 };
+		unsigned n = 1 + rnd(3);
+		uint16_t at;
+
+		/* JR over a block. */
+		emit(a, jr[rnd(sizeof(jr))]);
+		emit(a, 0);
+		at = a->pc;
+		while(n--)
+			simple(a, depth + 1);
+
+		*rom_at(a, at - 1) = (uint8_t)(a->pc - at);
+	}
+	else if(k < 39 && depth < 2)
+	{
+		static const uint8_t jp[] = { 0xC2, 0xCA, 0xD2, 0xDA, 0xC3 };
+		unsigned n = 1 + rnd(3);
+		uint16_t at;
+
+		/* JP over a block. */
+		emit(a, jp[rnd(sizeof(jp))]);
+		emit16(a, 0);
+		at = a->pc;
+		while(n--)
+			simple(a, depth + 1);
+
+		*rom_at(a, at - 2) = (uint8_t)a->pc;
+		*rom_at(a, at - 1) = (uint8_t)(a->pc >> 8);
+	}
+	else
+	{
+		ld_hl(a, a->pc + 4);
+		emit(a, 0xE9);					/* JP (HL) */
+	}
+}
+
+static void block(struct asm_s *a, unsigned n)
+{
+	while(n--)
+		simple(a, 0);
+}
+
+/* Selects a row of the joypad and reads it into A. */
+static void read_joypad(struct asm_s *a, uint8_t row)
+{
+	emit(a, 0x3E);
+	emit(a, row);
+	emit(a, 0xE0);
+	emit(a, 0x00);
+	emit(a, 0xF0);
+	emit(a, 0x00);
+	emit(a, 0xE6);
+	emit(a, 0x0F);
+}
+
+/**
+ * Assembles a random ROM from seed, which runs blocks of random instructions
+ * in a loop with the timer, STAT and VBlank interrupts enabled. Some of the
+ * blocks branch on the joypad, call code in the ROM bank it selects, halt,
+ * or write VRAM, and the lanes with one joypad state crash. Returns non-zero
+ * if the code did not fit.
+ */
+static int make_rom(uint32_t seed)
+{
+	static const uint8_t init[] = {
+		0xF3,				/* DI */
+		0x31, 0xF0, 0xDF,		/* LD SP, 0xDFF0 */
+		0x3E, 0x05, 0xE0, 0x07,		/* Timer at 262144 Hz */
+		0x3E, 0x08, 0xE0, 0x41,		/* STAT on HBlank */
+		0x3E, 0x07, 0xE0, 0xFF,		/* IE */
+		0xAF, 0xE0, 0x0F,		/* Clear IF */
+		0xFB				/* EI */
+	};
+	struct asm_s a = { 0, 0 };
+	uint8_t checksum = 0;
+	uint16_t main_loop;
+	unsigned bank;
+	unsigned chunk;
+	unsigned i;
+
+	memset(rom, 0, sizeof(rom));
+	rng = seed;
+	sub_count = 0;
+
+	/* RST 28 and RST 30. */
+	a.pc = 0x28;
+	emit(&a, 0x04);					/* INC B */
+	emit(&a, 0xC9);
+	a.pc = 0x30;
+	emit(&a, 0xA9);					/* XOR C */
+	emit(&a, 0xC9);
+
+	/* Each interrupt counts itself in HRAM. */
+	for(i = 0; i < 3; i++)
+	{
+		a.pc = (uint16_t)(0x40 + 8 * i);
+		emit(&a, 0xF5);				/* PUSH AF */
+		emit(&a, 0xF0);				/* LDH A, (count) */
+		emit(&a, (uint8_t)(0x80 + i));
+		emit(&a, 0x3C);				/* INC A */
+		emit(&a, 0xE0);				/* LDH (count), A */
+		emit(&a, (uint8_t)(0x80 + i));
+		emit(&a, 0xF1);				/* POP AF */
+		emit(&a, 0xD9);				/* RETI */
+	}
+
+	/* Entry point: JP 0x0150 */
+	rom[0x100] = 0x00;
+	rom[0x101] = 0xC3;
+	rom[0x102] = 0x50;
+	rom[0x103] = 0x01;
+	rom[0x147] = 0x01;				/* MBC1 */
+	rom[0x148] = 0x01;				/* 64 KiB */
+
+	a.pc = 0x1000;
+	for(i = 0; i < sizeof(subs) / sizeof(subs[0]); i++)
+	{
+		subs[sub_count++] = a.pc;
+		block(&a, 2 + rnd(4));
+		if(rnd(2))
+			emit(&a, (uint8_t)(0xC0 | rnd(4) << 3));	/* RET cc */
+
+		emit(&a, (uint8_t)(0x80 | rnd(8) << 3 | reg()));
+		emit(&a, 0xC9);					/* RET */
+	}
+
+	/* Each bank at 0x4000 has a block of its own. */
+	for(bank = 1; bank < 4; bank++)
+	{
+		struct asm_s b = { bank, 0x4000 };
+
+		block(&b, 5 + rnd(25));
+		emit(&b, 0xC9);
+	}
+
+	a.pc = 0x150;
+	for(i = 0; i < sizeof(init); i++)
+		emit(&a, init[i]);
+
+	main_loop = a.pc;
+	for(chunk = 0; chunk < 40; chunk++)
+	{
+		const unsigned t = rnd(10);
+
+		block(&a, 3 + rnd(12));
+
+		if(chunk == 20)
+		{
+			uint16_t wait;
+
+			/* Turn the LCD off, wait, and turn it back on. */
+			emit(&a, 0x3E);
+			emit(&a, 0x11);
+			emit(&a, 0xE0);
+			emit(&a, 0x40);
+			emit(&a, 0x01);				/* LD BC, 0x0100 */
+			emit16(&a, 0x0100);
+			wait = a.pc;
+			emit(&a, 0x0B);				/* DEC BC */
+			emit(&a, 0x78);				/* LD A, B */
+			emit(&a, 0xB1);				/* OR C */
+			emit(&a, 0x20);				/* JR NZ, wait */
+			emit(&a, (uint8_t)(wait - (a.pc + 1)));
+			emit(&a, 0x3E);
+			emit(&a, 0x91);
+			emit(&a, 0xE0);
+			emit(&a, 0x40);
+		}
+		else if(chunk == 30)
+		{
+			/* Crash if both rows of the joypad read 0x5. */
+			read_joypad(&a, 0x10);
+			emit(&a, 0xFE);				/* CP 0x05 */
+			emit(&a, 0x05);
+			emit(&a, 0x20);				/* JR NZ, over */
+			emit(&a, 0x09);
+			read_joypad(&a, 0x20);
+			emit(&a, 0xFE);				/* CP 0x05 */
+			emit(&a, 0x05);
+			emit(&a, 0x20);				/* JR NZ, over */
+			emit(&a, 0x01);
+			emit(&a, 0xD3);				/* Invalid */
+		}
+		else if(t < 4)
+		{
+			static const uint8_t use[] = { 0x47, 0x4F, 0xA8, 0x80 };
+			uint16_t at;
+
+			/* Branch on the joypad. */
+			read_joypad(&a, rnd(2) ? 0x10 : 0x20);
+			emit(&a, use[rnd(sizeof(use))]);
+			emit(&a, 0xFE);				/* CP imm */
+			emit(&a, (uint8_t)rnd(16));
+			emit(&a, rnd(2) ? 0x20 : 0x28);		/* JR NZ/Z */
+			emit(&a, 0);
+			at = a.pc;
+			block(&a, 1 + rnd(5));
+			*rom_at(&a, at - 1) = (uint8_t)(a.pc - at);
+		}
+		else if(t < 5)
+		{
+			/* Call the ROM bank that the joypad selects. */
+			read_joypad(&a, 0x20);
+			emit(&a, 0xE6);				/* AND 0x03 */
+			emit(&a, 0x03);
+			emit(&a, 0xEA);				/* LD (0x2000), A */
+			emit16(&a, 0x2000);
+			emit(&a, 0xCD);				/* CALL 0x4000 */
+			emit16(&a, 0x4000);
+		}
+		else if(t < 6)
+			emit(&a, 0x76);				/* HALT */
+		else if(t < 7)
+		{
+			emit(&a, 0xF3);				/* DI */
+			block(&a, 3);
+			emit(&a, 0xFB);				/* EI */
+		}
+		else if(t < 8)
+		{
+			ld_hl(&a, (uint16_t)(0x8000 + rnd(0x1800)));
+			emit(&a, 0x77);				/* LD (HL), A */
+		}
+	}
+
+	emit(&a, 0xC3);
+	emit16(&a, main_loop);
+	if(a.pc > 0x1000)
+	{
+		printf("Seed %u: code does not fit\n", (unsigned)seed);
+		return 1;
+	}
+
+	for(i = 0x134; i <= 0x14C; i++)
+		checksum = checksum - rom[i] - 1;
+
+	rom[0x14D] = checksum;
+	return 0;
+}
+
+static uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	(void)gb;
+	return rom[addr];
+}
+
+/* The ROMs have no cartridge RAM. */
+static uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	(void)gb;
+	(void)addr;
+	return 0xFF;
+}
+
+static void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+			      const uint8_t val)
+{
+	(void)gb;
+	(void)addr;
+	(void)val;
+}
+
+static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err,
+		     const uint16_t addr)
+{
+	(void)gb;
+	fprintf(stderr, "Error %d at 0x%04X\n", gb_err, addr);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Returns the joypad state of the lane in the frame. All lanes start with the
+ * same input, then it differs by lane % 2, by lane % 4 and then by lane.
+ */
+static uint8_t lane_joypad(const uint8_t *frame_joypad, unsigned frame,
+			   unsigned lane)
+{
+	static const unsigned keys[] = { 1, 2, 4, LANES };
+	const unsigned phase = frame / PHASE_FRAMES;
+
+	return frame_joypad[lane % keys[phase < 3 ? phase : 3]];
+}
+
+/**
+ * Checks that the lane matches its reference context after the frame.
+ */
+static int check_lane(const batch_t *batch, struct ref_s *ref, unsigned frame,
+		      unsigned lane)
+{
+	static uint8_t ref_state[1 << 16];
+	static uint8_t lane_state[1 << 16];
+	static struct gb_s gb;
+	size_t size;
+
+	/* The context of the lane is copied to save it, as that reads the
+	 * cartridge RAM through the core that batch.c was built with. */
+	memcpy(&gb, batch_lane_gb(batch, lane), sizeof(gb));
+	size = gb.core->state_size(&gb);
+
+	if(size != gb_state_size(&ref->gb) || size > sizeof(ref_state) ||
+			gb.core->state_save(&gb, lane_state, size) != 0 ||
+			gb_state_save(&ref->gb, ref_state, size) != 0)
+	{
+		printf("Frame %u lane %u: could not save the state\n",
+				frame, lane);
+		return 1;
+	}
+
+	if(memcmp(lane_state, ref_state, size) != 0)
+	{
+		size_t i = 0;
+
+		while(lane_state[i] == ref_state[i])
+			i++;
+
+		printf("Frame %u lane %u: state differs at byte %lu\n",
+				frame, lane, (unsigned long)i);
+		return 1;
+	}
+
+	if(memcmp(batch_lane_fb(batch, lane), ref->fb, sizeof(ref->fb)) != 0)
+	{
+		printf("Frame %u lane %u: frame differs\n", frame, lane);
+		return 1;
+	}
+
+	if(batch_lane_crashed(batch, lane) != ref->crashed)
+	{
+		printf("Frame %u lane %u: crashed %d, but %d in the core\n",
+				frame, lane, batch_lane_crashed(batch, lane),
+				ref->crashed);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Runs LANES lanes of the ROM from seed in a batch and in reference contexts,
+ * comparing them after every frame.
+ */
+static int test_seed(uint32_t seed)
+{
+	static struct ref_s ref[LANES];
+	batch_t *batch;
+	uint64_t frame_end;
+	unsigned frame;
+	unsigned lane;
+	int failed = 0;
+
+	if(make_rom(seed))
+		return 1;
+
+	batch = batch_create(rom, LANES);
+	if(batch == NULL)
+	{
+		printf("Seed %u: could not create the batch\n",
+				(unsigned)seed);
+		return 1;
+	}
+
+	for(lane = 0; lane < LANES; lane++)
+	{
+		/* gb_init() leaves RAM as it was, and the batch starts with
+		 * it cleared. */
+		memset(&ref[lane], 0, sizeof(ref[lane]));
+		if(gb_init(&ref[lane].gb, gb_rom_read, gb_cart_ram_read,
+				gb_cart_ram_write, gb_error, &ref[lane]) !=
+				GB_INIT_NO_ERROR)
+		{
+			printf("Seed %u: could not initialise\n",
+					(unsigned)seed);
+			batch_destroy(batch);
+			return 1;
+		}
+
+		gb_init_lcd_fb(&ref[lane].gb, ref[lane].fb,
+				sizeof(ref[lane].fb[0]), NULL);
+	}
+
+	/* Every frame ends at the same cycle, as it does in the batch. */
+	frame_end = gb_get_cycles(&ref[0].gb);
+	for(frame = 0; frame < FRAMES && !failed; frame++)
+	{
+		uint8_t frame_joypad[LANES];
+
+		frame_end += FRAME_CYCLES;
+		for(lane = 0; lane < LANES; lane++)
+			frame_joypad[lane] = (uint8_t)rnd(256);
+
+		for(lane = 0; lane < LANES; lane++)
+		{
+			struct ref_s *const r = &ref[lane];
+			const uint8_t joypad =
+				lane_joypad(frame_joypad, frame, lane);
+
+			batch_set_joypad(batch, lane, joypad);
+			if(r->crashed)
+				continue;
+
+			r->gb.direct.joypad = joypad;
+			if(gb_run_until(&r->gb, GB_STOP_ON_INVALID_OPCODE,
+					(uint_fast32_t)(frame_end -
+						gb_get_cycles(&r->gb))) ==
+					GB_STOP_INVALID_OPCODE)
+				r->crashed = true;
+		}
+
+		if(batch_run_frame(batch) == (size_t)-1)
+		{
+			printf("Seed %u: out of memory\n", (unsigned)seed);
+			failed = 1;
+			break;
+		}
+
+		for(lane = 0; lane < LANES && !failed; lane++)
+		{
+			if(check_lane(batch, &ref[lane], frame, lane))
+			{
+				printf("Seed %u failed\n", (unsigned)seed);
+				failed = 1;
+			}
+		}
+	}
+
+	batch_destroy(batch);
+	return failed;
+}
+
+int main(void)
+{
+	static const uint32_t seeds[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	int failed = 0;
+	unsigned i;
+
+	for(i = 0; i < sizeof(seeds) / sizeof(seeds[0]); i++)
+		failed += test_seed(seeds[i]);
+
+	if(failed)
+	{
+		printf("%d tests failed\n", failed);
+		return EXIT_FAILURE;
+	}
+
+	printf("All tests passed\n");
+	return EXIT_SUCCESS;
+}
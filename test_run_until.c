@@ -0,0 +1,395 @@
+/**
+ * MIT License
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Tests that gb_run_until() stops on each event, and at breakpoints on
+ * interrupt vectors. Each test runs a small ROM that is assembled in memory,
+ * so no ROM file is needed. Prints each failure, and exits with EXIT_FAILURE
+ * if any fail.
+ */
+#define ENABLE_LCD 0
+#define ENABLE_SOUND 0
+
+#include "peanut_gb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Cycles in each frame. */
+#define FRAME_CYCLES 70224
+
+static uint8_t rom[0x8000];
+
+static uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	(void)gb;
+	return rom[addr];
+}
+
+static uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	(void)gb;
+	(void)addr;
+	return 0xFF;
+}
+
+static void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+			      const uint8_t val)
+{
+	(void)gb;
+	(void)addr;
+	(void)val;
+}
+
+static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err,
+		     const uint16_t addr)
+{
+	(void)gb;
+	fprintf(stderr, "Error %d at 0x%04X\n", gb_err, addr);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Assembles a ROM that runs code from 0x0150. Each interrupt handler only
+ * returns.
+ */
+static void make_code(const uint8_t *code, size_t code_size)
+{
+	static const uint8_t vectors[] = { 0x40, 0x48, 0x50, 0x58, 0x60 };
+	uint8_t checksum = 0;
+	unsigned i;
+
+	memset(rom, 0, sizeof(rom));
+
+	for(i = 0; i < sizeof(vectors); i++)
+		rom[vectors[i]] = 0xD9;		/* RETI */
+
+	/* Entry point: JP 0x0150 */
+	rom[0x100] = 0x00;
+	rom[0x101] = 0xC3;
+	rom[0x102] = 0x50;
+	rom[0x103] = 0x01;
+
+	memcpy(&rom[0x150], code, code_size);
+
+	for(i = 0x134; i <= 0x14C; i++)
+		checksum = checksum - rom[i] - 1;
+
+	rom[0x14D] = checksum;
+}
+
+/**
+ * Assembles a ROM that enables the interrupts in ie, then runs wait in a
+ * loop.
+ */
+static void make_rom(uint8_t ie, uint8_t tac, const uint8_t *wait,
+		     size_t wait_size)
+{
+	uint8_t code[64];
+	uint8_t *p = code;
+
+	*p++ = 0xF3;				/* DI */
+	*p++ = 0x3E; *p++ = tac;		/* LD A, tac */
+	*p++ = 0xE0; *p++ = 0x07;		/* LDH (TAC), A */
+	*p++ = 0x3E; *p++ = ie;			/* LD A, ie */
+	*p++ = 0xE0; *p++ = 0xFF;		/* LDH (IE), A */
+	*p++ = 0xAF;				/* XOR A */
+	*p++ = 0xE0; *p++ = 0x0F;		/* LDH (IF), A */
+	*p++ = 0xFB;				/* EI */
+	memcpy(p, wait, wait_size);
+	p += wait_size;
+	*p++ = 0x18;				/* JR to wait */
+	*p = (uint8_t)-(int)(wait_size + 2);
+	p++;
+
+	make_code(code, (size_t)(p - code));
+}
+
+/**
+ * Initialises gb with the ROM. Returns non-zero on failure.
+ */
+static int start(const char *name, struct gb_s *gb)
+{
+	if(gb_init(gb, gb_rom_read, gb_cart_ram_read, gb_cart_ram_write,
+			gb_error, NULL) == GB_INIT_NO_ERROR)
+		return 0;
+
+	printf("%s: could not initialise\n", name);
+	return 1;
+}
+
+/**
+ * Runs the ROM with a breakpoint on the vector, and checks that every
+ * interrupt stops there before the handler is run.
+ */
+static int test_vector(const char *name, uint8_t ie, uint8_t tac,
+		       uint16_t vector, const uint8_t *wait, size_t wait_size)
+{
+	static struct gb_s gb;
+	unsigned hits;
+
+	make_rom(ie, tac, wait, wait_size);
+	if(start(name, &gb))
+		return 1;
+
+	gb_set_breakpoint(&gb, vector);
+
+	for(hits = 0; hits < 3; hits++)
+	{
+		enum gb_stop_reason_e reason;
+
+		reason = gb_run_until(&gb, GB_STOP_ON_BREAKPOINT,
+				2 * FRAME_CYCLES);
+
+		if(reason != GB_STOP_BREAKPOINT ||
+				gb.cpu_reg.pc.reg != vector)
+		{
+			printf("%s: hit %u stopped with reason %d at 0x%04X\n",
+					name, hits, reason, gb.cpu_reg.pc.reg);
+			return 1;
+		}
+
+		/* The interrupt has been taken, but not the handler. */
+		if(gb.gb_ime || (gb.hram_io[IO_IF] & ie) != 0)
+		{
+			printf("%s: hit %u stopped before the interrupt\n",
+					name, hits);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Checks that gb_run_until() stops on each line given to gb_set_stop_ly(),
+ * once per frame.
+ */
+static int test_ly(void)
+{
+	static const uint8_t code[] = {
+		0x18, 0xFE			/* JR to itself */
+	};
+	static const uint8_t lines[] = { 100, 0, 153, 100 };
+	static struct gb_s gb;
+	unsigned i;
+
+	make_code(code, sizeof(code));
+	if(start("LY", &gb))
+		return 1;
+
+	for(i = 0; i < sizeof(lines); i++)
+	{
+		enum gb_stop_reason_e reason;
+
+		gb_set_stop_ly(&gb, lines[i]);
+		reason = gb_run_until(&gb, GB_STOP_ON_LY, FRAME_CYCLES);
+
+		if(reason != GB_STOP_LY || gb.hram_io[IO_LY] != lines[i])
+		{
+			printf("LY: line %u stopped with reason %d at line %u\n",
+					lines[i], reason, gb.hram_io[IO_LY]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Checks that gb_run_until() stops at the start of each VBlank, once per
+ * frame.
+ */
+static int test_vblank(void)
+{
+	static const uint8_t code[] = {
+		0x18, 0xFE			/* JR to itself */
+	};
+	static struct gb_s gb;
+	uint64_t last = 0;
+	unsigned hits;
+
+	make_code(code, sizeof(code));
+	if(start("VBlank", &gb))
+		return 1;
+
+	for(hits = 0; hits < 3; hits++)
+	{
+		enum gb_stop_reason_e reason;
+		uint64_t now;
+
+		reason = gb_run_until(&gb, GB_STOP_ON_VBLANK, 2 * FRAME_CYCLES);
+		now = gb_get_cycles(&gb);
+
+		if(reason != GB_STOP_VBLANK ||
+				gb.hram_io[IO_LY] != LCD_HEIGHT ||
+				(gb.hram_io[IO_STAT] & STAT_MODE) !=
+					IO_STAT_MODE_VBLANK)
+		{
+			printf("VBlank: hit %u stopped with reason %d at line "
+					"%u\n", hits, reason, gb.hram_io[IO_LY]);
+			return 1;
+		}
+
+		/* Every VBlank after the first is a frame later. */
+		if(hits > 0 && now - last != FRAME_CYCLES)
+		{
+			printf("VBlank: hit %u was %lu cycles after the last\n",
+					hits, (unsigned long)(now - last));
+			return 1;
+		}
+
+		last = now;
+	}
+
+	return 0;
+}
+
+/**
+ * Checks that gb_run_until() stops when a serial transfer with the internal
+ * clock completes, with nothing connected.
+ */
+static int test_serial(void)
+{
+	static const uint8_t code[] = {
+		0x3E, 0x55,			/* LD A, 0x55 */
+		0xE0, 0x01,			/* LDH (SB), A */
+		0x3E, 0x81,			/* LD A, 0x81 */
+		0xE0, 0x02,			/* LDH (SC), A */
+		0x18, 0xFE			/* JR to itself */
+	};
+	static struct gb_s gb;
+	enum gb_stop_reason_e reason;
+
+	make_code(code, sizeof(code));
+	if(start("Serial", &gb))
+		return 1;
+
+	reason = gb_run_until(&gb, GB_STOP_ON_SERIAL, FRAME_CYCLES);
+
+	/* Bits shifted in from nothing are all 1. */
+	if(reason != GB_STOP_SERIAL || gb.hram_io[IO_SB] != 0xFF ||
+			(gb.hram_io[IO_SC] & SERIAL_SC_TX_START) != 0)
+	{
+		printf("Serial: stopped with reason %d, SB 0x%02X, SC 0x%02X\n",
+				reason, gb.hram_io[IO_SB], gb.hram_io[IO_SC]);
+		return 1;
+	}
+
+	/* No other transfer is started. */
+	reason = gb_run_until(&gb, GB_STOP_ON_SERIAL, FRAME_CYCLES);
+	if(reason != GB_STOP_CYCLES)
+	{
+		printf("Serial: stopped again with reason %d\n", reason);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Checks that gb_run_until() stops after each instruction that reads the
+ * joypad register.
+ */
+static int test_joypad_read(void)
+{
+	static const uint8_t code[] = {
+		0x00,				/* NOP */
+		0xF0, 0x00,			/* LDH A, (P1) */
+		0x18, 0xFB			/* JR to NOP */
+	};
+	static struct gb_s gb;
+	unsigned hits;
+
+	make_code(code, sizeof(code));
+	if(start("Joypad read", &gb))
+		return 1;
+
+	for(hits = 0; hits < 3; hits++)
+	{
+		enum gb_stop_reason_e reason;
+
+		reason = gb_run_until(&gb, GB_STOP_ON_JOYPAD_READ, FRAME_CYCLES);
+
+		if(reason != GB_STOP_JOYPAD_READ ||
+				gb.cpu_reg.pc.reg != 0x0153)
+		{
+			printf("Joypad read: hit %u stopped with reason %d at "
+					"0x%04X\n", hits, reason, gb.cpu_reg.pc.reg);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Checks that gb_run_until() stops at an invalid opcode, leaving PC at it,
+ * instead of calling the error callback, which would exit.
+ */
+static int test_invalid_opcode(void)
+{
+	static const uint8_t code[] = {
+		0x00,				/* NOP */
+		0xD3				/* Invalid */
+	};
+	static struct gb_s gb;
+	unsigned hits;
+
+	make_code(code, sizeof(code));
+	if(start("Invalid opcode", &gb))
+		return 1;
+
+	/* Calling it again stops at the same opcode. */
+	for(hits = 0; hits < 2; hits++)
+	{
+		enum gb_stop_reason_e reason;
+
+		reason = gb_run_until(&gb, GB_STOP_ON_INVALID_OPCODE,
+				FRAME_CYCLES);
+
+		if(reason != GB_STOP_INVALID_OPCODE ||
+				gb.cpu_reg.pc.reg != 0x0151)
+		{
+			printf("Invalid opcode: hit %u stopped with reason %d "
+					"at 0x%04X\n", hits, reason,
+					gb.cpu_reg.pc.reg);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	/* Wait with NOP or HALT. */
+	static const uint8_t busy[] = { 0x00 };
+	static const uint8_t halt[] = { 0x76 };
+	int failed = 0;
+
+	failed += test_vector("VBlank", VBLANK_INTR, 0x00, VBLANK_INTR_ADDR,
+			busy, sizeof(busy));
+	failed += test_vector("VBlank in HALT", VBLANK_INTR, 0x00,
+			VBLANK_INTR_ADDR, halt, sizeof(halt));
+	/* Timer at 262144 Hz, which overflows every 4096 cycles. */
+	failed += test_vector("Timer", TIMER_INTR, 0x05, TIMER_INTR_ADDR,
+			busy, sizeof(busy));
+	failed += test_vector("Timer in HALT", TIMER_INTR, 0x05,
+			TIMER_INTR_ADDR, halt, sizeof(halt));
+	failed += test_ly();
+	failed += test_vblank();
+	failed += test_serial();
+	failed += test_joypad_read();
+	failed += test_invalid_opcode();
+
+	if(failed)
+	{
+		printf("%d tests failed\n", failed);
+		return EXIT_FAILURE;
+	}
+
+	printf("All tests passed\n");
+	return EXIT_SUCCESS;
+}